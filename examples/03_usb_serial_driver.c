@@ -17,252 +17,1500 @@
 #include <linux/usb.h>
 #include <linux/usb/serial.h>
 #include <linux/serial.h>
-#include <linux/kfifo.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include <linux/timex.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/idr.h>
 
 /* 定义厂商ID和产品ID（示例：FTDI芯片）*/
 #define VENDOR_ID  0x0403
 #define PRODUCT_ID 0x6001
+#define PRODUCT_ID_2232H 0x6010     /* FT2232C/D/H，两个接口 */
+#define PRODUCT_ID_232H  0x6014
 
-/* 缓冲区大小 */
-#define SERIAL_BUF_SIZE  256
+/*
+ * FTDI SIO厂商请求。芯片攒满一个包或等到延迟定时器超时才把接收到的
+ * 数据发给主机，定时器默认16ms；收到事件字符时立即发送
+ */
+#define FTDI_SIO_SET_MODEM_CTRL     0x01
+#define FTDI_SIO_SET_FLOW_CTRL      0x02
+#define FTDI_SIO_SET_BAUD_RATE      0x03
+#define FTDI_SIO_SET_DATA           0x04
+#define FTDI_SIO_SET_EVENT_CHAR     0x06
+#define FTDI_SIO_SET_LATENCY_TIMER  0x09
+#define FTDI_SIO_REQTYPE_OUT        (USB_TYPE_VENDOR | USB_DIR_OUT)
+#define FTDI_LATENCY_LOW            1        /* ASYNC_LOW_LATENCY时用的延迟 */
+#define FTDI_BAUD_BASE              3000000
+#define FTDI_BAUD_MIN               183
+#define FTDI_BAUD_MAX               3000000
+#define FTDI_HS_BAUD_MIN            1200     /* H系列芯片关掉2.5分频后的下限 */
+#define FTDI_HS_BAUD_MAX            12000000
+
+/* SET_MODEM_CTRL：低字节是电平，高字节选择要改的线 */
+#define FTDI_MCR_DTR                BIT(0)
+#define FTDI_MCR_RTS                BIT(1)
+#define FTDI_MCR_MASK_SHIFT         8
+
+/* SET_FLOW_CTRL的wIndex高字节 */
+#define FTDI_FLOW_NONE              0
+#define FTDI_FLOW_RTS_CTS           (0x1 << 8)
+
+/* SET_DATA：低字节数据位，8到10位校验，11到13位停止位，14位break */
+#define FTDI_DATA_PARITY_ODD        (1 << 8)
+#define FTDI_DATA_PARITY_EVEN       (2 << 8)
+#define FTDI_DATA_PARITY_MARK       (3 << 8)
+#define FTDI_DATA_PARITY_SPACE      (4 << 8)
+#define FTDI_DATA_STOP_BITS_2       (2 << 11)
+#define FTDI_DATA_BREAK             BIT(14)
+#define FTDI_EVENT_CHAR_OFF         -1
+
+/* 每个批量输入包前的2字节状态头：modem状态和线路状态 */
+#define FTDI_STATUS_SIZE  2
+#define FTDI_RS0_CTS      0x10
+#define FTDI_RS0_DSR      0x20
+#define FTDI_RS0_RI       0x40
+#define FTDI_RS0_RLSD     0x80
+#define FTDI_RS0_MSR_MASK 0xf0
+#define FTDI_RS_OE        0x02
+#define FTDI_RS_PE        0x04
+#define FTDI_RS_FE        0x08
+#define FTDI_RS_BI        0x10
+#define FTDI_RS_ERR_MASK  (FTDI_RS_OE | FTDI_RS_PE | FTDI_RS_FE | FTDI_RS_BI)
+
+/* usb_device_id.driver_info */
+#define SERIAL_FTDI_SIO   BIT(0)
+
+/* ttyUSB次设备号个数，每个接口动态分配一个 */
+#define SERIAL_TTY_MINORS  512
+
+/* 发送环形缓冲区大小的范围，实际大小按波特率和tx_latency_ms取2的幂 */
+#define SERIAL_TX_RING_MIN  256
+#define SERIAL_TX_RING_MAX  (1024 * 1024)
+
+/* 接收：多个读URB轮流在端点上排队，一个完成时其他的继续接收 */
+#define SERIAL_RX_URBS_MAX  16
+#define SERIAL_RX_SIZE_MAX  65536
+
+static unsigned int rx_urbs = 4;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs, "同时提交的读URB数（1到16，默认4）");
+
+static unsigned int rx_size = 4096;
+module_param(rx_size, uint, 0444);
+MODULE_PARM_DESC(rx_size, "每个读URB的缓冲区大小（字节，按wMaxPacketSize取整，默认4096）");
 
-/* 串口私有数据 */
+/* 发送：多个写URB同时在端点上排队，完成回调里直接从FIFO补充 */
+#define SERIAL_TX_URBS_MAX  16
+#define SERIAL_TX_SIZE_MAX  65536
+
+static unsigned int tx_urbs = 4;
+module_param(tx_urbs, uint, 0444);
+MODULE_PARM_DESC(tx_urbs, "同时提交的写URB数（1到16，默认4）");
+
+static unsigned int tx_size = 4096;
+module_param(tx_size, uint, 0444);
+MODULE_PARM_DESC(tx_size, "每个写URB的缓冲区大小（字节，按wMaxPacketSize取整，默认4096）");
+
+static bool tx_zlp = true;
+module_param(tx_zlp, bool, 0644);
+MODULE_PARM_DESC(tx_zlp, "写URB长度是wMaxPacketSize的整数倍时补发零长度包（默认开）");
+
+static unsigned int tx_latency_ms = 20;
+module_param(tx_latency_ms, uint, 0644);
+MODULE_PARM_DESC(tx_latency_ms, "发送环按当前波特率能缓冲的时间（毫秒，1到1000，默认20，下次打开生效）");
+
+/* 只有需要睡眠的发送错误恢复（清除端点STALL）才放到这里 */
+static struct workqueue_struct *serial_wq;
+
+static unsigned int ftdi_latency = 16;
+module_param(ftdi_latency, uint, 0644);
+MODULE_PARM_DESC(ftdi_latency, "FTDI延迟定时器的默认值（毫秒，1到255，默认16），每个端口可在sysfs里改");
+
+struct usb_serial_private;
+
+/*
+ * 单生产者单消费者的发送环。生产者是tty写路径：普通写入、
+ * tty_send_xchar和n_tty的回显可能同时调用->write，写者之间用
+ * tx_put_lock串行化；消费者是补充写URB的路径，只有拿到tx_lock的
+ * 一方才能消费。head只由生产者写，tail只由消费者写，生产者和
+ * 消费者之间不需要锁
+ */
+struct serial_tx_ring {
+    unsigned char *buf;
+    unsigned int size;             /* 2的幂 */
+    unsigned int head;             /* 下一个写入位置，生产者发布 */
+    unsigned int tail;             /* 下一个读出位置，消费者发布 */
+};
+
+/* tx_flags的位 */
+#define SERIAL_TX_HALTED  0        /* 端点STALL或端口关闭，不再提交 */
+#define SERIAL_TX_WAKE    1        /* 写者被高水位挡住，等低水位唤醒 */
+
+/* 一个读URB和它还没交给tty层的数据 */
+struct serial_rx_buf {
+    struct usb_serial_private *priv;
+    struct urb *urb;
+    unsigned int len;              /* 去掉状态头后的数据长度 */
+    unsigned int offset;           /* 已交给tty层的字节数 */
+    unsigned char *flags;          /* FTDI：每个字符的TTY_*标志 */
+    bool has_flags;                /* 这次有线路错误，要按flags插入 */
+    struct list_head node;         /* 挂在priv->rx_done上 */
+};
+
+/*
+ * 串口私有数据，每个接口一个。生命周期由port的引用计数管理：probe
+ * 持有一个，每个打开它的tty在install时再拿一个，最后一个放掉时
+ * serial_port_destruct释放
+ */
 struct usb_serial_private {
-    spinlock_t lock;
+    struct tty_port port;
+    unsigned int minor;
+    bool disconnected;             /* 受serial_minors_lock保护 */
+    
+    /* FTDI芯片设置，受cfg_mutex保护 */
+    bool ftdi;
+    bool ftdi_hispeed;             /* H系列芯片，波特率可到12M */
+    u16 ftdi_index;                /* 控制请求的wIndex，单口芯片是0 */
+    u16 data_value;                /* 最近一次SET_DATA的值，break时要带上 */
+    u8 mcr;                        /* 当前的DTR/RTS */
+    struct mutex cfg_mutex;
+    u8 latency_timer;              /* sysfs设置的延迟定时器 */
+    int event_char;                /* FTDI_EVENT_CHAR_OFF或0到255 */
+    bool low_latency;              /* ASYNC_LOW_LATENCY，延迟固定为1ms */
+    
+    /* 状态头里的modem状态和计数，受rx_lock保护 */
+    u8 msr;
+    struct async_icount icount;
     struct usb_device *udev;
     struct usb_interface *interface;
-    struct tty_struct *tty;
-    struct urb *read_urb;
-    struct urb *write_urb;
-    unsigned char *bulk_in_buffer;
-    unsigned char *bulk_out_buffer;
-    size_t bulk_in_size;
-    size_t bulk_out_size;
+    struct serial_rx_buf rx_bufs[SERIAL_RX_URBS_MAX];
+    unsigned int num_read_urbs;
+    spinlock_t rx_lock;            /* 保护rx_done、rx_parked和两个标志 */
+    struct list_head rx_done;      /* 已完成、等待交给tty层的读URB，按完成顺序 */
+    struct list_head rx_parked;    /* 节流期间交完数据、暂不提交的读URB */
+    bool rx_stopped;               /* 端口关闭，不再重新提交 */
+    bool rx_throttled;             /* tty层节流，读URB交完数据后不重新提交 */
+    struct delayed_work rx_work;   /* tty缓冲区满时稍后重试 */
+    struct urb *write_urbs[SERIAL_TX_URBS_MAX];
+    unsigned int num_write_urbs;
+    unsigned long tx_free;         /* 空闲写URB的位图，原子位操作 */
+    unsigned long tx_flags;        /* SERIAL_TX_* */
+    spinlock_t tx_put_lock;        /* 串行化发送环的生产者 */
+    spinlock_t tx_lock;            /* 消费发送环的一方持有，补充路径只trylock */
+    struct serial_tx_ring tx_ring;
+    unsigned int tx_high;          /* 高水位：占用到这里就不再接受写入 */
+    unsigned int tx_low;           /* 低水位：被挡住的写者在这里唤醒 */
+    speed_t tx_baud;               /* 发送环大小对应的波特率 */
+    size_t bulk_in_size;           /* 每个读URB的缓冲区大小 */
+    size_t bulk_in_maxp;
+    size_t bulk_out_size;          /* 每个写URB的缓冲区大小 */
+    size_t bulk_out_maxp;
     __u8 bulk_in_endpointAddr;
     __u8 bulk_out_endpointAddr;
-    struct kfifo write_fifo;
     struct work_struct work;
-    int open_count;
-    struct mutex mutex;
+    
+    /* 接收统计 */
+    atomic_t rx_inflight;          /* 已提交还没完成的读URB数 */
+    atomic64_t rx_idle_since;      /* 读URB全部完成的时间（ns），0表示端点上有URB */
+    atomic64_t rx_bytes;           /* 收到的字节数 */
+    atomic64_t rx_completions;     /* 读URB完成次数 */
+    atomic64_t rx_stalls;          /* tty缓冲区满、暂停接收的次数 */
+    atomic64_t rx_throttles;       /* tty层节流的次数 */
+    atomic64_t rx_cycles;          /* 插入tty缓冲区用的CPU周期 */
+    atomic64_t rx_insert_bytes;    /* 插入tty缓冲区的字节数 */
+    atomic64_t rx_idle_gaps;       /* 端点上没有读URB的次数 */
+    atomic64_t rx_idle_ns;         /* 端点上没有读URB的总时间 */
+    atomic64_t rx_errors;          /* 读URB出错次数 */
+    
+    /* 发送统计 */
+    atomic64_t tx_bytes;           /* 发出的字节数 */
+    atomic64_t tx_completions;     /* 写URB完成次数 */
+    atomic64_t tx_zlps;            /* 补发零长度包的次数 */
+    atomic64_t tx_errors;          /* 写URB出错次数 */
+    atomic64_t tx_halts;           /* 端点STALL的次数 */
+    unsigned int tx_inflight_max;  /* 同时在端点上的写URB数峰值，只由消费者写 */
+    unsigned int tx_ring_peak;     /* 发送环占用峰值，受tx_put_lock保护 */
+    atomic64_t tx_ring_full;       /* 写入时超过高水位的次数 */
+    atomic64_t tx_wakeups;         /* 低水位唤醒写者的次数 */
+    atomic64_t tx_irqoff_ns;       /* 写完成回调关中断运行的总时间 */
+    atomic64_t tx_irqoff_max_ns;   /* 单次写完成回调关中断运行的最长时间 */
+    atomic64_t tx_irqoff_samples;  /* 关中断运行的写完成回调次数 */
 };
 
 /* 前向声明 */
 static struct usb_driver usb_serial_driver;
 static struct tty_driver *serial_tty_driver;
 
-/* 读URB完成处理 */
-static void serial_read_bulk_callback(struct urb *urb)
+/* 次设备号到串口的映射，install时按tty->index直接查找 */
+static DEFINE_IDR(serial_minors);
+static DEFINE_MUTEX(serial_minors_lock);
+
+static void serial_read_bulk_callback(struct urb *urb);
+static void serial_set_termios(struct tty_struct *tty,
+                               const struct ktermios *old);
+
+/*
+ * 提交一个读URB。所有读URB都完成过之后端点是空闲的，这段时间设备
+ * 发来的数据只能堆在芯片的FIFO里，高波特率下会溢出，计入空闲统计
+ */
+static int serial_submit_read_urb(struct usb_serial_private *priv,
+                                  struct urb *urb, gfp_t mem_flags)
+{
+    u64 idle;
+    int result;
+    
+    if (atomic_inc_return(&priv->rx_inflight) == 1) {
+        idle = atomic64_xchg(&priv->rx_idle_since, 0);
+        if (idle) {
+            atomic64_inc(&priv->rx_idle_gaps);
+            atomic64_add(ktime_get_ns() - idle, &priv->rx_idle_ns);
+        }
+    }
+    
+    result = usb_submit_urb(urb, mem_flags);
+    if (result)
+        atomic_dec(&priv->rx_inflight);
+    
+    return result;
+}
+
+/*
+ * 把一段数据交给tty层，返回接受的字节数。用tty_insert_flip_string
+ * 一次复制，有线路错误时带上每个字符的标志
+ */
+static int serial_rx_insert(struct tty_port *port, const unsigned char *data,
+                            const unsigned char *flags, int len)
+{
+    if (flags)
+        return tty_insert_flip_string_flags(port, data, flags, len);
+    return tty_insert_flip_string(port, data, len);
+}
+
+/*
+ * 按完成顺序把读URB的数据交给tty层，交完的URB重新提交。tty缓冲区
+ * 满时剩下的数据留在URB里，稍后从断点继续；这期间URB不重新提交，
+ * 设备的数据留在芯片里，不会在驱动里丢掉。节流时已经收到的数据照样
+ * 交出去，只是URB不再提交，端点上没有读请求，芯片FIFO满了以后由
+ * RTS/CTS挡住对端
+ */
+static void serial_rx_deliver(struct usb_serial_private *priv)
+{
+    struct serial_rx_buf *rb;
+    unsigned long flags;
+    bool pushed = false;
+    bool stalled = false;
+    cycles_t start;
+    int len, n;
+    int result;
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    while (!priv->rx_stopped && !list_empty(&priv->rx_done)) {
+        rb = list_first_entry(&priv->rx_done, struct serial_rx_buf, node);
+        len = rb->len - rb->offset;
+        
+        if (len) {
+            start = get_cycles();
+            n = serial_rx_insert(&priv->port,
+                                 (unsigned char *)rb->urb->transfer_buffer +
+                                 rb->offset,
+                                 rb->has_flags ? rb->flags + rb->offset : NULL,
+                                 len);
+            atomic64_add(get_cycles() - start, &priv->rx_cycles);
+            atomic64_add(n, &priv->rx_insert_bytes);
+            rb->offset += n;
+            pushed |= n > 0;
+            if (n < len) {
+                stalled = true;
+                break;
+            }
+        }
+        
+        if (priv->rx_throttled) {
+            list_move_tail(&rb->node, &priv->rx_parked);
+            continue;
+        }
+        
+        list_del(&rb->node);
+        result = serial_submit_read_urb(priv, rb->urb, GFP_ATOMIC);
+        if (result)
+            dev_err(&priv->interface->dev,
+                    "重新提交读URB失败: %d\n", result);
+    }
+    if (stalled) {
+        atomic64_inc(&priv->rx_stalls);
+        schedule_delayed_work(&priv->rx_work, 1);
+    }
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    
+    if (pushed)
+        tty_flip_buffer_push(&priv->port);
+}
+
+/* tty缓冲区满后重试 */
+static void serial_rx_work(struct work_struct *work)
+{
+    struct usb_serial_private *priv =
+        container_of(work, struct usb_serial_private, rx_work.work);
+    
+    serial_rx_deliver(priv);
+}
+
+/* 打开端口时提交所有读URB，失败时取消已提交的 */
+static int serial_start_read(struct usb_serial_private *priv)
+{
+    unsigned long flags;
+    int result;
+    int i;
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    INIT_LIST_HEAD(&priv->rx_done);
+    INIT_LIST_HEAD(&priv->rx_parked);
+    priv->rx_stopped = false;
+    priv->rx_throttled = false;
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    
+    atomic64_set(&priv->rx_idle_since, 0);
+    for (i = 0; i < priv->num_read_urbs; i++) {
+        result = serial_submit_read_urb(priv, priv->rx_bufs[i].urb,
+                                        GFP_KERNEL);
+        if (result) {
+            dev_err(&priv->interface->dev,
+                    "提交读URB失败: %d\n", result);
+            while (--i >= 0)
+                usb_kill_urb(priv->rx_bufs[i].urb);
+            return result;
+        }
+    }
+    
+    return 0;
+}
+
+/* 取消所有读URB，丢弃还没交给tty层的数据 */
+static void serial_stop_read(struct usb_serial_private *priv)
+{
+    unsigned long flags;
+    int i;
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    priv->rx_stopped = true;
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    
+    cancel_delayed_work_sync(&priv->rx_work);
+    for (i = 0; i < priv->num_read_urbs; i++)
+        usb_kill_urb(priv->rx_bufs[i].urb);
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    INIT_LIST_HEAD(&priv->rx_done);
+    INIT_LIST_HEAD(&priv->rx_parked);
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+}
+
+/*
+ * modem状态变化时计数并唤醒TIOCMIWAIT的等待者。DCD的处理和
+ * usb_serial_handle_dcd_change一样：变化时唤醒等载波的打开，没有
+ * CLOCAL时掉线挂断tty。调用者持有rx_lock
+ */
+static void serial_ftdi_msr(struct usb_serial_private *priv, u8 msr)
+{
+    u8 delta = msr ^ priv->msr;
+    
+    if (!delta)
+        return;
+    
+    if (delta & FTDI_RS0_CTS)
+        priv->icount.cts++;
+    if (delta & FTDI_RS0_DSR)
+        priv->icount.dsr++;
+    if (delta & FTDI_RS0_RI)
+        priv->icount.rng++;
+    if (delta & FTDI_RS0_RLSD)
+        priv->icount.dcd++;
+    WRITE_ONCE(priv->msr, msr);
+    
+    wake_up_interruptible(&priv->port.delta_msr_wait);
+    
+    if (delta & FTDI_RS0_RLSD) {
+        if (msr & FTDI_RS0_RLSD)
+            wake_up_interruptible(&priv->port.open_wait);
+        else
+            tty_port_tty_hangup(&priv->port, true);
+    }
+}
+
+/*
+ * FTDI芯片在每个最大包前加2字节状态头。去掉状态头，把数据原地压紧
+ * 成连续的一段；有线路错误的包给其中的字符打上标志，芯片FIFO溢出时
+ * 补一个带TTY_OVERRUN的0字符。去掉的状态头总能容纳补上的字符。
+ * 调用者持有rx_lock
+ */
+static void serial_ftdi_process(struct usb_serial_private *priv,
+                                struct serial_rx_buf *rb)
+{
+    unsigned char *data = rb->urb->transfer_buffer;
+    unsigned int total = rb->urb->actual_length;
+    unsigned int maxp = priv->bulk_in_maxp;
+    unsigned int pos, plen;
+    unsigned int out = 0;
+    u8 lsr;
+    char flag;
+    
+    rb->has_flags = false;
+    for (pos = 0; pos + FTDI_STATUS_SIZE <= total; pos += maxp) {
+        plen = min(maxp, total - pos) - FTDI_STATUS_SIZE;
+        serial_ftdi_msr(priv, data[pos] & FTDI_RS0_MSR_MASK);
+        lsr = data[pos + 1];
+        
+        /* break优先，其次是奇偶校验和帧错误，和8250的处理顺序一样 */
+        flag = TTY_NORMAL;
+        if (lsr & FTDI_RS_BI) {
+            flag = TTY_BREAK;
+            priv->icount.brk++;
+        } else if (lsr & FTDI_RS_PE) {
+            flag = TTY_PARITY;
+            priv->icount.parity++;
+        } else if (lsr & FTDI_RS_FE) {
+            flag = TTY_FRAME;
+            priv->icount.frame++;
+        }
+        if (lsr & FTDI_RS_OE)
+            priv->icount.overrun++;
+        
+        if ((lsr & FTDI_RS_ERR_MASK) && !rb->has_flags) {
+            memset(rb->flags, TTY_NORMAL, out);
+            rb->has_flags = true;
+        }
+        
+        memmove(data + out, data + pos + FTDI_STATUS_SIZE, plen);
+        if (rb->has_flags)
+            memset(rb->flags + out, flag, plen);
+        out += plen;
+        
+        /* 没有数据的break包也要让tty层看到 */
+        if (!plen && flag != TTY_NORMAL) {
+            data[out] = 0;
+            rb->flags[out++] = flag;
+        }
+        if (lsr & FTDI_RS_OE) {
+            data[out] = 0;
+            rb->flags[out++] = TTY_OVERRUN;
+        }
+    }
+    rb->len = out;
+}
+
+/*
+ * 读URB完成处理。同一个端点上的URB按提交顺序完成，挂到rx_done队尾
+ * 后按顺序交给tty层
+ */
+static void serial_read_bulk_callback(struct urb *urb)
+{
+    struct serial_rx_buf *rb = urb->context;
+    struct usb_serial_private *priv = rb->priv;
+    int status = urb->status;
+    unsigned long flags;
+    
+    if (atomic_dec_and_test(&priv->rx_inflight))
+        atomic64_set(&priv->rx_idle_since, ktime_get_ns());
+    
+    /* 检查状态 */
+    if (status) {
+        if (status == -ENOENT ||
+            status == -ECONNRESET ||
+            status == -ESHUTDOWN) {
+            /* URB被终止 */
+            return;
+        }
+        atomic64_inc(&priv->rx_errors);
+        dev_err(&priv->interface->dev,
+                "读URB错误: %d\n", status);
+    }
+    
+    atomic64_inc(&priv->rx_completions);
+    atomic64_add(urb->actual_length, &priv->rx_bytes);
+    
+    /* 出错的URB不交数据，但仍按顺序排队后重新提交 */
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    rb->offset = 0;
+    rb->has_flags = false;
+    if (status)
+        rb->len = 0;
+    else if (priv->ftdi)
+        serial_ftdi_process(priv, rb);
+    else
+        rb->len = urb->actual_length;
+    list_add_tail(&rb->node, &priv->rx_done);
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    
+    serial_rx_deliver(priv);
+}
+
+/* 发送环中的字节数 */
+static unsigned int serial_tx_ring_used(struct serial_tx_ring *ring)
+{
+    return READ_ONCE(ring->head) - READ_ONCE(ring->tail);
+}
+
+/*
+ * 生产者：写入最多count字节。先用acquire读tail，保证消费者读完的
+ * 空间才会被覆盖；数据复制完再用release发布head
+ */
+static unsigned int serial_tx_ring_put(struct serial_tx_ring *ring,
+                                       const unsigned char *buf,
+                                       unsigned int count)
+{
+    unsigned int head = ring->head;
+    unsigned int tail = smp_load_acquire(&ring->tail);
+    unsigned int off = head & (ring->size - 1);
+    unsigned int n;
+    
+    count = min(count, ring->size - (head - tail));
+    n = min(count, ring->size - off);
+    memcpy(ring->buf + off, buf, n);
+    memcpy(ring->buf, buf + n, count - n);
+    
+    smp_store_release(&ring->head, head + count);
+    return count;
+}
+
+/*
+ * 消费者：取出最多count字节。acquire读head后才能看到生产者写入的
+ * 数据，复制完用release发布tail把空间还给生产者
+ */
+static unsigned int serial_tx_ring_get(struct serial_tx_ring *ring,
+                                       unsigned char *buf,
+                                       unsigned int count)
+{
+    unsigned int tail = ring->tail;
+    unsigned int head = smp_load_acquire(&ring->head);
+    unsigned int off = tail & (ring->size - 1);
+    unsigned int n;
+    
+    count = min(count, head - tail);
+    n = min(count, ring->size - off);
+    memcpy(buf, ring->buf + off, n);
+    memcpy(buf + n, ring->buf, count - n);
+    
+    smp_store_release(&ring->tail, tail + count);
+    return count;
+}
+
+/*
+ * 按波特率重新分配发送环，让它刚好能缓冲tx_latency_ms的数据：9600的
+ * 控制台只要最小的256字节，几Mbaud的链路才用到几十KB。至少能装满两个
+ * 写URB。端口打开时也可以调用：拿到生产者和消费者的锁后把环里剩下
+ * 的数据搬到新环；放不下的话这次先不缩小，tx_baud不变，下次
+ * set_termios再试。会睡眠
+ */
+static int serial_tx_ring_resize(struct usb_serial_private *priv, speed_t baud)
+{
+    struct serial_tx_ring *ring = &priv->tx_ring;
+    unsigned int latency = clamp(READ_ONCE(tx_latency_ms), 1U, 1000U);
+    unsigned long bytes, flags;
+    unsigned int used;
+    unsigned char *buf, *old;
+    
+    bytes = (unsigned long)baud / 10 * latency / 1000;
+    bytes = max_t(unsigned long, bytes, 2 * priv->bulk_out_size);
+    bytes = clamp_t(unsigned long, bytes, SERIAL_TX_RING_MIN, SERIAL_TX_RING_MAX);
+    bytes = roundup_pow_of_two(bytes);
+    
+    if (bytes == ring->size) {
+        priv->tx_baud = baud;
+        return 0;
+    }
+    
+    buf = kvmalloc(bytes, GFP_KERNEL);
+    if (!buf) {
+        /* 保留原来的环，只是不够理想 */
+        if (ring->buf)
+            return 0;
+        return -ENOMEM;
+    }
+    
+    /*
+     * 写者和补充写URB的路径都只做很短的复制，等它们退出。完成回调
+     * 只trylock，拿不到时直接返回，换完环后由调用者重新补充
+     */
+    spin_lock_irqsave(&priv->tx_put_lock, flags);
+    spin_lock(&priv->tx_lock);
+    
+    used = ring->buf ? ring->head - ring->tail : 0;
+    if (used > bytes - bytes / 8) {
+        old = buf;
+    } else {
+        if (used)
+            serial_tx_ring_get(ring, buf, used);
+        old = ring->buf;
+        ring->buf = buf;
+        ring->size = bytes;
+        ring->tail = 0;
+        ring->head = used;
+        priv->tx_high = bytes - bytes / 8;
+        priv->tx_low = bytes / 4;
+        priv->tx_baud = baud;
+    }
+    
+    spin_unlock(&priv->tx_lock);
+    spin_unlock_irqrestore(&priv->tx_put_lock, flags);
+    
+    kvfree(old);
+    return 0;
+}
+
+/* 写者现在能写入的字节数，被挡住后要等到低水位才重新给空间 */
+static unsigned int serial_tx_room(struct usb_serial_private *priv)
+{
+    unsigned int used = serial_tx_ring_used(&priv->tx_ring);
+    
+    if (test_bit(SERIAL_TX_WAKE, &priv->tx_flags) || used >= priv->tx_high)
+        return 0;
+    return priv->tx_high - used;
+}
+
+/*
+ * 发送环降到低水位时唤醒被挡住的写者。写者先置SERIAL_TX_WAKE再看
+ * 占用，这里先发布tail再看标志，两边的屏障保证至少一方看到对方
+ */
+static void serial_tx_wake_check(struct usb_serial_private *priv)
+{
+    smp_mb();
+    if (serial_tx_ring_used(&priv->tx_ring) > priv->tx_low)
+        return;
+    if (!test_and_clear_bit(SERIAL_TX_WAKE, &priv->tx_flags))
+        return;
+    
+    atomic64_inc(&priv->tx_wakeups);
+    tty_port_tty_wakeup(&priv->port);
+}
+
+/* 是否还有数据可以提交，释放tx_lock后也会调用，tail要重新读 */
+static bool serial_tx_pending(struct usb_serial_private *priv)
+{
+    return !test_bit(SERIAL_TX_HALTED, &priv->tx_flags) &&
+           READ_ONCE(priv->tx_free) &&
+           smp_load_acquire(&priv->tx_ring.head) !=
+           smp_load_acquire(&priv->tx_ring.tail);
+}
+
+/*
+ * 从发送环取数据填满空闲的写URB并提交。调用者持有tx_lock，
+ * 同一时刻只有一个消费者，数据按环里的顺序排到端点上
+ */
+static void serial_tx_consume(struct usb_serial_private *priv)
+{
+    struct urb *urb;
+    unsigned int inflight;
+    int count;
+    int result;
+    int i;
+    
+    while (serial_tx_pending(priv)) {
+        i = __ffs(READ_ONCE(priv->tx_free));
+        urb = priv->write_urbs[i];
+        
+        count = serial_tx_ring_get(&priv->tx_ring, urb->transfer_buffer,
+                                   priv->bulk_out_size);
+        urb->transfer_buffer_length = count;
+        
+        /* 长度是最大包长整数倍时设备收不到短包，补一个零长度包结束传输 */
+        urb->transfer_flags &= ~URB_ZERO_PACKET;
+        if (READ_ONCE(tx_zlp) && !(count % priv->bulk_out_maxp)) {
+            urb->transfer_flags |= URB_ZERO_PACKET;
+            atomic64_inc(&priv->tx_zlps);
+        }
+        
+        clear_bit(i, &priv->tx_free);
+        result = usb_submit_urb(urb, GFP_ATOMIC);
+        if (result) {
+            set_bit(i, &priv->tx_free);
+            atomic64_inc(&priv->tx_errors);
+            dev_err(&priv->interface->dev,
+                    "提交写URB失败: %d\n", result);
+            break;
+        }
+        
+        inflight = priv->num_write_urbs - hweight_long(READ_ONCE(priv->tx_free));
+        if (inflight > priv->tx_inflight_max)
+            WRITE_ONCE(priv->tx_inflight_max, inflight);
+    }
+}
+
+/*
+ * 补充写URB。没抢到tx_lock说明别人正在消费，它释放后会重新检查；
+ * trylock前和释放后的两个屏障保证新写入的数据或刚空出的URB至少
+ * 被一方看到
+ */
+static void serial_tx_refill(struct usb_serial_private *priv)
+{
+    unsigned long flags;
+    
+    do {
+        smp_mb();
+        if (!spin_trylock_irqsave(&priv->tx_lock, flags))
+            return;
+        serial_tx_consume(priv);
+        spin_unlock_irqrestore(&priv->tx_lock, flags);
+        smp_mb();
+    } while (serial_tx_pending(priv));
+}
+
+/* 写URB的下标 */
+static int serial_tx_index(struct usb_serial_private *priv, struct urb *urb)
+{
+    int i;
+    
+    for (i = 0; i < priv->num_write_urbs; i++) {
+        if (priv->write_urbs[i] == urb)
+            return i;
+    }
+    return -1;
+}
+
+/* 记录一次关中断运行的时间 */
+static void serial_tx_irqoff_account(struct usb_serial_private *priv, u64 ns)
+{
+    s64 max = atomic64_read(&priv->tx_irqoff_max_ns);
+    
+    atomic64_add(ns, &priv->tx_irqoff_ns);
+    atomic64_inc(&priv->tx_irqoff_samples);
+    while ((s64)ns > max) {
+        if (atomic64_try_cmpxchg(&priv->tx_irqoff_max_ns, &max, ns))
+            break;
+    }
+}
+
+/*
+ * 写URB完成处理。在中断上下文里直接补充下一个URB，不经过工作队列，
+ * 端点上一直有数据排队；降到低水位时直接唤醒写者。回调在关中断时
+ * 运行的话统计运行时间
+ */
+static void serial_write_bulk_callback(struct urb *urb)
+{
+    struct usb_serial_private *priv = urb->context;
+    int status = urb->status;
+    bool irqoff = irqs_disabled();
+    u64 start = irqoff ? ktime_get_ns() : 0;
+    
+    set_bit(serial_tx_index(priv, urb), &priv->tx_free);
+    
+    /* 检查状态 */
+    if (status) {
+        if (status == -ENOENT ||
+            status == -ECONNRESET ||
+            status == -ESHUTDOWN) {
+            /* URB被终止 */
+            return;
+        }
+        atomic64_inc(&priv->tx_errors);
+        dev_err(&priv->interface->dev,
+                "写URB错误: %d\n", status);
+        
+        /* 清除STALL要发控制请求，会睡眠，交给工作队列 */
+        if (status == -EPIPE &&
+            !test_and_set_bit(SERIAL_TX_HALTED, &priv->tx_flags)) {
+            atomic64_inc(&priv->tx_halts);
+            queue_work(serial_wq, &priv->work);
+        }
+    } else {
+        atomic64_inc(&priv->tx_completions);
+        atomic64_add(urb->actual_length, &priv->tx_bytes);
+    }
+    
+    serial_tx_refill(priv);
+    serial_tx_wake_check(priv);
+    
+    if (irqoff)
+        serial_tx_irqoff_account(priv, ktime_get_ns() - start);
+}
+
+/* 端点STALL后等在途的写URB结束，清除STALL再继续发送 */
+static void serial_tx_halt_work(struct work_struct *work)
+{
+    struct usb_serial_private *priv = 
+        container_of(work, struct usb_serial_private, work);
+    int result;
+    int i;
+    
+    for (i = 0; i < priv->num_write_urbs; i++)
+        usb_kill_urb(priv->write_urbs[i]);
+    
+    result = usb_clear_halt(priv->udev,
+                            usb_sndbulkpipe(priv->udev,
+                                            priv->bulk_out_endpointAddr));
+    if (result) {
+        dev_err(&priv->interface->dev,
+                "清除写端点STALL失败: %d\n", result);
+        return;
+    }
+    
+    clear_bit(SERIAL_TX_HALTED, &priv->tx_flags);
+    smp_mb__after_atomic();
+    serial_tx_refill(priv);
+}
+
+/*
+ * 取消所有写URB并丢弃发送环里的数据。先置SERIAL_TX_HALTED，完成回调
+ * 不再提交也不再排工作
+ */
+static void serial_stop_write(struct usb_serial_private *priv)
+{
+    int i;
+    
+    set_bit(SERIAL_TX_HALTED, &priv->tx_flags);
+    cancel_work_sync(&priv->work);
+    for (i = 0; i < priv->num_write_urbs; i++)
+        usb_kill_urb(priv->write_urbs[i]);
+    
+    /* 这时没有生产者也没有消费者，丢掉剩余数据 */
+    smp_store_release(&priv->tx_ring.tail, READ_ONCE(priv->tx_ring.head));
+    clear_bit(SERIAL_TX_WAKE, &priv->tx_flags);
+    clear_bit(SERIAL_TX_HALTED, &priv->tx_flags);
+}
+
+/* 释放写URB和它们的缓冲区 */
+static void serial_free_write_urbs(struct usb_serial_private *priv)
+{
+    int i;
+    
+    for (i = 0; i < priv->num_write_urbs; i++) {
+        if (!priv->write_urbs[i])
+            continue;
+        kfree(priv->write_urbs[i]->transfer_buffer);
+        usb_free_urb(priv->write_urbs[i]);
+    }
+}
+
+/* 释放读URB和它们的缓冲区 */
+static void serial_free_read_urbs(struct usb_serial_private *priv)
+{
+    int i;
+    
+    for (i = 0; i < priv->num_read_urbs; i++) {
+        if (!priv->rx_bufs[i].urb)
+            continue;
+        kfree(priv->rx_bufs[i].urb->transfer_buffer);
+        usb_free_urb(priv->rx_bufs[i].urb);
+        kfree(priv->rx_bufs[i].flags);
+    }
+}
+
+/* 发一个FTDI SIO厂商请求，会睡眠 */
+static int serial_ftdi_request_index(struct usb_serial_private *priv,
+                                     u8 request, u16 value, u16 index)
+{
+    int result;
+    
+    result = usb_control_msg(priv->udev, usb_sndctrlpipe(priv->udev, 0),
+                             request, FTDI_SIO_REQTYPE_OUT, value,
+                             index, NULL, 0, USB_CTRL_SET_TIMEOUT);
+    if (result < 0) {
+        dev_err(&priv->interface->dev,
+                "FTDI请求0x%02x失败: %d\n", request, result);
+        return result;
+    }
+    return 0;
+}
+
+static int serial_ftdi_request(struct usb_serial_private *priv, u8 request,
+                               u16 value)
+{
+    return serial_ftdi_request_index(priv, request, value, priv->ftdi_index);
+}
+
+/*
+ * 把延迟定时器和事件字符写进芯片。ASYNC_LOW_LATENCY时延迟用1ms，
+ * 请求/应答式的协议每次来回从16ms降到1ms左右。调用者持有cfg_mutex
+ */
+static int serial_ftdi_apply(struct usb_serial_private *priv)
+{
+    u16 event;
+    int result;
+    
+    if (!priv->ftdi)
+        return 0;
+    
+    result = serial_ftdi_request(priv, FTDI_SIO_SET_LATENCY_TIMER,
+                                 priv->low_latency ? FTDI_LATENCY_LOW :
+                                                     priv->latency_timer);
+    if (result)
+        return result;
+    
+    /* 低8位是字符，第8位使能 */
+    event = priv->event_char == FTDI_EVENT_CHAR_OFF ? 0 :
+            priv->event_char | BIT(8);
+    return serial_ftdi_request(priv, FTDI_SIO_SET_EVENT_CHAR, event);
+}
+
+/* 改DTR/RTS，只发有变化的线。调用者持有cfg_mutex */
+static int serial_ftdi_set_mctrl(struct usb_serial_private *priv,
+                                 u8 set, u8 clear)
+{
+    u8 mcr = (priv->mcr | set) & ~clear;
+    u8 changed = (mcr ^ priv->mcr) & (FTDI_MCR_DTR | FTDI_MCR_RTS);
+    int result;
+    
+    if (!priv->ftdi || !changed)
+        return 0;
+    
+    result = serial_ftdi_request(priv, FTDI_SIO_SET_MODEM_CTRL,
+                                 (changed << FTDI_MCR_MASK_SHIFT) | mcr);
+    if (!result)
+        priv->mcr = mcr;
+    return result;
+}
+
+/*
+ * FTDI波特率分频系数：整数部分加3位小数，小数部分按芯片规定的顺序
+ * 编码。BM/R系列以3MHz为基准；H系列以12MHz为基准并置第17位关掉
+ * 2.5分频，最高12Mbaud，1200以下仍按BM方式计算
+ */
+static u32 serial_ftdi_divisor(struct usb_serial_private *priv, speed_t baud)
+{
+    static const unsigned char divfrac[8] = { 0, 3, 2, 4, 1, 5, 6, 7 };
+    bool hs = priv->ftdi_hispeed && baud >= FTDI_HS_BAUD_MIN;
+    u32 divisor3, divisor;
+    
+    if (hs)
+        divisor3 = DIV_ROUND_CLOSEST(8 * 120000000U, 10 * baud);
+    else
+        divisor3 = DIV_ROUND_CLOSEST(48000000U, 2 * baud);
+    
+    divisor = divisor3 >> 3;
+    divisor |= (u32)divfrac[divisor3 & 7] << 14;
+    
+    /* 1.0和1.5是特殊编码 */
+    if (divisor == 1)
+        divisor = 0;
+    else if (divisor == 0x4001)
+        divisor = 1;
+    
+    if (hs)
+        divisor |= BIT(17);
+    return divisor;
+}
+
+/* 设置波特率，分频系数的高位放在wIndex里。调用者持有cfg_mutex */
+static int serial_ftdi_set_baud(struct usb_serial_private *priv, speed_t baud)
+{
+    u32 divisor = serial_ftdi_divisor(priv, baud);
+    u16 index = divisor >> 16;
+    
+    if (priv->ftdi_hispeed || priv->ftdi_index)
+        index = (index << 8) | priv->ftdi_index;
+    
+    return serial_ftdi_request_index(priv, FTDI_SIO_SET_BAUD_RATE,
+                                     divisor & 0xffff, index);
+}
+
+/*
+ * 按次设备号找到串口并拿一个引用，tty释放时在serial_cleanup里放掉。
+ * 已经断开的接口不能再打开
+ */
+static int serial_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+    struct usb_serial_private *priv;
+    int result;
+    
+    mutex_lock(&serial_minors_lock);
+    priv = idr_find(&serial_minors, tty->index);
+    if (priv && !priv->disconnected)
+        tty_port_get(&priv->port);
+    else
+        priv = NULL;
+    mutex_unlock(&serial_minors_lock);
+    
+    if (!priv)
+        return -ENODEV;
+    
+    result = tty_port_install(&priv->port, driver, tty);
+    if (result) {
+        tty_port_put(&priv->port);
+        return result;
+    }
+    
+    tty->driver_data = priv;
+    return 0;
+}
+
+static void serial_cleanup(struct tty_struct *tty)
 {
-    struct usb_serial_private *priv = urb->context;
-    struct tty_struct *tty;
-    unsigned char *data = urb->transfer_buffer;
-    int status = urb->status;
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    tty->driver_data = NULL;
+    tty_port_put(&priv->port);
+}
+
+/* 第一次打开：配置芯片，按当前波特率调整发送环，再提交所有读URB */
+static int serial_port_activate(struct tty_port *port, struct tty_struct *tty)
+{
+    struct usb_serial_private *priv =
+        container_of(port, struct usb_serial_private, port);
     int result;
-    int i;
     
-    /* 检查状态 */
-    if (status) {
-        if (status == -ENOENT ||
-            status == -ECONNRESET ||
-            status == -ESHUTDOWN) {
-            /* URB被终止 */
-            return;
-        } else {
-            dev_err(&priv->interface->dev,
-                    "读URB错误: %d\n", status);
-            goto resubmit;
-        }
-    }
+    if (READ_ONCE(priv->disconnected))
+        return -ENODEV;
     
-    /* 处理接收到的数据 */
-    tty = priv->tty;
-    if (tty && urb->actual_length) {
-        /* 将数据推送到tty层 */
-        for (i = 0; i < urb->actual_length; i++) {
-            if (!tty_insert_flip_char(&tty->port, data[i], TTY_NORMAL)) {
-                dev_err(&priv->interface->dev, "TTY缓冲区满\n");
-                break;
-            }
-        }
-        tty_flip_buffer_push(&tty->port);
-    }
+    /* 芯片可能复位过，重新写入延迟定时器、事件字符和termios，失败不影响打开 */
+    mutex_lock(&priv->cfg_mutex);
+    serial_ftdi_apply(priv);
+    mutex_unlock(&priv->cfg_mutex);
+    serial_set_termios(tty, NULL);
     
-resubmit:
-    /* 重新提交URB */
-    result = usb_submit_urb(urb, GFP_ATOMIC);
+    result = serial_tx_ring_resize(priv, tty_get_baud_rate(tty));
     if (result)
-        dev_err(&priv->interface->dev,
-                "重新提交读URB失败: %d\n", result);
+        return result;
+    
+    return serial_start_read(priv);
 }
 
-/* 写URB完成处理 */
-static void serial_write_bulk_callback(struct urb *urb)
+/* 最后一次关闭或挂断：停止URB和工作队列 */
+static void serial_port_shutdown(struct tty_port *port)
 {
-    struct usb_serial_private *priv = urb->context;
+    struct usb_serial_private *priv =
+        container_of(port, struct usb_serial_private, port);
+    
+    serial_stop_read(priv);
+    serial_stop_write(priv);
+}
+
+/* 打开时拉高、HUPCL关闭时拉低DTR和RTS */
+static void serial_port_dtr_rts(struct tty_port *port, bool active)
+{
+    struct usb_serial_private *priv =
+        container_of(port, struct usb_serial_private, port);
+    
+    mutex_lock(&priv->cfg_mutex);
+    if (active)
+        serial_ftdi_set_mctrl(priv, FTDI_MCR_DTR | FTDI_MCR_RTS, 0);
+    else
+        serial_ftdi_set_mctrl(priv, 0, FTDI_MCR_DTR | FTDI_MCR_RTS);
+    mutex_unlock(&priv->cfg_mutex);
+}
+
+/* 没有CLOCAL时打开要等DCD */
+static bool serial_port_carrier_raised(struct tty_port *port)
+{
+    struct usb_serial_private *priv =
+        container_of(port, struct usb_serial_private, port);
+    
+    return !priv->ftdi || (READ_ONCE(priv->msr) & FTDI_RS0_RLSD);
+}
+
+/* 最后一个引用放掉时释放URB、缓冲区和私有数据 */
+static void serial_port_destruct(struct tty_port *port)
+{
+    struct usb_serial_private *priv =
+        container_of(port, struct usb_serial_private, port);
+    
+    serial_free_read_urbs(priv);
+    serial_free_write_urbs(priv);
+    kvfree(priv->tx_ring.buf);
+    usb_put_dev(priv->udev);
+    kfree(priv);
+}
+
+static const struct tty_port_operations serial_port_ops = {
+    .carrier_raised = serial_port_carrier_raised,
+    .dtr_rts = serial_port_dtr_rts,
+    .activate = serial_port_activate,
+    .shutdown = serial_port_shutdown,
+    .destruct = serial_port_destruct,
+};
+
+/* TTY打开 */
+static int serial_open(struct tty_struct *tty, struct file *filp)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    return tty_port_open(&priv->port, tty, filp);
+}
+
+/* TTY关闭 */
+static void serial_close(struct tty_struct *tty, struct file *filp)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    tty_port_close(&priv->port, tty, filp);
+}
+
+/* TTY挂断，设备断开时也会走到这里 */
+static void serial_hangup(struct tty_struct *tty)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    tty_port_hangup(&priv->port);
+}
+
+/* TTY写入 */
+static ssize_t serial_write(struct tty_struct *tty, const u8 *buf,
+                            size_t count)
+{
+    struct usb_serial_private *priv = tty->driver_data;
     unsigned long flags;
+    unsigned int used;
+    unsigned int retval;
     
-    /* 检查状态 */
-    if (urb->status) {
-        dev_err(&priv->interface->dev,
-                "写URB错误: %d\n", urb->status);
+    if (!priv)
+        return -ENODEV;
+    
+    /*
+     * 将数据加入发送环，有空闲的写URB就直接提交。超过高水位时挡住
+     * 写者，写完成回调降到低水位后唤醒。xchar和回显可能和普通写入
+     * 同时进来，写者之间要加锁；调整环大小时也拿这把锁
+     */
+    spin_lock_irqsave(&priv->tx_put_lock, flags);
+    retval = serial_tx_ring_put(&priv->tx_ring, buf,
+                                min_t(size_t, count, serial_tx_room(priv)));
+    used = serial_tx_ring_used(&priv->tx_ring);
+    if (used > priv->tx_ring_peak)
+        WRITE_ONCE(priv->tx_ring_peak, used);
+    spin_unlock_irqrestore(&priv->tx_put_lock, flags);
+    
+    if (retval < count) {
+        atomic64_inc(&priv->tx_ring_full);
+        set_bit(SERIAL_TX_WAKE, &priv->tx_flags);
     }
     
-    /* 调度工作队列继续发送 */
-    schedule_work(&priv->work);
+    serial_tx_refill(priv);
+    
+    /* 置标志前环可能已经排空，没有完成回调会再来唤醒 */
+    if (retval < count)
+        serial_tx_wake_check(priv);
+    
+    return retval;
 }
 
-/* 工作队列处理函数 */
-static void serial_send_work(struct work_struct *work)
+/* TTY写入空间 */
+static unsigned int serial_write_room(struct tty_struct *tty)
 {
-    struct usb_serial_private *priv = 
-        container_of(work, struct usb_serial_private, work);
-    unsigned long flags;
-    int count;
-    int result;
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    if (!priv)
+        return 0;
     
-    spin_lock_irqsave(&priv->lock, flags);
+    return serial_tx_room(priv);
+}
+
+/*
+ * 把termios写进芯片：波特率、数据位、校验、停止位和RTS/CTS流控。
+ * 芯片只支持7位和8位数据，其他的按8位处理。发送环按新波特率调整
+ */
+static void serial_set_termios(struct tty_struct *tty,
+                               const struct ktermios *old)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    struct ktermios *termios = &tty->termios;
+    unsigned int cflag;
+    speed_t baud;
+    u16 value;
     
-    /* 检查是否有数据要发送 */
-    if (priv->write_urb->status == -EINPROGRESS) {
-        spin_unlock_irqrestore(&priv->lock, flags);
-        return;
+    baud = tty_get_baud_rate(tty);
+    if (!priv->ftdi)
+        goto resize;
+    
+    if ((termios->c_cflag & CSIZE) != CS7 && (termios->c_cflag & CSIZE) != CS8) {
+        termios->c_cflag &= ~CSIZE;
+        termios->c_cflag |= CS8;
+    }
+    cflag = termios->c_cflag;
+    
+    /* 超出芯片范围的波特率取最近的，并把实际值写回termios */
+    if (baud) {
+        baud = clamp_t(speed_t, baud, FTDI_BAUD_MIN,
+                       priv->ftdi_hispeed ? FTDI_HS_BAUD_MAX : FTDI_BAUD_MAX);
+        tty_encode_baud_rate(tty, baud, baud);
     }
     
-    count = kfifo_out(&priv->write_fifo, 
-                      priv->bulk_out_buffer,
-                      priv->bulk_out_size);
+    mutex_lock(&priv->cfg_mutex);
     
-    if (count == 0) {
-        spin_unlock_irqrestore(&priv->lock, flags);
-        return;
+    /* 数据格式 */
+    value = (cflag & CSIZE) == CS7 ? 7 : 8;
+    if (cflag & PARENB) {
+        if (cflag & CMSPAR)
+            value |= cflag & PARODD ? FTDI_DATA_PARITY_MARK :
+                                      FTDI_DATA_PARITY_SPACE;
+        else
+            value |= cflag & PARODD ? FTDI_DATA_PARITY_ODD :
+                                      FTDI_DATA_PARITY_EVEN;
     }
+    if (cflag & CSTOPB)
+        value |= FTDI_DATA_STOP_BITS_2;
+    if (serial_ftdi_request(priv, FTDI_SIO_SET_DATA, value) == 0)
+        priv->data_value = value;
     
-    /* 准备URB */
-    priv->write_urb->transfer_buffer_length = count;
+    /* B0挂断DTR/RTS，从B0恢复时重新拉高 */
+    if (!baud) {
+        serial_ftdi_set_mctrl(priv, 0, FTDI_MCR_DTR | FTDI_MCR_RTS);
+    } else {
+        serial_ftdi_set_baud(priv, baud);
+        if (old && (old->c_cflag & CBAUD) == B0)
+            serial_ftdi_set_mctrl(priv, FTDI_MCR_DTR | FTDI_MCR_RTS, 0);
+    }
     
-    spin_unlock_irqrestore(&priv->lock, flags);
+    /*
+     * RTS/CTS由芯片自己处理：接收FIFO快满时拉低RTS，CTS低时停止发送，
+     * 配合节流时不提交读URB，几Mbaud下也不会溢出
+     */
+    serial_ftdi_request_index(priv, FTDI_SIO_SET_FLOW_CTRL, 0,
+                              (cflag & CRTSCTS ? FTDI_FLOW_RTS_CTS :
+                                                 FTDI_FLOW_NONE) |
+                              priv->ftdi_index);
     
-    /* 提交URB */
-    result = usb_submit_urb(priv->write_urb, GFP_KERNEL);
-    if (result) {
-        dev_err(&priv->interface->dev,
-                "提交写URB失败: %d\n", result);
+    mutex_unlock(&priv->cfg_mutex);
+    
+resize:
+    if (baud && baud != priv->tx_baud) {
+        serial_tx_ring_resize(priv, baud);
+        serial_tx_refill(priv);
+        serial_tx_wake_check(priv);
     }
 }
 
-/* TTY打开 */
-static int serial_open(struct tty_struct *tty, struct file *filp)
+/* TIOCMGET：DTR/RTS是最近一次设置的值，其他线来自状态头 */
+static int serial_tiocmget(struct tty_struct *tty)
 {
-    struct usb_serial_private *priv;
-    int index = tty->index;
-    int result = 0;
+    struct usb_serial_private *priv = tty->driver_data;
+    u8 msr = READ_ONCE(priv->msr);
+    u8 mcr;
     
-    /* 查找对应的USB设备 */
-    priv = tty->driver_data;
-    if (!priv)
-        return -ENODEV;
+    if (!priv->ftdi)
+        return -ENOTTY;
     
-    mutex_lock(&priv->mutex);
+    mutex_lock(&priv->cfg_mutex);
+    mcr = priv->mcr;
+    mutex_unlock(&priv->cfg_mutex);
     
-    /* 增加打开计数 */
-    priv->open_count++;
-    if (priv->open_count == 1) {
-        /* 第一次打开 */
-        priv->tty = tty;
-        
-        /* 提交读URB */
-        usb_fill_bulk_urb(priv->read_urb, priv->udev,
-                         usb_rcvbulkpipe(priv->udev, priv->bulk_in_endpointAddr),
-                         priv->bulk_in_buffer,
-                         priv->bulk_in_size,
-                         serial_read_bulk_callback, priv);
-        
-        result = usb_submit_urb(priv->read_urb, GFP_KERNEL);
-        if (result) {
-            dev_err(&priv->interface->dev,
-                    "提交读URB失败: %d\n", result);
-            priv->open_count--;
-            priv->tty = NULL;
-        }
-    }
+    return (mcr & FTDI_MCR_DTR ? TIOCM_DTR : 0) |
+           (mcr & FTDI_MCR_RTS ? TIOCM_RTS : 0) |
+           (msr & FTDI_RS0_CTS ? TIOCM_CTS : 0) |
+           (msr & FTDI_RS0_DSR ? TIOCM_DSR : 0) |
+           (msr & FTDI_RS0_RI ? TIOCM_RI : 0) |
+           (msr & FTDI_RS0_RLSD ? TIOCM_CD : 0);
+}
+
+/* TIOCMSET/TIOCMBIS/TIOCMBIC */
+static int serial_tiocmset(struct tty_struct *tty,
+                           unsigned int set, unsigned int clear)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    u8 mset = 0, mclear = 0;
+    int result;
     
-    mutex_unlock(&priv->mutex);
+    if (!priv->ftdi)
+        return -ENOTTY;
+    
+    if (set & TIOCM_DTR)
+        mset |= FTDI_MCR_DTR;
+    if (set & TIOCM_RTS)
+        mset |= FTDI_MCR_RTS;
+    if (clear & TIOCM_DTR)
+        mclear |= FTDI_MCR_DTR;
+    if (clear & TIOCM_RTS)
+        mclear |= FTDI_MCR_RTS;
+    
+    mutex_lock(&priv->cfg_mutex);
+    result = serial_ftdi_set_mctrl(priv, mset, mclear);
+    mutex_unlock(&priv->cfg_mutex);
     
     return result;
 }
 
-/* TTY关闭 */
-static void serial_close(struct tty_struct *tty, struct file *filp)
+/* 发送break：在当前数据格式上置第14位 */
+static int serial_break_ctl(struct tty_struct *tty, int state)
 {
     struct usb_serial_private *priv = tty->driver_data;
+    int result;
     
-    if (!priv)
-        return;
+    if (!priv->ftdi)
+        return -EOPNOTSUPP;
     
-    mutex_lock(&priv->mutex);
+    mutex_lock(&priv->cfg_mutex);
+    result = serial_ftdi_request(priv, FTDI_SIO_SET_DATA,
+                                 priv->data_value |
+                                 (state == -1 ? FTDI_DATA_BREAK : 0));
+    mutex_unlock(&priv->cfg_mutex);
     
-    priv->open_count--;
-    if (priv->open_count == 0) {
-        /* 最后一次关闭 */
-        
-        /* 停止URB */
-        usb_kill_urb(priv->read_urb);
-        usb_kill_urb(priv->write_urb);
-        
-        /* 取消工作队列 */
-        cancel_work_sync(&priv->work);
-        
-        priv->tty = NULL;
+    return result;
+}
+
+/*
+ * tty层的接收缓冲区快满了：读URB交完数据后不再提交。端点上没有读请求，
+ * 芯片的FIFO填满后RTS/CTS让对端停下，数据不会丢
+ */
+static void serial_throttle(struct tty_struct *tty)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    if (!priv->rx_throttled) {
+        priv->rx_throttled = true;
+        atomic64_inc(&priv->rx_throttles);
+    }
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+}
+
+/* 恢复接收：重新提交停下的读URB，再交还没交完的数据 */
+static void serial_unthrottle(struct tty_struct *tty)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    struct serial_rx_buf *rb, *tmp;
+    unsigned long flags;
+    int result;
+    
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    priv->rx_throttled = false;
+    if (!priv->rx_stopped) {
+        list_for_each_entry_safe(rb, tmp, &priv->rx_parked, node) {
+            list_del(&rb->node);
+            result = serial_submit_read_urb(priv, rb->urb, GFP_ATOMIC);
+            if (result)
+                dev_err(&priv->interface->dev,
+                        "重新提交读URB失败: %d\n", result);
+        }
     }
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
     
-    mutex_unlock(&priv->mutex);
+    serial_rx_deliver(priv);
 }
 
-/* TTY写入 */
-static int serial_write(struct tty_struct *tty,
-                       const unsigned char *buf, int count)
+/* TIOCGSERIAL */
+static int serial_get_serial(struct tty_struct *tty, struct serial_struct *ss)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    
+    ss->line = priv->minor;
+    ss->baud_base = FTDI_BAUD_BASE;
+    ss->xmit_fifo_size = priv->bulk_out_size;
+    mutex_lock(&priv->cfg_mutex);
+    ss->flags = priv->low_latency ? ASYNC_LOW_LATENCY : 0;
+    mutex_unlock(&priv->cfg_mutex);
+    
+    return 0;
+}
+
+/* TIOCSSERIAL：只支持ASYNC_LOW_LATENCY，打开时把延迟定时器设成1ms */
+static int serial_set_serial(struct tty_struct *tty, struct serial_struct *ss)
 {
     struct usb_serial_private *priv = tty->driver_data;
+    bool low_latency = ss->flags & ASYNC_LOW_LATENCY;
+    int result = 0;
+    
+    mutex_lock(&priv->cfg_mutex);
+    if (priv->low_latency != low_latency) {
+        priv->low_latency = low_latency;
+        result = serial_ftdi_apply(priv);
+    }
+    mutex_unlock(&priv->cfg_mutex);
+    
+    return result;
+}
+
+/* arg里的线从prev以来有没有变化，prev更新为当前计数 */
+static bool serial_msr_changed(struct usb_serial_private *priv,
+                               struct async_icount *prev, unsigned long arg)
+{
+    struct async_icount cnow;
     unsigned long flags;
-    int retval;
+    bool changed;
     
-    if (!priv)
-        return -ENODEV;
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    cnow = priv->icount;
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
+    
+    changed = ((arg & TIOCM_RNG) && cnow.rng != prev->rng) ||
+              ((arg & TIOCM_DSR) && cnow.dsr != prev->dsr) ||
+              ((arg & TIOCM_CD) && cnow.dcd != prev->dcd) ||
+              ((arg & TIOCM_CTS) && cnow.cts != prev->cts);
+    *prev = cnow;
+    
+    return changed;
+}
+
+/* TIOCMIWAIT：等到arg里的任一条线变化，端口挂断或关闭时返回-EIO */
+static int serial_tiocmiwait(struct tty_struct *tty, unsigned long arg)
+{
+    struct usb_serial_private *priv = tty->driver_data;
+    struct tty_port *port = &priv->port;
+    struct async_icount prev;
+    unsigned long flags;
+    int result;
     
-    spin_lock_irqsave(&priv->lock, flags);
+    if (!priv->ftdi)
+        return -ENOTTY;
     
-    /* 将数据加入FIFO */
-    retval = kfifo_in(&priv->write_fifo, buf, count);
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    prev = priv->icount;
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
     
-    spin_unlock_irqrestore(&priv->lock, flags);
+    /* 挂断时tty_port_hangup会唤醒delta_msr_wait */
+    result = wait_event_interruptible(port->delta_msr_wait,
+                                      !tty_port_initialized(port) ||
+                                      serial_msr_changed(priv, &prev, arg));
+    if (result)
+        return result;
     
-    /* 触发发送 */
-    schedule_work(&priv->work);
+    return tty_port_initialized(port) ? 0 : -EIO;
+}
+
+static int serial_ioctl(struct tty_struct *tty, unsigned int cmd,
+                        unsigned long arg)
+{
+    switch (cmd) {
+    case TIOCMIWAIT:
+        return serial_tiocmiwait(tty, arg);
+    }
     
-    return retval;
+    return -ENOIOCTLCMD;
 }
 
-/* TTY写入空间 */
-static int serial_write_room(struct tty_struct *tty)
+/* TIOCGICOUNT：状态头里统计到的modem状态变化和线路错误 */
+static int serial_get_icount(struct tty_struct *tty,
+                             struct serial_icounter_struct *icount)
 {
     struct usb_serial_private *priv = tty->driver_data;
+    struct async_icount cnow;
     unsigned long flags;
-    int room;
     
-    if (!priv)
-        return 0;
+    spin_lock_irqsave(&priv->rx_lock, flags);
+    cnow = priv->icount;
+    spin_unlock_irqrestore(&priv->rx_lock, flags);
     
-    spin_lock_irqsave(&priv->lock, flags);
-    room = kfifo_avail(&priv->write_fifo);
-    spin_unlock_irqrestore(&priv->lock, flags);
+    icount->cts = cnow.cts;
+    icount->dsr = cnow.dsr;
+    icount->rng = cnow.rng;
+    icount->dcd = cnow.dcd;
+    icount->frame = cnow.frame;
+    icount->parity = cnow.parity;
+    icount->overrun = cnow.overrun;
+    icount->brk = cnow.brk;
     
-    return room;
+    return 0;
 }
 
 /* TTY操作结构 */
 static const struct tty_operations serial_ops = {
+    .install = serial_install,
+    .cleanup = serial_cleanup,
     .open = serial_open,
     .close = serial_close,
+    .hangup = serial_hangup,
+    .set_termios = serial_set_termios,
+    .tiocmget = serial_tiocmget,
+    .tiocmset = serial_tiocmset,
+    .break_ctl = serial_break_ctl,
+    .throttle = serial_throttle,
+    .unthrottle = serial_unthrottle,
+    .get_serial = serial_get_serial,
+    .set_serial = serial_set_serial,
+    .get_icount = serial_get_icount,
+    .ioctl = serial_ioctl,
     .write = serial_write,
     .write_room = serial_write_room,
 };
@@ -275,6 +1523,9 @@ static int usb_serial_probe(struct usb_interface *interface,
     struct usb_host_interface *iface_desc;
     struct usb_endpoint_descriptor *endpoint;
     struct usb_device *udev = interface_to_usbdev(interface);
+    struct device *tty_dev;
+    unsigned char *buf;
+    size_t maxp;
     int i;
     int retval = -ENOMEM;
     
@@ -283,12 +1534,28 @@ static int usb_serial_probe(struct usb_interface *interface,
     if (!priv)
         return -ENOMEM;
     
-    /* 初始化 */
-    spin_lock_init(&priv->lock);
-    mutex_init(&priv->mutex);
+    /* 初始化，从这里开始出错时由tty_port_put经serial_port_destruct释放 */
+    tty_port_init(&priv->port);
+    priv->port.ops = &serial_port_ops;
+    spin_lock_init(&priv->rx_lock);
+    spin_lock_init(&priv->tx_put_lock);
+    spin_lock_init(&priv->tx_lock);
+    INIT_LIST_HEAD(&priv->rx_done);
+    INIT_LIST_HEAD(&priv->rx_parked);
+    INIT_DELAYED_WORK(&priv->rx_work, serial_rx_work);
+    mutex_init(&priv->cfg_mutex);
     priv->udev = usb_get_dev(udev);
     priv->interface = interface;
-    INIT_WORK(&priv->work, serial_send_work);
+    
+    /* 多口芯片按接口号选通道，单口芯片用0 */
+    priv->ftdi = id->driver_info & SERIAL_FTDI_SIO;
+    if (udev->actconfig->desc.bNumInterfaces > 1)
+        priv->ftdi_index = interface->cur_altsetting->desc.bInterfaceNumber + 1;
+    priv->ftdi_hispeed = le16_to_cpu(udev->descriptor.bcdDevice) >= 0x0700;
+    priv->data_value = 8;
+    priv->latency_timer = clamp(ftdi_latency, 1U, 255U);
+    priv->event_char = FTDI_EVENT_CHAR_OFF;
+    INIT_WORK(&priv->work, serial_tx_halt_work);
     
     /* 解析端点 */
     iface_desc = interface->cur_altsetting;
@@ -296,19 +1563,22 @@ static int usb_serial_probe(struct usb_interface *interface,
         endpoint = &iface_desc->endpoint[i].desc;
         
         if (usb_endpoint_is_bulk_in(endpoint)) {
-            priv->bulk_in_size = usb_endpoint_maxp(endpoint);
+            /* 读缓冲区是wMaxPacketSize的整数倍，设备的短包才会结束URB */
+            maxp = usb_endpoint_maxp(endpoint);
+            priv->bulk_in_maxp = maxp;
+            priv->bulk_in_size = clamp_t(size_t, rx_size, maxp,
+                                         SERIAL_RX_SIZE_MAX);
+            priv->bulk_in_size = rounddown(priv->bulk_in_size, maxp);
             priv->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-            priv->bulk_in_buffer = kmalloc(priv->bulk_in_size, GFP_KERNEL);
-            if (!priv->bulk_in_buffer)
-                goto error;
         }
         
         if (usb_endpoint_is_bulk_out(endpoint)) {
-            priv->bulk_out_size = usb_endpoint_maxp(endpoint);
+            maxp = usb_endpoint_maxp(endpoint);
+            priv->bulk_out_maxp = maxp;
+            priv->bulk_out_size = clamp_t(size_t, tx_size, maxp,
+                                          SERIAL_TX_SIZE_MAX);
+            priv->bulk_out_size = rounddown(priv->bulk_out_size, maxp);
             priv->bulk_out_endpointAddr = endpoint->bEndpointAddress;
-            priv->bulk_out_buffer = kmalloc(priv->bulk_out_size, GFP_KERNEL);
-            if (!priv->bulk_out_buffer)
-                goto error;
         }
     }
     
@@ -318,47 +1588,83 @@ static int usb_serial_probe(struct usb_interface *interface,
         goto error;
     }
     
-    /* 分配URB */
-    priv->read_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!priv->read_urb)
-        goto error;
-    
-    priv->write_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!priv->write_urb)
-        goto error;
+    /* 分配读URB环 */
+    priv->num_read_urbs = clamp(rx_urbs, 1U, (unsigned int)SERIAL_RX_URBS_MAX);
+    for (i = 0; i < priv->num_read_urbs; i++) {
+        priv->rx_bufs[i].priv = priv;
+        priv->rx_bufs[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!priv->rx_bufs[i].urb)
+            goto error;
+        buf = kmalloc(priv->bulk_in_size, GFP_KERNEL);
+        if (!buf)
+            goto error;
+        if (priv->ftdi) {
+            priv->rx_bufs[i].flags = kmalloc(priv->bulk_in_size, GFP_KERNEL);
+            if (!priv->rx_bufs[i].flags) {
+                kfree(buf);
+                goto error;
+            }
+        }
+        usb_fill_bulk_urb(priv->rx_bufs[i].urb, priv->udev,
+                         usb_rcvbulkpipe(priv->udev, priv->bulk_in_endpointAddr),
+                         buf, priv->bulk_in_size,
+                         serial_read_bulk_callback, &priv->rx_bufs[i]);
+    }
     
-    /* 初始化写URB */
-    usb_fill_bulk_urb(priv->write_urb, priv->udev,
-                     usb_sndbulkpipe(priv->udev, priv->bulk_out_endpointAddr),
-                     priv->bulk_out_buffer,
-                     priv->bulk_out_size,
-                     serial_write_bulk_callback, priv);
+    /* 分配写URB池 */
+    priv->num_write_urbs = clamp(tx_urbs, 1U, (unsigned int)SERIAL_TX_URBS_MAX);
+    for (i = 0; i < priv->num_write_urbs; i++) {
+        priv->write_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!priv->write_urbs[i])
+            goto error;
+        buf = kmalloc(priv->bulk_out_size, GFP_KERNEL);
+        if (!buf)
+            goto error;
+        usb_fill_bulk_urb(priv->write_urbs[i], priv->udev,
+                         usb_sndbulkpipe(priv->udev, priv->bulk_out_endpointAddr),
+                         buf, priv->bulk_out_size,
+                         serial_write_bulk_callback, priv);
+        __set_bit(i, &priv->tx_free);
+    }
     
-    /* 初始化FIFO */
-    retval = kfifo_alloc(&priv->write_fifo, SERIAL_BUF_SIZE, GFP_KERNEL);
+    /* 按默认波特率分配发送环，打开时再按实际波特率调整 */
+    retval = serial_tx_ring_resize(priv,
+                    tty_termios_baud_rate(&serial_tty_driver->init_termios));
     if (retval)
         goto error;
     
+    /* 动态分配次设备号 */
+    mutex_lock(&serial_minors_lock);
+    retval = idr_alloc(&serial_minors, priv, 0, SERIAL_TTY_MINORS, GFP_KERNEL);
+    mutex_unlock(&serial_minors_lock);
+    if (retval < 0) {
+        dev_err(&interface->dev, "没有空闲的次设备号: %d\n", retval);
+        goto error;
+    }
+    priv->minor = retval;
+    
     /* 保存设备数据 */
     usb_set_intfdata(interface, priv);
     
     /* 注册TTY设备 */
-    /* 这里简化处理，实际应该动态分配TTY设备号 */
+    tty_dev = tty_port_register_device(&priv->port, serial_tty_driver,
+                                       priv->minor, &interface->dev);
+    if (IS_ERR(tty_dev)) {
+        retval = PTR_ERR(tty_dev);
+        goto error_minor;
+    }
     
-    dev_info(&interface->dev, "USB串口设备已连接\n");
+    dev_info(&interface->dev, "USB串口设备已连接: ttyUSB%u\n", priv->minor);
     
     return 0;
     
+error_minor:
+    usb_set_intfdata(interface, NULL);
+    mutex_lock(&serial_minors_lock);
+    idr_remove(&serial_minors, priv->minor);
+    mutex_unlock(&serial_minors_lock);
 error:
-    if (priv) {
-        usb_free_urb(priv->read_urb);
-        usb_free_urb(priv->write_urb);
-        kfree(priv->bulk_in_buffer);
-        kfree(priv->bulk_out_buffer);
-        kfifo_free(&priv->write_fifo);
-        usb_put_dev(priv->udev);
-        kfree(priv);
-    }
+    tty_port_put(&priv->port);
     return retval;
 }
 
@@ -370,28 +1676,205 @@ static void usb_serial_disconnect(struct usb_interface *interface)
     if (!priv)
         return;
     
-    /* 停止所有传输 */
-    usb_kill_urb(priv->read_urb);
-    usb_kill_urb(priv->write_urb);
-    cancel_work_sync(&priv->work);
+    /* 之后install找不到这个接口，次设备号可以给新插入的设备 */
+    mutex_lock(&serial_minors_lock);
+    priv->disconnected = true;
+    idr_remove(&serial_minors, priv->minor);
+    mutex_unlock(&serial_minors_lock);
     
-    /* 清理资源 */
-    usb_free_urb(priv->read_urb);
-    usb_free_urb(priv->write_urb);
-    kfree(priv->bulk_in_buffer);
-    kfree(priv->bulk_out_buffer);
-    kfifo_free(&priv->write_fifo);
-    usb_put_dev(priv->udev);
+    /* 挂断已经打开的tty，之后的读写都返回错误 */
+    tty_port_tty_vhangup(&priv->port);
+    tty_unregister_device(serial_tty_driver, priv->minor);
     
-    usb_set_intfdata(interface, NULL);
-    kfree(priv);
+    /* 停止所有传输，挂断时已经停过的话这里什么也不做 */
+    mutex_lock(&priv->port.mutex);
+    serial_stop_read(priv);
+    serial_stop_write(priv);
+    set_bit(SERIAL_TX_HALTED, &priv->tx_flags);
+    mutex_unlock(&priv->port.mutex);
     
+    usb_set_intfdata(interface, NULL);
     dev_info(&interface->dev, "USB串口设备已断开\n");
+    
+    /* 还有tty没释放的话，等它们cleanup时再释放私有数据 */
+    tty_port_put(&priv->port);
+}
+
+/*
+ * sysfs: 接收统计，idle_gaps是端点上没有读URB的次数，cycles_per_mb是
+ * 每MB数据插入tty缓冲区用的CPU周期
+ */
+static ssize_t rx_stats_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    u64 bytes = atomic64_read(&priv->rx_insert_bytes);
+    
+    return sysfs_emit(buf,
+                      "urbs %u\n"
+                      "urb_size %zu\n"
+                      "bytes %llu\n"
+                      "completions %llu\n"
+                      "stalls %llu\n"
+                      "throttles %llu\n"
+                      "idle_gaps %llu\n"
+                      "idle_us %llu\n"
+                      "errors %llu\n"
+                      "cycles_per_mb %llu\n",
+                      priv->num_read_urbs, priv->bulk_in_size,
+                      (u64)atomic64_read(&priv->rx_bytes),
+                      (u64)atomic64_read(&priv->rx_completions),
+                      (u64)atomic64_read(&priv->rx_stalls),
+                      (u64)atomic64_read(&priv->rx_throttles),
+                      (u64)atomic64_read(&priv->rx_idle_gaps),
+                      div_u64(atomic64_read(&priv->rx_idle_ns), NSEC_PER_USEC),
+                      (u64)atomic64_read(&priv->rx_errors),
+                      bytes ? div64_u64((u64)atomic64_read(&priv->rx_cycles) << 20,
+                                        bytes) : 0);
+}
+static DEVICE_ATTR_RO(rx_stats);
+
+/*
+ * sysfs: 发送统计，inflight_max是同时在端点上的写URB数峰值，irqoff_*
+ * 是写完成回调关中断运行的时间
+ */
+static ssize_t tx_stats_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    u64 samples = atomic64_read(&priv->tx_irqoff_samples);
+    
+    return sysfs_emit(buf,
+                      "urbs %u\n"
+                      "urb_size %zu\n"
+                      "bytes %llu\n"
+                      "completions %llu\n"
+                      "inflight_max %u\n"
+                      "zlps %llu\n"
+                      "errors %llu\n"
+                      "halts %llu\n"
+                      "baud %u\n"
+                      "ring_size %u\n"
+                      "ring_high %u\n"
+                      "ring_low %u\n"
+                      "ring_used %u\n"
+                      "ring_peak %u\n"
+                      "ring_full %llu\n"
+                      "wakeups %llu\n"
+                      "irqoff_avg_ns %llu\n"
+                      "irqoff_max_ns %llu\n",
+                      priv->num_write_urbs, priv->bulk_out_size,
+                      (u64)atomic64_read(&priv->tx_bytes),
+                      (u64)atomic64_read(&priv->tx_completions),
+                      READ_ONCE(priv->tx_inflight_max),
+                      (u64)atomic64_read(&priv->tx_zlps),
+                      (u64)atomic64_read(&priv->tx_errors),
+                      (u64)atomic64_read(&priv->tx_halts),
+                      priv->tx_baud,
+                      priv->tx_ring.size,
+                      priv->tx_high,
+                      priv->tx_low,
+                      serial_tx_ring_used(&priv->tx_ring),
+                      READ_ONCE(priv->tx_ring_peak),
+                      (u64)atomic64_read(&priv->tx_ring_full),
+                      (u64)atomic64_read(&priv->tx_wakeups),
+                      samples ? div64_u64(atomic64_read(&priv->tx_irqoff_ns),
+                                          samples) : 0,
+                      (u64)atomic64_read(&priv->tx_irqoff_max_ns));
+}
+static DEVICE_ATTR_RO(tx_stats);
+
+/* sysfs: FTDI延迟定时器（毫秒），ASYNC_LOW_LATENCY打开时芯片实际用1ms */
+static ssize_t latency_timer_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    
+    return sysfs_emit(buf, "%u\n", READ_ONCE(priv->latency_timer));
+}
+
+static ssize_t latency_timer_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    u8 latency;
+    int result;
+    
+    if (!priv->ftdi)
+        return -EOPNOTSUPP;
+    
+    result = kstrtou8(buf, 0, &latency);
+    if (result)
+        return result;
+    if (!latency)
+        return -EINVAL;
+    
+    mutex_lock(&priv->cfg_mutex);
+    priv->latency_timer = latency;
+    result = serial_ftdi_apply(priv);
+    mutex_unlock(&priv->cfg_mutex);
+    
+    return result ? result : count;
+}
+static DEVICE_ATTR_RW(latency_timer);
+
+/* sysfs: FTDI事件字符，收到它时芯片不等延迟定时器立即发送，off关闭 */
+static ssize_t event_char_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    int event_char = READ_ONCE(priv->event_char);
+    
+    if (event_char == FTDI_EVENT_CHAR_OFF)
+        return sysfs_emit(buf, "off\n");
+    return sysfs_emit(buf, "%d\n", event_char);
+}
+
+static ssize_t event_char_store(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct usb_serial_private *priv = usb_get_intfdata(to_usb_interface(dev));
+    int event_char;
+    u8 ch;
+    int result;
+    
+    if (!priv->ftdi)
+        return -EOPNOTSUPP;
+    
+    if (sysfs_streq(buf, "off")) {
+        event_char = FTDI_EVENT_CHAR_OFF;
+    } else {
+        result = kstrtou8(buf, 0, &ch);
+        if (result)
+            return result;
+        event_char = ch;
+    }
+    
+    mutex_lock(&priv->cfg_mutex);
+    priv->event_char = event_char;
+    result = serial_ftdi_apply(priv);
+    mutex_unlock(&priv->cfg_mutex);
+    
+    return result ? result : count;
 }
+static DEVICE_ATTR_RW(event_char);
+
+static struct attribute *serial_attrs[] = {
+    &dev_attr_rx_stats.attr,
+    &dev_attr_tx_stats.attr,
+    &dev_attr_latency_timer.attr,
+    &dev_attr_event_char.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(serial);
 
 /* USB设备ID表 */
 static const struct usb_device_id usb_serial_id_table[] = {
-    { USB_DEVICE(VENDOR_ID, PRODUCT_ID) },
+    { USB_DEVICE(VENDOR_ID, PRODUCT_ID), .driver_info = SERIAL_FTDI_SIO },
+    { USB_DEVICE(VENDOR_ID, PRODUCT_ID_2232H), .driver_info = SERIAL_FTDI_SIO },
+    { USB_DEVICE(VENDOR_ID, PRODUCT_ID_232H), .driver_info = SERIAL_FTDI_SIO },
     { }  /* 终止符 */
 };
 MODULE_DEVICE_TABLE(usb, usb_serial_id_table);
@@ -402,6 +1885,7 @@ static struct usb_driver usb_serial_driver = {
     .probe      = usb_serial_probe,
     .disconnect = usb_serial_disconnect,
     .id_table   = usb_serial_id_table,
+    .dev_groups = serial_groups,
 };
 
 /* 模块初始化 */
@@ -409,11 +1893,20 @@ static int __init usb_serial_init(void)
 {
     int retval;
     
-    /* 分配TTY驱动 */
-    serial_tty_driver = alloc_tty_driver(256);
-    if (!serial_tty_driver)
+    /* 发送错误恢复用的高优先级工作队列 */
+    serial_wq = alloc_workqueue("usb_serial_tx", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+    if (!serial_wq)
         return -ENOMEM;
     
+    /* 分配TTY驱动，设备节点在probe时按接口创建 */
+    serial_tty_driver = tty_alloc_driver(SERIAL_TTY_MINORS,
+                                         TTY_DRIVER_REAL_RAW |
+                                         TTY_DRIVER_DYNAMIC_DEV);
+    if (IS_ERR(serial_tty_driver)) {
+        destroy_workqueue(serial_wq);
+        return PTR_ERR(serial_tty_driver);
+    }
+    
     /* 设置TTY驱动 */
     serial_tty_driver->driver_name = "usb_serial";
     serial_tty_driver->name = "ttyUSB";
@@ -421,7 +1914,6 @@ static int __init usb_serial_init(void)
     serial_tty_driver->minor_start = 0;
     serial_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
     serial_tty_driver->subtype = SERIAL_TYPE_NORMAL;
-    serial_tty_driver->flags = TTY_DRIVER_REAL_RAW | TTY_DRIVER_DYNAMIC_DEV;
     serial_tty_driver->init_termios = tty_std_termios;
     serial_tty_driver->init_termios.c_cflag = B9600 | CS8 | CREAD | HUPCL | CLOCAL;
     tty_set_operations(serial_tty_driver, &serial_ops);
@@ -429,7 +1921,8 @@ static int __init usb_serial_init(void)
     /* 注册TTY驱动 */
     retval = tty_register_driver(serial_tty_driver);
     if (retval) {
-        put_tty_driver(serial_tty_driver);
+        tty_driver_kref_put(serial_tty_driver);
+        destroy_workqueue(serial_wq);
         return retval;
     }
     
@@ -437,7 +1930,8 @@ static int __init usb_serial_init(void)
     retval = usb_register(&usb_serial_driver);
     if (retval) {
         tty_unregister_driver(serial_tty_driver);
-        put_tty_driver(serial_tty_driver);
+        tty_driver_kref_put(serial_tty_driver);
+        destroy_workqueue(serial_wq);
         return retval;
     }
     
@@ -453,7 +1947,10 @@ static void __exit usb_serial_exit(void)
     
     /* 注销TTY驱动 */
     tty_unregister_driver(serial_tty_driver);
-    put_tty_driver(serial_tty_driver);
+    tty_driver_kref_put(serial_tty_driver);
+    
+    destroy_workqueue(serial_wq);
+    idr_destroy(&serial_minors);
     
     pr_info("USB串口驱动已卸载\n");
 }
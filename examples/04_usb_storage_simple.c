@@ -3,6 +3,12 @@
  * 
  * 这是一个演示性的USB存储驱动，展示了SCSI命令的处理
  * 实际的USB存储驱动要复杂得多
+ *
+ * Bulk-Only传输由完成回调驱动：CBW、数据、CSW三个URB在各自的
+ * 回调中依次提交，CSW校验完成后才通知调用者
+ *
+ * 接口提供UAS（协议0x62）备用设置时改用UAS，多条命令可以同时
+ * 在设备上执行；否则回退到BOT
  */
 
 #include <linux/module.h>
@@ -10,7 +16,36 @@
 #include <linux/usb.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/timer.h>
+#include <linux/delay.h>
 #include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/llist.h>
+#include <linux/dma-direction.h>
+#include <linux/scatterlist.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/idr.h>
+#include <linux/list_sort.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/usb/uas.h>
+#include <linux/unaligned.h>
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
 
@@ -27,6 +62,180 @@
 #define US_BULK_STAT_FAIL    1
 #define US_BULK_STAT_PHASE   2
 
+/* BOT类请求：Bulk-Only Mass Storage Reset */
+#define US_BULK_RESET_REQUEST 0xff
+
+/* 各阶段超时的上限（毫秒），样本足够前直接使用 */
+#define STORAGE_CMD_TIMEOUT  5000   /* CBW和CSW阶段 */
+#define STORAGE_DATA_TIMEOUT 10000  /* 数据阶段 */
+
+/* 自适应超时 */
+#define STORAGE_RTO_MIN_SAMPLES  8            /* 样本数不足时用上限 */
+#define STORAGE_RTO_DATA_UNIT    (64 * 1024)  /* 数据阶段按每64KB估计 */
+
+/* 接口协议 */
+#define STORAGE_PR_BULK      0x50   /* Bulk-Only Transport */
+#define STORAGE_PR_UAS       0x62   /* USB Attached SCSI */
+
+/* UAS标签数 */
+#define STORAGE_UAS_MAX_TAGS       256  /* 最多申请的streams */
+#define STORAGE_UAS_NOSTREAM_TAGS  32   /* 高速设备（无streams） */
+
+/* 块设备参数 */
+#define STORAGE_MINORS       16     /* 每个磁盘的次设备号数（含分区） */
+
+/* 多LUN */
+#define STORAGE_MAX_LUNS     16     /* BOT的CBW中LUN只有4位 */
+#define STORAGE_LUN_QUANTUM  (128 * 1024)  /* 公平调度每轮给每个LUN的字节额度 */
+#define US_BULK_GET_MAX_LUN  0xfe   /* BOT类请求：读取最大LUN号 */
+
+/* 精简配置（discard） */
+#define STORAGE_VPD_LEN          64     /* 读取VPD页的缓冲区大小 */
+#define STORAGE_SCSI_SPC3        5      /* INQUIRY版本号，更早的设备不支持VPD */
+#define STORAGE_UNMAP_MAX_DESC   ((PAGE_SIZE - 8) / 16)  /* 参数列表不超过一页 */
+#define STORAGE_WS16_MAX_BLOCKS  0x7fffff  /* 设备没报告上限时WRITE SAME的块数 */
+
+/* 总线调度：权重为1时每轮的字节额度 */
+#define STORAGE_BUS_QUANTUM      (16 * 1024)
+#define STORAGE_BUS_WEIGHT       10     /* 默认权重 */
+#define STORAGE_BUS_WEIGHT_MAX   100
+
+/* 直通命令 */
+#define STORAGE_PT_MINOR_BASE    200
+#define STORAGE_PT_MAX_LEN       (16 * 1024 * 1024)
+#define STORAGE_PT_SENSE_LEN     32
+#define STORAGE_PT_MAX_TIMEOUT   120000  /* 每个阶段的超时上限（毫秒） */
+
+#define STORAGE_PT_DIR_NONE      0
+#define STORAGE_PT_DIR_TO_DEV    1
+#define STORAGE_PT_DIR_FROM_DEV  2
+
+/*
+ * 直通ioctl的参数（/dev/usb/usbsgN）。数据直接在用户缓冲区和设备之间
+ * DMA，控制器有sg限制时缓冲区要按wMaxPacketSize对齐
+ */
+struct storage_passthru {
+    __u8  cdb[16];
+    __u8  cdb_len;                 /* 6到16 */
+    __u8  direction;               /* STORAGE_PT_DIR_* */
+    __u8  lun;
+    __u8  sense_len;               /* 输出：sense数据的长度 */
+    __u32 timeout_ms;              /* 每个阶段的超时，0用默认值，最大120秒 */
+    __u64 data;                    /* 用户缓冲区 */
+    __u32 length;                  /* 数据长度 */
+    __u32 residue;                 /* 输出：CSW的dCSWDataResidue */
+    __u32 status;                  /* 输出：SCSI状态 */
+    __u8  sense[STORAGE_PT_SENSE_LEN];  /* 输出：CHECK CONDITION的sense数据 */
+    __u32 pad;                     /* 32位和64位布局一致，必须为0 */
+};
+
+#define STORAGE_IOC_PASSTHRU  _IOWR('U', 0x90, struct storage_passthru)
+
+/* 设备档案 */
+#define STORAGE_PROFILE_SERIAL   64     /* 保存的序列号最大长度（含结尾0） */
+
+/* 扇区缓存 */
+#define STORAGE_CACHE_HASH_BITS  10
+#define STORAGE_CACHE_FILL_MAX   (64 * 1024)  /* 完成时填回缓存的请求大小上限 */
+#define STORAGE_SENSE_LEN        18     /* 固定格式sense数据 */
+
+/* 写合并的块大小范围（KB） */
+#define STORAGE_WC_MIN_KB        4
+#define STORAGE_WC_MAX_KB        4096
+
+static unsigned int queue_depth = 16;
+module_param(queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "每个块设备的请求队列深度（默认16）");
+
+static unsigned int max_sectors;
+module_param(max_sectors, uint, 0644);
+MODULE_PARM_DESC(max_sectors, "单个请求的最大扇区数，512字节为单位（默认0，按端点计算）");
+
+/* 合并后单条命令的上限（KB），默认按端点计算，可通过sysfs的max_transfer_kb调整 */
+#define STORAGE_MAX_TRANSFER_KB_MAX  16384
+
+static unsigned int max_segments = 128;
+module_param(max_segments, uint, 0644);
+MODULE_PARM_DESC(max_segments, "单个请求的最大段数（默认128）");
+
+/* 异步识别：TEST UNIT READY按指数退避重试 */
+static unsigned int ready_initial_ms = 50;
+module_param(ready_initial_ms, uint, 0644);
+MODULE_PARM_DESC(ready_initial_ms, "等待设备就绪的首次重试间隔（毫秒，默认50）");
+
+static unsigned int ready_max_delay_ms = 2000;
+module_param(ready_max_delay_ms, uint, 0644);
+MODULE_PARM_DESC(ready_max_delay_ms, "重试间隔的上限（毫秒，默认2000）");
+
+static unsigned int ready_timeout_ms = 20000;
+module_param(ready_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(ready_timeout_ms, "等待设备就绪的总时间（毫秒，默认20000）");
+
+/* 错误恢复 */
+static unsigned int max_retries = 3;
+module_param(max_retries, uint, 0644);
+MODULE_PARM_DESC(max_retries, "复位后重试命令的最大次数（默认3）");
+
+static unsigned int rto_min_ms = 300;
+module_param(rto_min_ms, uint, 0644);
+MODULE_PARM_DESC(rto_min_ms, "自适应超时的下限（毫秒，默认300）");
+
+/* 写合并 */
+static unsigned int wc_chunk_kb;
+module_param(wc_chunk_kb, uint, 0444);
+MODULE_PARM_DESC(wc_chunk_kb, "写合并的块大小（KB，按2的幂取整，默认0不启用）");
+
+static unsigned int wc_flush_ms = 1000;
+module_param(wc_flush_ms, uint, 0644);
+MODULE_PARM_DESC(wc_flush_ms, "写合并的数据最多缓存多久（毫秒，默认1000）");
+
+/* 扇区缓存 */
+static unsigned int cache_kb;
+module_param(cache_kb, uint, 0644);
+MODULE_PARM_DESC(cache_kb, "每个设备的扇区缓存上限（KB，默认0不启用）");
+
+static unsigned int cache_readahead_kb = 128;
+module_param(cache_readahead_kb, uint, 0644);
+MODULE_PARM_DESC(cache_readahead_kb, "检测到顺序读时预读的大小（KB，默认128，0不预读）");
+
+/* 轮询完成 */
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "每个块设备的轮询队列数（0或1，默认0），供io_uring IOPOLL使用");
+
+static unsigned int poll_budget_us;
+module_param(poll_budget_us, uint, 0644);
+MODULE_PARM_DESC(poll_budget_us, "同步命令忙等完成的时间预算（微秒，默认0不忙等）");
+
+static unsigned int poll_max_kb = 64;
+module_param(poll_max_kb, uint, 0644);
+MODULE_PARM_DESC(poll_max_kb, "忙等的同步命令的最大数据量（KB，默认64）");
+
+/* 总线调度 */
+static unsigned int device_inflight_kb = 2048;
+module_param(device_inflight_kb, uint, 0644);
+MODULE_PARM_DESC(device_inflight_kb, "每个设备正在传输的数据上限（KB，默认2048，0不限制）");
+
+static unsigned int bus_inflight_kb = 8192;
+module_param(bus_inflight_kb, uint, 0644);
+MODULE_PARM_DESC(bus_inflight_kb, "共用上游带宽的设备正在传输的数据总量上限（KB，默认8192，0不限制）");
+
+/* 设备档案 */
+static unsigned int profile_cache_size = 32;
+module_param(profile_cache_size, uint, 0644);
+MODULE_PARM_DESC(profile_cache_size, "按VID/PID/序列号记住的设备数（默认32，0不使用）");
+
+static int storage_major;
+static DEFINE_IDA(storage_index_ida);
+static struct workqueue_struct *storage_wq;
+static struct dentry *storage_debugfs_root;
+static LIST_HEAD(storage_buses);
+static DEFINE_MUTEX(storage_bus_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(storage_bus_wait);
+static LIST_HEAD(storage_profiles);
+static DEFINE_MUTEX(storage_profile_mutex);
+static unsigned int storage_nprofiles;
+
 /* 命令块封装器（CBW） */
 struct bulk_cb_wrap {
     __le32 Signature;              /* "USBC" */
@@ -46,245 +255,4919 @@ struct bulk_cs_wrap {
     __u8   Status;                 /* 状态 */
 } __packed;
 
+/* BOT状态机阶段 */
+enum storage_phase {
+    STORAGE_PHASE_IDLE,            /* 空闲 */
+    STORAGE_PHASE_CBW,             /* 等待CBW完成 */
+    STORAGE_PHASE_DATA,            /* 等待数据阶段完成 */
+    STORAGE_PHASE_CSW,             /* 等待CSW */
+    STORAGE_PHASE_RECOVERY,        /* 等待恢复工作 */
+};
+
+/* BOT错误恢复方式 */
+enum storage_recovery {
+    STORAGE_RECOVER_DATA_STALL,    /* 数据阶段STALL：清除halt后照常读CSW */
+    STORAGE_RECOVER_CSW_STALL,     /* CSW阶段STALL：清除halt后再读一次CSW */
+    STORAGE_RECOVER_RESET,         /* Mass Storage Reset并清除两个管道的halt */
+};
+
+/* 超时估计（微秒），同TCP的RTO：srtt + 4 * rttvar */
+enum storage_rto_kind {
+    STORAGE_RTO_CTRL,              /* CBW阶段 */
+    STORAGE_RTO_DATA,              /* 数据阶段，每STORAGE_RTO_DATA_UNIT字节 */
+    STORAGE_RTO_NR,
+};
+
+struct storage_rto {
+    u32 srtt_us;                   /* 平滑后的耗时 */
+    u32 rttvar_us;                 /* 平均偏差 */
+    u32 samples;                   /* 样本数 */
+};
+
+/* 延迟统计的命令分类 */
+enum storage_stat_op {
+    STORAGE_OP_READ,
+    STORAGE_OP_WRITE,
+    STORAGE_OP_TUR,
+    STORAGE_OP_INQUIRY,
+    STORAGE_OP_CAPACITY,
+    STORAGE_OP_UNMAP,
+    STORAGE_OP_OTHER,
+    STORAGE_OP_NR,
+};
+
+/* 延迟统计的阶段：BOT为CBW/数据/CSW，UAS为命令IU/数据/状态IU */
+enum storage_stat_phase {
+    STORAGE_STAT_CMD,
+    STORAGE_STAT_DATA,
+    STORAGE_STAT_STATUS,
+    STORAGE_STAT_TOTAL,            /* 从发出到结束 */
+    STORAGE_STAT_NR,
+};
+
+/* 第i个桶统计[2^i, 2^(i+1))微秒，第0个桶含0，最后一个桶不设上限 */
+#define STORAGE_HIST_BUCKETS  24
+
+/* 每CPU一份，只做本地加法，读取时累加 */
+struct storage_stats {
+    u64 hist[STORAGE_OP_NR][STORAGE_STAT_NR][STORAGE_HIST_BUCKETS];
+    u64 errors[STORAGE_STAT_NR];   /* 各阶段出错次数 */
+    u64 short_transfers;           /* 数据阶段少于请求长度 */
+    u64 tag_mismatches;            /* CSW/状态IU的标签对不上 */
+    u64 resets;                    /* BOT复位次数 */
+    u64 retries;                   /* 复位后重试的命令数 */
+};
+
+/* 一条排队执行的SCSI命令 */
+struct storage_cmd {
+    struct list_head node;         /* 挂在命令队列上 */
+    unsigned char cdb[16];         /* SCSI命令 */
+    int cdb_len;                   /* CDB长度 */
+    struct scatterlist *sg;        /* 数据阶段的分散/聚集表 */
+    unsigned int nents;            /* sg表项数 */
+    unsigned int length;           /* 数据长度 */
+    int direction;                 /* DMA_FROM_DEVICE/DMA_TO_DEVICE/DMA_NONE */
+    u32 tag;                       /* 发出时分配的CBW标签 */
+    unsigned int actual;           /* 数据阶段实际传输的字节数 */
+    u32 residue;                   /* CSW报告的剩余量 */
+    int result;                    /* 0或负错误码 */
+    struct storage_lun *lun;       /* 目标逻辑单元 */
+    u64 start_ns;                  /* 发出时间 */
+    u64 phase_ns;                  /* 当前阶段开始时间 */
+    unsigned int retries;          /* 复位后已重试的次数 */
+    bool no_retry;                 /* 复位后不重试（直通命令、自动REQUEST SENSE） */
+    unsigned int bus_bytes;        /* 总线调度计入的字节数，0表示没有计入 */
+    unsigned int timeout_ms;       /* 每个阶段的超时，0按自适应超时 */
+    u8 *sense;                     /* 非NULL时保存sense数据（STORAGE_PT_SENSE_LEN字节） */
+    unsigned int sense_len;        /* 保存的sense数据长度 */
+    
+    /* 轮询队列上的请求完成后挂到lun->poll_done，由->poll结束 */
+    bool polled;
+    blk_status_t poll_status;
+    u64 done_ns;                   /* 状态机完成的时间 */
+    struct llist_node poll_node;
+    
+    /* 块请求和合并 */
+    u64 lba;                       /* 起始逻辑块 */
+    u32 blocks;                    /* 逻辑块数（合并后为总数） */
+    unsigned int req_length;       /* 本请求自身的字节数 */
+    unsigned int req_nents;        /* 本请求自身的sg表项数 */
+    struct list_head merged;       /* 合并到本命令的其他请求 */
+    u64 cache_gen;                 /* 派发时LUN的缓存代数 */
+    bool discard;                  /* REQ_OP_DISCARD */
+    unsigned int ranges;           /* discard的范围数（合并后为总数） */
+    void *buf;                     /* 命令自带的数据（UNMAP参数列表） */
+    
+    void (*done)(struct storage_cmd *cmd);  /* CSW校验后调用，可能在中断上下文 */
+    void *context;                 /* 调用者私有数据 */
+};
+
+struct usb_storage;
+
+/* 写合并缓冲区的状态 */
+enum storage_wc_state {
+    STORAGE_WC_IDLE,               /* 没有数据 */
+    STORAGE_WC_DIRTY,              /* 正在攒写入 */
+    STORAGE_WC_FLUSHING,           /* 正在写回，不接受新写入 */
+};
+
+/* 写回的原因 */
+enum storage_wc_reason {
+    STORAGE_WC_DEADLINE,           /* 缓存时间到 */
+    STORAGE_WC_EVICT,              /* 要写别的块，或者有读写和当前块重叠 */
+    STORAGE_WC_SYNC,               /* FLUSH请求 */
+};
+
+/*
+ * 写合并：小于一个擦除块的写入先复制到内存中按块对齐的缓冲区，
+ * 写回时缺的逻辑块先从设备读出补齐，再整块写下去，U盘控制器就
+ * 不用为每次小写入做一次读改写
+ */
+struct storage_wc {
+    struct storage_lun *lun;
+    spinlock_t lock;               /* 保护以下状态 */
+    enum storage_wc_state state;
+    enum storage_wc_reason reason; /* 本次写回的原因 */
+    bool rerun;                    /* 有请求因缓冲区忙返回过DEV_RESOURCE */
+    u64 lba;                       /* 当前块的起始LBA */
+    unsigned int blocks;           /* 当前块的逻辑块数，磁盘末尾可能不满 */
+    unsigned long *valid;          /* 已写入的逻辑块 */
+    struct list_head waiters;      /* 等待写回完成的FLUSH请求 */
+    int error;                     /* 没报告过的写回错误，下一个FLUSH返回 */
+    struct delayed_work flush_work;
+    
+    unsigned int chunk_blocks;     /* 块大小（逻辑块，2的幂） */
+    unsigned int npages;
+    struct page **pages;           /* 块缓冲区 */
+    struct page **fill;            /* 读补齐缓冲区 */
+    struct scatterlist *sg;        /* npages项 */
+};
+
+/* 解除映射的方式 */
+enum storage_unmap_mode {
+    STORAGE_UNMAP_NONE,            /* 不支持discard */
+    STORAGE_UNMAP_UNMAP,           /* UNMAP，一个参数列表带多个范围 */
+    STORAGE_UNMAP_WS16,            /* WRITE SAME(16)加UNMAP位，一次一个范围 */
+};
+
+/* 逻辑单元：每个LUN有自己的块设备和请求队列 */
+struct storage_lun {
+    struct usb_storage *us;        /* 所属设备 */
+    unsigned int lun;              /* LUN号 */
+    struct list_head cmd_queue;    /* 等待发出的命令，由us->lock保护 */
+    unsigned int deficit;          /* 公平调度的剩余额度（字节） */
+    
+    /* 块设备 */
+    struct blk_mq_tag_set tag_set; /* blk-mq标签集 */
+    struct gendisk *disk;          /* /dev/usbsN */
+    int disk_index;                /* N，-1表示未分配 */
+    u64 capacity;                  /* 逻辑块数 */
+    unsigned int block_size;       /* 逻辑块大小（字节） */
+    
+    /* 异步识别状态，只在识别工作中访问 */
+    bool present;                  /* INQUIRY成功 */
+    bool settled;                  /* 已注册块设备（就绪或超时） */
+    
+    /* 精简配置，由Block Limits和Logical Block Provisioning VPD页得出 */
+    bool lbpme;                    /* READ CAPACITY(16)的LBPME位 */
+    enum storage_unmap_mode unmap_mode;
+    u32 max_unmap_blocks;          /* 一条命令最多解除映射的块数 */
+    u32 max_unmap_desc;            /* UNMAP参数列表最多的描述符数 */
+    u32 unmap_granularity;         /* 最佳粒度（块） */
+    
+    struct storage_wc *wc;         /* 写合并，NULL表示不启用 */
+    bool no_sync_cache;            /* 设备不支持SYNCHRONIZE CACHE */
+    struct llist_head poll_done;   /* 等待->poll结束的请求 */
+    
+    /* 扇区缓存，由us->cache_lock保护 */
+    u64 cache_gen;                 /* 每次写入、discard或介质更换加一 */
+    u64 seq_next;                  /* 下一个顺序读的起始LBA */
+    unsigned int seq_count;        /* 连续顺序读的次数 */
+    bool ra_busy;                  /* 有预读在进行 */
+    
+    /* INQUIRY信息 */
+    char vendor[9];
+    char product[17];
+    u8 version;                    /* SCSI标准版本 */
+};
+
+/*
+ * 共用上游带宽的一组设备：同一个根端口下的设备，或者全速/低速设备
+ * 共用的TT。组内按权重做差额轮询，限制正在传输的总字节数
+ */
+struct storage_bus {
+    struct list_head node;         /* 挂在storage_buses上 */
+    struct usb_bus *bus;           /* 主机控制器 */
+    int port;                      /* 根端口号 */
+    struct usb_tt *tt;             /* 共用的TT，NULL表示没有 */
+    int ttport;                    /* 多TT的hub上按端口区分 */
+    spinlock_t lock;               /* 保护以下字段和成员的bus_*字段 */
+    struct list_head devices;      /* 组内的设备 */
+    struct list_head waiters;      /* 等待额度的设备，按轮询顺序 */
+    u64 inflight;                  /* 组内正在传输的字节数 */
+};
+
+/* 设备档案中一个LUN的识别结果 */
+struct storage_profile_lun {
+    unsigned int lun;              /* LUN号 */
+    char vendor[9];
+    char product[17];
+    u8 version;
+    bool ready;                    /* 有介质 */
+    bool lbpme;
+    u64 capacity;
+    u32 block_size;
+    enum storage_unmap_mode unmap_mode;
+    u32 max_unmap_blocks;
+    u32 max_unmap_desc;
+    u32 unmap_granularity;
+};
+
+/*
+ * 设备档案：按VID/PID/序列号记住上次识别的结果。同一个设备再次插入
+ * 时直接按档案注册块设备，完整识别在后台做，用来校验档案
+ */
+struct storage_profile {
+    struct list_head node;         /* 挂在storage_profiles上，表头是最近使用的 */
+    u16 vid;
+    u16 pid;
+    char serial[STORAGE_PROFILE_SERIAL];
+    bool uas;                      /* 上次使用UAS */
+    s64 ready_ms;                  /* 上次从probe到就绪的毫秒数 */
+    unsigned int hits;             /* 按档案快速识别的次数 */
+    unsigned int mismatches;       /* 后台校验发现不一致的次数 */
+    unsigned int nluns;
+    struct storage_profile_lun luns[STORAGE_MAX_LUNS];
+};
+
+/* 传输层：BOT或UAS */
+struct storage_transport {
+    const char *name;
+    void (*kick)(struct usb_storage *us);  /* 从各LUN的队列取命令发出 */
+};
+
+/* UAS每个标签的状态 */
+struct storage_uas_tag {
+    struct usb_storage *us;
+    unsigned int index;            /* 标签号减1 */
+    struct storage_cmd *cmd;       /* 占用本标签的命令 */
+    struct command_iu *iu;         /* 命令IU缓冲区 */
+    struct sense_iu *sense;        /* 状态IU缓冲区 */
+    struct urb *cmd_urb;           /* 命令管道URB */
+    struct urb *data_urb;          /* 数据管道URB */
+    struct urb *stat_urb;          /* 状态管道URB */
+    unsigned int pending;          /* UAS_PENDING_* */
+    bool data_submitted;           /* 数据URB已提交 */
+    bool timed_out;                /* 命令超时 */
+    unsigned long deadline;        /* 超时时间（jiffies） */
+    u64 data_ns;                   /* 数据URB提交时间 */
+};
+
+/* 缓存的一页数据，按LUN和页号（PAGE_SIZE为单位）查找 */
+struct storage_cache_entry {
+    struct hlist_node hash;
+    struct list_head lru;
+    struct storage_lun *lun;
+    u64 index;
+    struct page *page;
+    bool readahead;                /* 由预读插入，还没命中过 */
+};
+
+/* 一次预读，完成后数据放进缓存 */
+struct storage_readahead {
+    struct storage_cmd cmd;
+    u64 gen;                       /* 发出时LUN的缓存代数 */
+    unsigned int npages;
+    struct page **pages;
+    struct scatterlist sg[];
+};
+
 /* USB存储设备结构 */
 struct usb_storage {
     struct usb_device *udev;       /* USB设备 */
     struct usb_interface *interface; /* USB接口 */
     unsigned int send_bulk_pipe;    /* 批量输出管道 */
     unsigned int recv_bulk_pipe;    /* 批量输入管道 */
+    const struct storage_transport *transport;  /* BOT或UAS */
     
     /* 传输缓冲区 */
     struct bulk_cb_wrap *cbw;      /* CBW缓冲区 */
     struct bulk_cs_wrap *csw;      /* CSW缓冲区 */
-    unsigned char *data_buffer;    /* 数据缓冲区 */
+    unsigned int max_segs;         /* 每条命令的最大sg表项数 */
+    
+    /* BOT状态机 */
+    struct urb *cbw_urb;           /* CBW阶段URB */
+    struct urb *data_urb;          /* 数据阶段URB */
+    struct urb *csw_urb;           /* CSW阶段URB */
+    struct usb_anchor anchor;      /* 正在传输的URB */
+    struct scatterlist *data_sg;   /* 逐段传输时的下一个sg表项 */
+    unsigned int data_sg_left;     /* 逐段传输时剩余的表项数 */
+    unsigned int data_sg_off;      /* 当前表项已传输的字节数 */
+    void *data_bounce;             /* 逐段传输高端内存页用的一页缓冲区 */
+    struct page *bounce_page;      /* 本段经bounce缓冲区传输的页，NULL表示没有 */
+    unsigned int bounce_off;       /* 本段在页内的偏移 */
+    spinlock_t lock;               /* 保护以下字段 */
+    struct storage_cmd *cur_cmd;   /* 正在执行的命令 */
+    enum storage_phase phase;      /* 当前阶段 */
+    struct timer_list timer;       /* 阶段超时 */
+    unsigned long deadline;        /* 当前阶段截止时间（jiffies） */
+    bool timed_out;                /* 当前阶段已超时 */
+    bool disconnected;             /* 设备已断开 */
+    
+    /* BOT错误恢复，cur_cmd在恢复期间保持不变 */
+    struct work_struct reset_work; /* 清除halt和复位需要睡眠 */
+    enum storage_recovery recovery;
+    int recovery_result;           /* 放弃时命令的结果 */
+    bool csw_retried;              /* 本命令已经重读过CSW */
+    struct storage_rto rto[STORAGE_RTO_NR];
+    
+    /* UAS */
+    unsigned int cmd_pipe;         /* 命令管道 */
+    unsigned int status_pipe;      /* 状态管道 */
+    struct usb_host_endpoint *uas_eps[3];  /* 使用streams的端点 */
+    int uas_streams;               /* 分配的streams数，0表示不用 */
+    unsigned int uas_ntags;        /* 标签数 */
+    struct storage_uas_tag *uas_tags;
+    unsigned long *uas_tag_busy;   /* 已占用的标签 */
+    unsigned long *uas_stat_busy;  /* 已提交的状态URB */
     
     /* 同步 */
     struct mutex io_mutex;
     struct completion command_done;
     
+    /* 轮询统计 */
+    u64 sync_done_ns;              /* 上一条同步命令完成的时间 */
+    atomic64_t poll_spin_ns;       /* 同步命令忙等的总时间 */
+    atomic64_t poll_hits;          /* 预算内等到完成的同步命令数 */
+    atomic64_t poll_misses;        /* 超出预算改为睡眠的次数 */
+    atomic64_t poll_reaped;        /* ->poll结束的块请求数 */
+    atomic64_t poll_observe_ns;    /* 完成到被轮询发现的总时间 */
+    atomic64_t wake_ns;            /* 完成到睡眠的线程被唤醒的总时间 */
+    atomic64_t wake_count;
+    
+    /* 直通字符设备，打开的文件持有引用 */
+    struct kref kref;
+    struct mutex pt_mutex;         /* 直通命令和断开互斥 */
+    bool pt_registered;            /* 已注册次设备号 */
+    bool pt_gone;                  /* 设备已断开，LUN已释放 */
+    
+    /* 总线调度，由bus->lock保护 */
+    struct storage_bus *bus;       /* 所在的组 */
+    struct list_head bus_node;     /* 挂在bus->devices上 */
+    struct list_head bus_wait;     /* 挂在bus->waiters上 */
+    struct list_head bus_kick;     /* 完成路径里待唤醒的设备 */
+    unsigned int bus_weight;       /* 权重，sysfs可调 */
+    u64 bus_deficit;               /* 差额轮询的剩余额度（字节） */
+    unsigned int bus_want;         /* 等待时队首命令的字节数 */
+    unsigned int bus_granted;      /* 已经预留、还没发出的字节数 */
+    u64 bus_inflight;              /* 本设备正在传输的字节数 */
+    u64 bus_throttled;             /* 因额度不够推迟发出的次数 */
+    u64 bus_bytes;                 /* 计入调度的总字节数 */
+    atomic_t bus_kicks;            /* 其他设备正在唤醒本设备 */
+    
+    /* 逻辑单元 */
+    struct storage_lun *luns[STORAGE_MAX_LUNS];
+    unsigned int nluns;            /* LUN数，修改时持有lock */
+    unsigned int rr_next;          /* 公平调度的轮询位置 */
+    
+    /* 请求合并 */
+    struct list_head merge_list;   /* 等待合并的请求，由lock保护 */
+    unsigned int max_transfer_kb;  /* 合并后单条命令的上限 */
+    
+    /* 按端点描述符计算的传输大小 */
+    unsigned int ep_maxp;          /* 批量端点的wMaxPacketSize */
+    unsigned int ep_burst;         /* 每次突发的包数（bMaxBurst + 1） */
+    unsigned int xfer_align;       /* 对齐大小：一次突发，向上取2的幂 */
+    unsigned int pref_transfer_kb; /* 首选单条命令大小 */
+    atomic64_t merge_requests;     /* 收到的块请求数 */
+    atomic64_t merge_transfers;    /* 实际发出的读写命令数 */
+    atomic64_t merge_bytes;        /* 读写命令的总字节数 */
+    atomic64_t discard_cmds;       /* 发出的UNMAP/WRITE SAME命令数 */
+    atomic64_t discard_ranges;     /* 这些命令覆盖的discard范围数 */
+    
+    /* 写合并统计（所有LUN） */
+    atomic64_t wc_host_bytes;      /* 合并进缓冲区的写入字节数 */
+    atomic64_t wc_dev_bytes;       /* 写回设备的字节数 */
+    atomic64_t wc_fill_bytes;      /* 读补齐的字节数 */
+    atomic64_t wc_flushes[3];      /* 按storage_wc_reason分类的写回次数 */
+    atomic64_t wc_full_chunks;     /* 不需要读补齐的写回次数 */
+    atomic64_t wc_errors;          /* 写回失败次数 */
+    
+    /* 扇区缓存（所有LUN共用容量上限） */
+    spinlock_t cache_lock;
+    struct hlist_head *cache_hash;
+    struct list_head cache_lru;    /* 表头是最近使用的 */
+    unsigned long cache_pages;     /* 已缓存的页数 */
+    u64 cache_hits;
+    u64 cache_misses;
+    u64 cache_inserts;
+    u64 cache_evictions;
+    u64 cache_invalidations;       /* 因写入、discard或介质更换删除的页数 */
+    u64 ra_issued;                 /* 发出的预读命令数 */
+    u64 ra_pages;                  /* 预读插入的页数 */
+    u64 ra_hits;                   /* 预读的页后来被命中 */
+    
+    /* BOT自动REQUEST SENSE */
+    struct storage_cmd sense_cmd;
+    struct scatterlist sense_sg;
+    u8 *sense_buf;                 /* STORAGE_SENSE_LEN字节 */
+    
+    /* 异步识别 */
+    struct work_struct scan_work;  /* 发现LUN、等待就绪、注册块设备 */
+    struct work_struct release_work; /* LUN 0不可用时释放接口 */
+    wait_queue_head_t scan_wait;   /* 退避等待，断开时提前唤醒 */
+    bool scan_abort;               /* 断开时置位 */
+    ktime_t probe_time;            /* probe开始的时间 */
+    s64 ready_ms;                  /* 从probe到识别完成的毫秒数，-1表示未完成 */
+    
+    /* 统计 */
+    struct storage_stats __percpu *stats;
+    struct dentry *debugfs;        /* usb_storage_simple/<接口名> */
+    
     /* 设备信息 */
-    char vendor[9];
-    char product[17];
     char serial[9];
     unsigned int tag;              /* 命令标签 */
 };
 
-/* 发送SCSI命令 */
-static int storage_send_command(struct usb_storage *us,
-                               unsigned char *cmd, int cmd_len,
-                               unsigned int data_len, int direction)
+static void storage_kick(struct usb_storage *us);
+static int storage_handle_sense(struct storage_lun *lun, const u8 *sense,
+                                unsigned int len);
+static bool storage_wc_overlaps(struct storage_wc *wc, u64 lba, u64 blocks);
+static void storage_uas_stat_callback(struct urb *urb);
+static void storage_uas_data_callback(struct urb *urb);
+
+/* 按操作码归类 */
+static enum storage_stat_op storage_stat_op(const struct storage_cmd *cmd)
+{
+    switch (cmd->cdb[0]) {
+    case READ_10:
+    case READ_16:
+        return STORAGE_OP_READ;
+    case WRITE_10:
+    case WRITE_16:
+        return STORAGE_OP_WRITE;
+    case TEST_UNIT_READY:
+        return STORAGE_OP_TUR;
+    case INQUIRY:
+        return STORAGE_OP_INQUIRY;
+    case READ_CAPACITY:
+    case SERVICE_ACTION_IN_16:
+        return STORAGE_OP_CAPACITY;
+    case UNMAP:
+    case WRITE_SAME_16:
+        return STORAGE_OP_UNMAP;
+    default:
+        return STORAGE_OP_OTHER;
+    }
+}
+
+/* 记录从start_ns到现在的一次阶段延迟，返回当前时间 */
+static u64 storage_stat_latency(struct usb_storage *us,
+                                const struct storage_cmd *cmd,
+                                enum storage_stat_phase phase, u64 start_ns)
+{
+    u64 now = ktime_get_ns();
+    u64 us_delta = div_u64(now - start_ns, NSEC_PER_USEC);
+    unsigned int bucket;
+    
+    bucket = us_delta ? min_t(unsigned int, ilog2(us_delta),
+                              STORAGE_HIST_BUCKETS - 1) : 0;
+    this_cpu_inc(us->stats->hist[storage_stat_op(cmd)][phase][bucket]);
+    
+    return now;
+}
+
+static void storage_stat_error(struct usb_storage *us,
+                               enum storage_stat_phase phase)
+{
+    this_cpu_inc(us->stats->errors[phase]);
+}
+
+/* BOT阶段出错计数 */
+static void storage_bot_stat_error(struct usb_storage *us,
+                                   enum storage_phase phase)
+{
+    switch (phase) {
+    case STORAGE_PHASE_CBW:
+        storage_stat_error(us, STORAGE_STAT_CMD);
+        break;
+    case STORAGE_PHASE_DATA:
+        storage_stat_error(us, STORAGE_STAT_DATA);
+        break;
+    case STORAGE_PHASE_CSW:
+        storage_stat_error(us, STORAGE_STAT_STATUS);
+        break;
+    default:
+        break;
+    }
+}
+
+/* 加入一个耗时样本（Jacobson算法） */
+static void storage_rto_sample(struct storage_rto *rto, u64 sample_us)
+{
+    s64 sample = min_t(u64, sample_us, STORAGE_DATA_TIMEOUT * USEC_PER_MSEC);
+    s64 delta;
+    
+    if (!rto->samples) {
+        rto->srtt_us = sample;
+        rto->rttvar_us = sample / 2;
+    } else {
+        delta = sample - rto->srtt_us;
+        rto->srtt_us = rto->srtt_us + delta / 8;
+        rto->rttvar_us = rto->rttvar_us +
+                         (abs(delta) - (s64)rto->rttvar_us) / 4;
+    }
+    if (rto->samples < U32_MAX)
+        rto->samples++;
+}
+
+/*
+ * 阶段超时（毫秒）：srtt + 4 * rttvar，数据阶段按长度放大，每重试
+ * 一次翻倍，限制在[rto_min_ms, 固定上限]之间
+ */
+static unsigned int storage_rto_timeout(struct usb_storage *us,
+                                        enum storage_rto_kind kind,
+                                        const struct storage_cmd *cmd)
+{
+    const struct storage_rto *rto = &us->rto[kind];
+    unsigned int limit = kind == STORAGE_RTO_DATA ?
+                         STORAGE_DATA_TIMEOUT : STORAGE_CMD_TIMEOUT;
+    u64 t_us;
+    
+    if (cmd->timeout_ms)
+        return cmd->timeout_ms;
+    if (rto->samples < STORAGE_RTO_MIN_SAMPLES)
+        return limit;
+    
+    t_us = rto->srtt_us + 4ULL * rto->rttvar_us;
+    if (kind == STORAGE_RTO_DATA)
+        t_us *= DIV_ROUND_UP(cmd->length, STORAGE_RTO_DATA_UNIT);
+    t_us <<= min(cmd->retries, 4U);
+    
+    return clamp_t(u64, DIV_ROUND_UP_ULL(t_us, USEC_PER_MSEC),
+                   min(rto_min_ms, limit), limit);
+}
+
+/* 启动当前阶段的超时定时器 */
+static void storage_arm_timer(struct usb_storage *us, unsigned int timeout)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    us->deadline = jiffies + msecs_to_jiffies(timeout);
+    us->timed_out = false;
+    mod_timer(&us->timer, us->deadline);
+    spin_unlock_irqrestore(&us->lock, flags);
+}
+
+/* 阶段超时：取消正在传输的URB，回调中以-ETIMEDOUT结束命令 */
+static void storage_timeout(struct timer_list *t)
+{
+    struct usb_storage *us = from_timer(us, t, timer);
+    unsigned long flags;
+    bool expired;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    /* 定时器可能在下一阶段重新设置截止时间时才运行 */
+    expired = us->cur_cmd && time_after_eq(jiffies, us->deadline);
+    if (expired)
+        us->timed_out = true;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (expired) {
+        dev_warn(&us->interface->dev, "命令超时: 阶段=%d\n", us->phase);
+        usb_unlink_anchored_urbs(&us->anchor);
+    }
+}
+
+/* 把URB状态转换为命令结果 */
+static int storage_urb_result(struct usb_storage *us, int status)
+{
+    if ((status == -ECONNRESET || status == -ENOENT) && us->timed_out)
+        return -ETIMEDOUT;
+    return status;
+}
+
+/*
+ * 总线调度
+ *
+ * 命令发出前按字节申请额度：设备自己正在传输的数据不超过
+ * device_inflight_kb，组内合计不超过bus_inflight_kb。组内额度不够或
+ * 已经有设备在等时，设备排进等待队列，由命令完成时按权重的差额轮询
+ * 依次预留额度并唤醒。一个设备上的大块连续拷贝只能用到自己那一份
+ * 带宽，同一个TT或根端口后面的其他U盘不会被饿死
+ */
+
+/* 找到设备所在的组：TT优先，否则按根端口 */
+static void storage_bus_key(struct usb_device *udev, int *port,
+                            struct usb_tt **tt, int *ttport)
+{
+    struct usb_device *top = udev;
+    
+    while (top->parent && top->parent->parent)
+        top = top->parent;
+    *port = top->portnum;
+    *tt = udev->tt;
+    *ttport = udev->tt && udev->tt->multi ? udev->ttport : 0;
+}
+
+/* 加入组，没有就新建 */
+static int storage_bus_join(struct usb_storage *us)
+{
+    struct storage_bus *bus;
+    struct usb_tt *tt;
+    int port, ttport;
+    unsigned long flags;
+    
+    storage_bus_key(us->udev, &port, &tt, &ttport);
+    INIT_LIST_HEAD(&us->bus_wait);
+    us->bus_weight = STORAGE_BUS_WEIGHT;
+    
+    mutex_lock(&storage_bus_mutex);
+    list_for_each_entry(bus, &storage_buses, node) {
+        if (bus->bus == us->udev->bus && bus->port == port &&
+            bus->tt == tt && bus->ttport == ttport)
+            goto found;
+    }
+    
+    bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (!bus) {
+        mutex_unlock(&storage_bus_mutex);
+        return -ENOMEM;
+    }
+    bus->bus = us->udev->bus;
+    bus->port = port;
+    bus->tt = tt;
+    bus->ttport = ttport;
+    spin_lock_init(&bus->lock);
+    INIT_LIST_HEAD(&bus->devices);
+    INIT_LIST_HEAD(&bus->waiters);
+    list_add_tail(&bus->node, &storage_buses);
+    
+found:
+    spin_lock_irqsave(&bus->lock, flags);
+    list_add_tail(&us->bus_node, &bus->devices);
+    us->bus = bus;
+    spin_unlock_irqrestore(&bus->lock, flags);
+    mutex_unlock(&storage_bus_mutex);
+    
+    return 0;
+}
+
+/*
+ * 组内额度变多后按差额轮询给等待的设备预留额度，要唤醒的设备放进
+ * kick链表。调用时持有bus->lock
+ */
+static void storage_bus_grant(struct storage_bus *bus, struct list_head *kick)
+{
+    u64 bus_cap = READ_ONCE(bus_inflight_kb) * 1024ULL;
+    struct usb_storage *w;
+    bool waiting = !list_empty(&bus->waiters);
+    
+    while (!list_empty(&bus->waiters)) {
+        w = list_first_entry(&bus->waiters, struct usb_storage, bus_wait);
+        if (bus_cap && bus->inflight &&
+            bus->inflight + w->bus_want > bus_cap)
+            break;
+        if (w->bus_deficit < w->bus_want) {
+            w->bus_deficit += (u64)STORAGE_BUS_QUANTUM * w->bus_weight;
+            list_move_tail(&w->bus_wait, &bus->waiters);
+            continue;
+        }
+        
+        w->bus_deficit -= w->bus_want;
+        w->bus_granted = w->bus_want;
+        w->bus_inflight += w->bus_want;
+        bus->inflight += w->bus_want;
+        atomic_inc(&w->bus_kicks);
+        list_del_init(&w->bus_wait);
+        list_add_tail(&w->bus_kick, kick);
+    }
+    
+    /* 等待队列清空后额度清零，空闲设备不能攒额度 */
+    if (waiting && list_empty(&bus->waiters)) {
+        list_for_each_entry(w, &bus->devices, bus_node)
+            w->bus_deficit = 0;
+    }
+}
+
+/* 唤醒storage_bus_grant选出的设备，调用时不持有bus->lock */
+static void storage_bus_kick(struct list_head *kick)
+{
+    struct usb_storage *w, *next;
+    
+    /* bus_kicks不为0时设备不会离开，kick链表只在这里访问 */
+    list_for_each_entry_safe(w, next, kick, bus_kick) {
+        list_del(&w->bus_kick);
+        storage_kick(w);
+        if (atomic_dec_and_test(&w->bus_kicks))
+            wake_up(&storage_bus_wait);
+    }
+}
+
+/*
+ * 离开组，设备已停止。设备带走的额度（包括已经预留但还没用上的）
+ * 让给其他等待的设备；最后一个设备离开时释放组
+ */
+static void storage_bus_leave(struct usb_storage *us)
+{
+    struct storage_bus *bus = us->bus;
+    unsigned long flags;
+    LIST_HEAD(kick);
+    
+    if (!bus)
+        return;
+    
+    mutex_lock(&storage_bus_mutex);
+    spin_lock_irqsave(&bus->lock, flags);
+    list_del(&us->bus_node);
+    list_del_init(&us->bus_wait);
+    bus->inflight -= us->bus_inflight;
+    us->bus_inflight = 0;
+    us->bus_granted = 0;
+    storage_bus_grant(bus, &kick);
+    spin_unlock_irqrestore(&bus->lock, flags);
+    
+    storage_bus_kick(&kick);
+    
+    /* 其他设备的完成路径可能正在唤醒本设备 */
+    wait_event(storage_bus_wait, !atomic_read(&us->bus_kicks));
+    
+    if (list_empty(&bus->devices)) {
+        list_del(&bus->node);
+        kfree(bus);
+    }
+    mutex_unlock(&storage_bus_mutex);
+    us->bus = NULL;
+}
+
+/*
+ * 命令出队前申请额度，返回false表示现在不能发出。调用时持有us->lock
+ */
+static bool storage_bus_admit(struct usb_storage *us, struct storage_cmd *cmd)
+{
+    struct storage_bus *bus = us->bus;
+    u64 dev_cap = READ_ONCE(device_inflight_kb) * 1024ULL;
+    u64 bus_cap = READ_ONCE(bus_inflight_kb) * 1024ULL;
+    unsigned int len = cmd->length;
+    bool ok = false;
+    
+    if (!bus || !len)
+        return true;
+    
+    spin_lock(&bus->lock);
+    
+    /* 完成路径已经按上次的需求预留，命令大小变了就修正差值 */
+    if (us->bus_granted) {
+        bus->inflight += len;
+        bus->inflight -= us->bus_granted;
+        us->bus_inflight += len;
+        us->bus_inflight -= us->bus_granted;
+        us->bus_granted = 0;
+        ok = true;
+        goto out;
+    }
+    
+    /* 设备自己的上限：本设备的命令完成时会再次尝试 */
+    if (dev_cap && us->bus_inflight && us->bus_inflight + len > dev_cap)
+        goto throttled;
+    
+    if (list_empty(&bus->waiters) &&
+        (!bus_cap || !bus->inflight || bus->inflight + len <= bus_cap)) {
+        bus->inflight += len;
+        us->bus_inflight += len;
+        ok = true;
+        goto out;
+    }
+    
+    us->bus_want = len;
+    if (list_empty(&us->bus_wait))
+        list_add_tail(&us->bus_wait, &bus->waiters);
+    
+throttled:
+    us->bus_throttled++;
+out:
+    if (ok) {
+        cmd->bus_bytes = len;
+        us->bus_bytes += len;
+    }
+    spin_unlock(&bus->lock);
+    return ok;
+}
+
+/*
+ * 命令离开传输层（完成或放回队列）时归还额度，然后按差额轮询给
+ * 等待的设备预留额度并唤醒它们
+ */
+static void storage_bus_release(struct usb_storage *us, struct storage_cmd *cmd)
+{
+    struct storage_bus *bus = us->bus;
+    unsigned long flags;
+    LIST_HEAD(kick);
+    
+    if (!bus || !cmd->bus_bytes)
+        return;
+    
+    spin_lock_irqsave(&bus->lock, flags);
+    bus->inflight -= cmd->bus_bytes;
+    us->bus_inflight -= cmd->bus_bytes;
+    cmd->bus_bytes = 0;
+    storage_bus_grant(bus, &kick);
+    spin_unlock_irqrestore(&bus->lock, flags);
+    
+    storage_bus_kick(&kick);
+}
+
+/* 结束当前命令并通知调用者，然后发出下一条命令 */
+static void storage_finish(struct usb_storage *us, int result)
+{
+    struct storage_cmd *cmd;
+    enum storage_phase phase;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    timer_delete(&us->timer);
+    cmd = us->cur_cmd;
+    phase = us->phase;
+    us->cur_cmd = NULL;
+    us->phase = STORAGE_PHASE_IDLE;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (!cmd)
+        return;
+    
+    if (result)
+        storage_bot_stat_error(us, phase);
+    storage_stat_latency(us, cmd, STORAGE_STAT_TOTAL, cmd->start_ns);
+    storage_bus_release(us, cmd);
+    
+    cmd->result = result;
+    cmd->done(cmd);
+    
+    storage_kick(us);
+}
+
+/*
+ * BOT阶段出错：URB被取消或设备断开时直接结束命令，STALL、超时和
+ * 协议错误交给恢复工作（清除halt和复位需要睡眠）
+ */
+static void storage_bot_error(struct usb_storage *us, int result,
+                              enum storage_recovery how)
+{
+    unsigned long flags;
+    
+    if (result == -ENOENT || result == -ECONNRESET ||
+        result == -ESHUTDOWN || result == -ENODEV) {
+        storage_finish(us, result);
+        return;
+    }
+    
+    spin_lock_irqsave(&us->lock, flags);
+    timer_delete(&us->timer);
+    storage_bot_stat_error(us, us->phase);
+    us->phase = STORAGE_PHASE_RECOVERY;
+    us->recovery = how;
+    us->recovery_result = result;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    queue_work(storage_wq, &us->reset_work);
+}
+
+/* 提交一个阶段的URB */
+static int storage_submit_phase(struct usb_storage *us, struct urb *urb,
+                                enum storage_phase phase,
+                                unsigned int timeout)
+{
+    int result;
+    
+    us->phase = phase;
+    storage_arm_timer(us, timeout);
+    
+    usb_anchor_urb(urb, &us->anchor);
+    result = usb_submit_urb(urb, GFP_ATOMIC);
+    if (result)
+        usb_unanchor_urb(urb);
+    
+    return result;
+}
+
+static void storage_cbw_callback(struct urb *urb);
+static void storage_data_callback(struct urb *urb);
+static void storage_csw_callback(struct urb *urb);
+
+/* 发送SCSI命令 */
+static int storage_send_command(struct usb_storage *us,
+                               struct storage_cmd *cmd)
+{
+    int result;
+    
+    /* 准备CBW */
+    memset(us->cbw, 0, sizeof(struct bulk_cb_wrap));
+    us->cbw->Signature = cpu_to_le32(US_BULK_CB_SIGN);
+    us->cbw->Tag = ++us->tag;
+    us->cbw->DataTransferLength = cpu_to_le32(cmd->length);
+    us->cbw->Flags = (cmd->direction == DMA_FROM_DEVICE) ? US_BULK_FLAG_IN : US_BULK_FLAG_OUT;
+    us->cbw->Lun = cmd->lun->lun;
+    us->cbw->Length = cmd->cdb_len;
+    memcpy(us->cbw->CDB, cmd->cdb, cmd->cdb_len);
+    cmd->tag = us->tag;
+    cmd->start_ns = ktime_get_ns();
+    cmd->phase_ns = cmd->start_ns;
+    us->csw_retried = false;
+    
+    /* 发送CBW，完成后在回调中进入数据阶段 */
+    usb_fill_bulk_urb(us->cbw_urb, us->udev, us->send_bulk_pipe,
+                     us->cbw, sizeof(struct bulk_cb_wrap),
+                     storage_cbw_callback, us);
+    
+    result = storage_submit_phase(us, us->cbw_urb, STORAGE_PHASE_CBW,
+                                  storage_rto_timeout(us, STORAGE_RTO_CTRL,
+                                                      cmd));
+    
+    if (result) {
+        dev_err(&us->interface->dev, "发送CBW失败: %d\n", result);
+        return result;
+    }
+    
+    return 0;
+}
+
+/*
+ * 填充数据阶段URB：主机控制器支持SG时一次提交整张表，否则逐段提交。
+ * 逐段时低端内存直接用页的内核地址，高端内存页经data_bounce复制
+ */
+static void storage_fill_data_urb(struct usb_storage *us,
+                                  struct storage_cmd *cmd)
+{
+    struct urb *urb = us->data_urb;
+    struct scatterlist *sg;
+    struct page *page, *last;
+    unsigned int off, len;
+    unsigned int pipe;
+    void *buf;
+    
+    /* 选择管道 */
+    pipe = (cmd->direction == DMA_FROM_DEVICE) ? 
+           us->recv_bulk_pipe : us->send_bulk_pipe;
+    
+    if (us->udev->bus->sg_tablesize) {
+        /* bio页直接交给主机控制器，不做复制 */
+        usb_fill_bulk_urb(urb, us->udev, pipe, NULL, cmd->length,
+                         storage_data_callback, us);
+        urb->sg = cmd->sg;
+        urb->num_sgs = cmd->nents;
+        us->data_sg_left = 0;
+        us->bounce_page = NULL;
+        return;
+    }
+    
+    sg = us->data_sg;
+    off = sg->offset + us->data_sg_off;
+    len = sg->length - us->data_sg_off;
+    page = nth_page(sg_page(sg), off >> PAGE_SHIFT);
+    last = nth_page(sg_page(sg), (sg->offset + sg->length - 1) >> PAGE_SHIFT);
+    off = offset_in_page(off);
+    
+    if (PageHighMem(page) || PageHighMem(last)) {
+        /* 高端内存页没有固定的内核地址：一次传一页，经bounce缓冲区复制 */
+        len = min_t(unsigned int, len, PAGE_SIZE - off);
+        buf = us->data_bounce;
+        if (cmd->direction == DMA_TO_DEVICE)
+            memcpy_from_page(buf, page, off, len);
+        us->bounce_page = page;
+        us->bounce_off = off;
+    } else {
+        buf = page_address(page) + off;
+        us->bounce_page = NULL;
+    }
+    
+    usb_fill_bulk_urb(urb, us->udev, pipe, buf, len,
+                     storage_data_callback, us);
+    urb->sg = NULL;
+    urb->num_sgs = 0;
+    
+    us->data_sg_off += len;
+    if (us->data_sg_off == sg->length) {
+        us->data_sg = sg_next(sg);
+        us->data_sg_left--;
+        us->data_sg_off = 0;
+    }
+}
+
+/* 传输数据 */
+static int storage_transfer_data(struct usb_storage *us,
+                                struct storage_cmd *cmd)
+{
+    int result;
+    
+    us->data_sg = cmd->sg;
+    us->data_sg_left = cmd->nents;
+    us->data_sg_off = 0;
+    
+    /* 传输数据，完成后在回调中接收CSW */
+    storage_fill_data_urb(us, cmd);
+    
+    result = storage_submit_phase(us, us->data_urb, STORAGE_PHASE_DATA,
+                                  storage_rto_timeout(us, STORAGE_RTO_DATA,
+                                                      cmd));
+    
+    if (result) {
+        dev_err(&us->interface->dev, "数据传输失败: %d\n", result);
+        return result;
+    }
+    
+    return 0;
+}
+
+/* 接收状态 */
+static int storage_get_status(struct usb_storage *us)
+{
+    int result;
+    
+    /* 接收CSW */
+    usb_fill_bulk_urb(us->csw_urb, us->udev, us->recv_bulk_pipe,
+                     us->csw, sizeof(struct bulk_cs_wrap),
+                     storage_csw_callback, us);
+    
+    /*
+     * CSW不用自适应超时：SYNCHRONIZE CACHE、闪存垃圾回收或硬盘起转时
+     * 设备可能几秒后才回状态，按CBW的耗时估计会误判成丢失并复位
+     */
+    result = storage_submit_phase(us, us->csw_urb, STORAGE_PHASE_CSW,
+                                  us->cur_cmd->timeout_ms ?:
+                                  STORAGE_CMD_TIMEOUT);
+    
+    if (result) {
+        dev_err(&us->interface->dev, "接收CSW失败: %d\n", result);
+        return result;
+    }
+    
+    return 0;
+}
+
+/*
+ * 校验CSW。命令失败返回-EIO；CSW无效或相位错误返回-EPROTO，
+ * 这时设备和主机的状态已经不一致，需要复位
+ */
+static int storage_check_status(struct usb_storage *us,
+                               struct storage_cmd *cmd,
+                               int actual_length)
+{
+    /* 验证CSW */
+    if (actual_length != sizeof(struct bulk_cs_wrap)) {
+        dev_err(&us->interface->dev, "CSW长度错误\n");
+        return -EPROTO;
+    }
+    
+    if (le32_to_cpu(us->csw->Signature) != US_BULK_CS_SIGN) {
+        dev_err(&us->interface->dev, "CSW签名错误\n");
+        return -EPROTO;
+    }
+    
+    if (us->csw->Tag != cmd->tag) {
+        this_cpu_inc(us->stats->tag_mismatches);
+        dev_err(&us->interface->dev, "CSW标签不匹配\n");
+        return -EPROTO;
+    }
+    
+    cmd->residue = le32_to_cpu(us->csw->Residue);
+    
+    if (us->csw->Status == US_BULK_STAT_PHASE) {
+        dev_err(&us->interface->dev, "相位错误\n");
+        return -EPROTO;
+    }
+    
+    /* 检查状态 */
+    if (us->csw->Status != US_BULK_STAT_OK) {
+        dev_err(&us->interface->dev, "命令失败: 状态=%d\n",
+                us->csw->Status);
+        return -EIO;
+    }
+    
+    return 0;
+}
+
+/* CBW完成：立即提交数据或CSW阶段 */
+static void storage_cbw_callback(struct urb *urb)
+{
+    struct usb_storage *us = urb->context;
+    struct storage_cmd *cmd = us->cur_cmd;
+    u64 now;
+    int result;
+    
+    if (urb->status) {
+        dev_err(&us->interface->dev, "发送CBW失败: %d\n", urb->status);
+        storage_bot_error(us, storage_urb_result(us, urb->status),
+                          STORAGE_RECOVER_RESET);
+        return;
+    }
+    
+    now = storage_stat_latency(us, cmd, STORAGE_STAT_CMD, cmd->phase_ns);
+    storage_rto_sample(&us->rto[STORAGE_RTO_CTRL],
+                       div_u64(now - cmd->phase_ns, NSEC_PER_USEC));
+    cmd->phase_ns = now;
+    
+    if (cmd->length > 0)
+        result = storage_transfer_data(us, cmd);
+    else
+        result = storage_get_status(us);
+    
+    if (result)
+        storage_finish(us, result);
+}
+
+/* 数据阶段完成：立即提交CSW阶段 */
+static void storage_data_callback(struct urb *urb)
+{
+    struct usb_storage *us = urb->context;
+    struct storage_cmd *cmd = us->cur_cmd;
+    u64 now;
+    int result;
+    
+    if (urb->status) {
+        dev_err(&us->interface->dev, "数据传输失败: %d\n", urb->status);
+        /* STALL表示设备提前结束了数据阶段，清除halt后仍有CSW */
+        cmd->actual += urb->actual_length;
+        storage_bot_error(us, storage_urb_result(us, urb->status),
+                          urb->status == -EPIPE ?
+                          STORAGE_RECOVER_DATA_STALL : STORAGE_RECOVER_RESET);
+        return;
+    }
+    
+    cmd->actual += urb->actual_length;
+    
+    /* 读进bounce缓冲区的数据复制回高端内存页 */
+    if (us->bounce_page && cmd->direction == DMA_FROM_DEVICE)
+        memcpy_to_page(us->bounce_page, us->bounce_off, us->data_bounce,
+                       urb->actual_length);
+    
+    /* 逐段模式：本段传满则继续下一段，短包表示数据阶段提前结束 */
+    if (us->data_sg_left &&
+        urb->actual_length == urb->transfer_buffer_length) {
+        storage_fill_data_urb(us, cmd);
+        result = storage_submit_phase(us, urb, STORAGE_PHASE_DATA,
+                                      storage_rto_timeout(us, STORAGE_RTO_DATA,
+                                                          cmd));
+        if (result) {
+            dev_err(&us->interface->dev, "数据传输失败: %d\n", result);
+            storage_finish(us, result);
+        }
+        return;
+    }
+    
+    now = storage_stat_latency(us, cmd, STORAGE_STAT_DATA, cmd->phase_ns);
+    storage_rto_sample(&us->rto[STORAGE_RTO_DATA],
+                       div_u64(div_u64(now - cmd->phase_ns, NSEC_PER_USEC) *
+                               STORAGE_RTO_DATA_UNIT,
+                               max_t(u32, cmd->actual, STORAGE_RTO_DATA_UNIT)));
+    cmd->phase_ns = now;
+    
+    if (cmd->actual != cmd->length) {
+        this_cpu_inc(us->stats->short_transfers);
+        dev_warn(&us->interface->dev,
+                "数据传输不完整: %u/%u\n",
+                cmd->actual, cmd->length);
+    }
+    
+    result = storage_get_status(us);
+    if (result)
+        storage_finish(us, result);
+}
+
+/*
+ * 自动REQUEST SENSE完成：解析原命令的sense数据。UNIT ATTENTION只是
+ * 通知介质更换或复位，原命令重新排到队首；其他情况原命令以-EIO结束
+ */
+static void storage_sense_done(struct storage_cmd *sc)
+{
+    struct storage_cmd *cmd = sc->context;
+    struct usb_storage *us = cmd->lun->us;
+    unsigned long flags;
+    int key = -1;
+    
+    if (!sc->result) {
+        key = storage_handle_sense(cmd->lun, us->sense_buf, sc->actual);
+        if (cmd->sense) {
+            cmd->sense_len = min(sc->actual, STORAGE_PT_SENSE_LEN);
+            memcpy(cmd->sense, us->sense_buf, cmd->sense_len);
+        }
+    } else {
+        /* REQUEST SENSE本身失败，复位后原命令的sense数据已经丢失 */
+        cmd->sense_len = 0;
+    }
+    
+    storage_bus_release(us, cmd);
+    
+    /* 直通命令把UNIT ATTENTION交给调用者 */
+    if (key == UNIT_ATTENTION && !cmd->sense && cmd->retries < max_retries) {
+        spin_lock_irqsave(&us->lock, flags);
+        if (!us->disconnected) {
+            cmd->retries++;
+            cmd->actual = 0;
+            cmd->residue = 0;
+            list_add(&cmd->node, &cmd->lun->cmd_queue);
+            spin_unlock_irqrestore(&us->lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&us->lock, flags);
+    }
+    
+    storage_stat_latency(us, cmd, STORAGE_STAT_TOTAL, cmd->start_ns);
+    cmd->result = -EIO;
+    cmd->done(cmd);
+}
+
+/* CSW报告命令失败：BOT设备只保留到下一条命令的sense数据，立即读出 */
+static void storage_bot_request_sense(struct usb_storage *us,
+                                      struct storage_cmd *cmd)
+{
+    struct storage_cmd *sc = &us->sense_cmd;
+    unsigned long flags;
+    int result;
+    
+    memset(sc->cdb, 0, sizeof(sc->cdb));
+    sc->cdb[0] = REQUEST_SENSE;
+    sc->cdb[4] = STORAGE_SENSE_LEN;
+    sc->cdb_len = 6;
+    sg_init_one(&us->sense_sg, us->sense_buf, STORAGE_SENSE_LEN);
+    sc->sg = &us->sense_sg;
+    sc->nents = 1;
+    sc->length = STORAGE_SENSE_LEN;
+    sc->direction = DMA_FROM_DEVICE;
+    sc->actual = 0;
+    sc->residue = 0;
+    sc->result = 0;
+    sc->retries = 0;
+    sc->bus_bytes = 0;
+    sc->timeout_ms = 0;
+    sc->sense = NULL;
+    /* 复位后sense数据没有意义，传输失败时不重试，由完成回调结束原命令 */
+    sc->no_retry = true;
+    sc->lun = cmd->lun;
+    sc->done = storage_sense_done;
+    sc->context = cmd;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    us->cur_cmd = sc;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    result = storage_send_command(us, sc);
+    if (result)
+        storage_finish(us, result);
+}
+
+/* CSW完成：校验后结束命令 */
+static void storage_csw_callback(struct urb *urb)
+{
+    struct usb_storage *us = urb->context;
+    struct storage_cmd *cmd = us->cur_cmd;
+    int result;
+    
+    if (urb->status) {
+        dev_err(&us->interface->dev, "接收CSW失败: %d\n", urb->status);
+        storage_bot_error(us, storage_urb_result(us, urb->status),
+                          urb->status == -EPIPE ?
+                          STORAGE_RECOVER_CSW_STALL : STORAGE_RECOVER_RESET);
+        return;
+    }
+    
+    storage_stat_latency(us, cmd, STORAGE_STAT_STATUS, cmd->phase_ns);
+    result = storage_check_status(us, cmd, urb->actual_length);
+    if (result == -EPROTO) {
+        storage_bot_error(us, -EIO, STORAGE_RECOVER_RESET);
+        return;
+    }
+    
+    if (result == -EIO && cmd != &us->sense_cmd) {
+        storage_stat_error(us, STORAGE_STAT_STATUS);
+        storage_bot_request_sense(us, cmd);
+        return;
+    }
+    
+    storage_finish(us, result);
+}
+
+/*
+ * 按差额轮询（DRR）在各LUN之间选出下一条命令：轮到的LUN额度够发
+ * 队首命令就发出并扣除额度，不够就加一份额度换下一个LUN。按字节
+ * 计费，一个LUN上的大块连续传输不会饿死其他卡槽。调用时持有us->lock
+ */
+static struct storage_cmd *storage_dequeue(struct usb_storage *us)
+{
+    struct storage_lun *lun;
+    struct storage_cmd *cmd;
+    unsigned int i;
+    bool busy;
+    
+    if (us->disconnected || !us->nluns)
+        return NULL;
+    
+    do {
+        busy = false;
+        for (i = 0; i < us->nluns; i++) {
+            lun = us->luns[us->rr_next];
+            if (list_empty(&lun->cmd_queue)) {
+                lun->deficit = 0;
+                us->rr_next = (us->rr_next + 1) % us->nluns;
+                continue;
+            }
+            
+            busy = true;
+            cmd = list_first_entry(&lun->cmd_queue, struct storage_cmd, node);
+            if (cmd->length <= lun->deficit) {
+                /* 总线额度不够时等其他设备的命令完成后再唤醒 */
+                if (!storage_bus_admit(us, cmd))
+                    return NULL;
+                lun->deficit -= cmd->length;
+                list_del_init(&cmd->node);
+                return cmd;
+            }
+            
+            lun->deficit += STORAGE_LUN_QUANTUM;
+            us->rr_next = (us->rr_next + 1) % us->nluns;
+        }
+    } while (busy);
+    
+    return NULL;
+}
+
+/* 从队列取出下一条命令并发出CBW */
+static void storage_bot_kick(struct usb_storage *us)
+{
+    struct storage_cmd *cmd;
+    unsigned long flags;
+    int result;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    cmd = us->cur_cmd ? NULL : storage_dequeue(us);
+    if (!cmd) {
+        spin_unlock_irqrestore(&us->lock, flags);
+        return;
+    }
+    us->cur_cmd = cmd;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    result = storage_send_command(us, cmd);
+    if (result)
+        storage_finish(us, result);
+}
+
+/* Bulk-Only Mass Storage Reset，然后清除两个批量管道的halt */
+static int storage_bot_reset(struct usb_storage *us)
+{
+    int result;
+    
+    result = usb_control_msg(us->udev, usb_sndctrlpipe(us->udev, 0),
+                            US_BULK_RESET_REQUEST,
+                            USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                            0,
+                            us->interface->cur_altsetting->desc.bInterfaceNumber,
+                            NULL, 0, STORAGE_CMD_TIMEOUT);
+    if (result < 0)
+        return result;
+    
+    result = usb_clear_halt(us->udev, us->recv_bulk_pipe);
+    if (result)
+        return result;
+    
+    return usb_clear_halt(us->udev, us->send_bulk_pipe);
+}
+
+/*
+ * 错误恢复：STALL先只清除对应管道的halt并继续读CSW，仍失败或其他
+ * 错误时复位设备，然后把命令放回队首重试，重试max_retries次后放弃
+ */
+static void storage_reset_work(struct work_struct *work)
+{
+    struct usb_storage *us = container_of(work, struct usb_storage,
+                                          reset_work);
+    struct device *dev = &us->interface->dev;
+    struct storage_cmd *cmd = us->cur_cmd;
+    unsigned long flags;
+    unsigned int pipe;
+    int result;
+    
+    if (READ_ONCE(us->disconnected)) {
+        storage_finish(us, -ENODEV);
+        return;
+    }
+    
+    switch (us->recovery) {
+    case STORAGE_RECOVER_DATA_STALL:
+        pipe = (cmd->direction == DMA_FROM_DEVICE) ?
+               us->recv_bulk_pipe : us->send_bulk_pipe;
+        if (usb_clear_halt(us->udev, pipe) == 0)
+            goto get_status;
+        break;
+    case STORAGE_RECOVER_CSW_STALL:
+        if (!us->csw_retried &&
+            usb_clear_halt(us->udev, us->recv_bulk_pipe) == 0) {
+            us->csw_retried = true;
+            goto get_status;
+        }
+        break;
+    case STORAGE_RECOVER_RESET:
+        break;
+    }
+    
+    this_cpu_inc(us->stats->resets);
+    result = storage_bot_reset(us);
+    if (result) {
+        dev_err(dev, "复位失败: %d\n", result);
+        storage_finish(us, us->recovery_result);
+        return;
+    }
+    
+    if (cmd->no_retry || cmd->retries >= max_retries) {
+        dev_err(dev, "命令0x%02x重试%u次后放弃\n", cmd->cdb[0], cmd->retries);
+        storage_finish(us, us->recovery_result);
+        return;
+    }
+    
+    spin_lock_irqsave(&us->lock, flags);
+    if (us->disconnected) {
+        spin_unlock_irqrestore(&us->lock, flags);
+        storage_finish(us, -ENODEV);
+        return;
+    }
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    storage_bus_release(us, cmd);
+    
+    spin_lock_irqsave(&us->lock, flags);
+    cmd->retries++;
+    cmd->actual = 0;
+    cmd->residue = 0;
+    list_add(&cmd->node, &cmd->lun->cmd_queue);
+    us->cur_cmd = NULL;
+    us->phase = STORAGE_PHASE_IDLE;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    this_cpu_inc(us->stats->retries);
+    dev_info(dev, "复位完成，重试命令0x%02x（第%u次）\n",
+             cmd->cdb[0], cmd->retries);
+    storage_kick(us);
+    return;
+    
+get_status:
+    result = storage_get_status(us);
+    if (result)
+        storage_finish(us, result);
+}
+
+static const struct storage_transport storage_bot_transport = {
+    .name = "BOT",
+    .kick = storage_bot_kick,
+};
+
+/*
+ * UAS（USB Attached SCSI）传输
+ *
+ * 命令IU走命令管道，状态IU走状态管道，数据走数据输入/输出管道。
+ * 每个标签有独立的URB和IU缓冲区，可以同时有多条命令在设备上。
+ * SuperSpeed下用bulk streams（stream ID等于标签）把状态和数据
+ * 对应到命令；高速设备没有streams，设备先发READ READY/WRITE READY
+ * IU，收到后才提交该标签的数据URB
+ */
+
+/* 标签上还未完成的部分 */
+#define UAS_PENDING_CMD      (1 << 0)   /* 命令IU在传输 */
+#define UAS_PENDING_STATUS   (1 << 1)   /* 等待状态IU */
+#define UAS_PENDING_DATA     (1 << 2)   /* 数据URB未完成 */
+
+/* 命令结束或出错时取消标签上的数据URB */
+static void storage_uas_unlink_data(struct storage_uas_tag *t)
+{
+    if ((t->pending & UAS_PENDING_DATA) && t->data_submitted)
+        usb_unlink_urb(t->data_urb);
+}
+
+/* 记录标签的第一个错误 */
+static void storage_uas_set_error(struct storage_uas_tag *t, int result)
+{
+    if (!t->cmd->result)
+        t->cmd->result = t->timed_out ? -ETIMEDOUT : result;
+}
+
+/* 所有部分都完成后释放标签并通知调用者，调用时不持有锁 */
+static void storage_uas_try_finish(struct usb_storage *us,
+                                   struct storage_uas_tag *t)
+{
+    struct storage_cmd *cmd = NULL;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    if (t->cmd && !t->pending) {
+        cmd = t->cmd;
+        t->cmd = NULL;
+        clear_bit(t->index, us->uas_tag_busy);
+    }
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (!cmd)
+        return;
+    
+    storage_stat_latency(us, cmd, STORAGE_STAT_TOTAL, cmd->start_ns);
+    storage_bus_release(us, cmd);
+    cmd->residue = cmd->length - cmd->actual;
+    cmd->done(cmd);
+    
+    storage_kick(us);
+}
+
+/* 提交一个状态URB，有streams时用标签自己的URB，否则从池中取一个 */
+static int storage_uas_post_status(struct usb_storage *us,
+                                   struct storage_uas_tag *t)
+{
+    struct storage_uas_tag *s;
+    unsigned int idx;
+    unsigned long flags;
+    int result;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    if (us->uas_streams) {
+        idx = t->index;
+    } else {
+        idx = find_first_zero_bit(us->uas_stat_busy, us->uas_ntags);
+        if (WARN_ON(idx >= us->uas_ntags)) {
+            spin_unlock_irqrestore(&us->lock, flags);
+            return -EBUSY;
+        }
+    }
+    set_bit(idx, us->uas_stat_busy);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    s = &us->uas_tags[idx];
+    usb_fill_bulk_urb(s->stat_urb, us->udev, us->status_pipe,
+                     s->sense, sizeof(*s->sense),
+                     storage_uas_stat_callback, s);
+    s->stat_urb->stream_id = us->uas_streams ? t->index + 1 : 0;
+    
+    usb_anchor_urb(s->stat_urb, &us->anchor);
+    result = usb_submit_urb(s->stat_urb, GFP_ATOMIC);
+    if (result) {
+        usb_unanchor_urb(s->stat_urb);
+        clear_bit(idx, us->uas_stat_busy);
+    }
+    
+    return result;
+}
+
+/* 提交标签的数据URB，bio页通过sg表直接交给主机控制器 */
+static int storage_uas_submit_data(struct usb_storage *us,
+                                   struct storage_uas_tag *t)
+{
+    struct storage_cmd *cmd = t->cmd;
+    struct urb *urb = t->data_urb;
+    unsigned int pipe;
+    int result;
+    
+    pipe = (cmd->direction == DMA_FROM_DEVICE) ?
+           us->recv_bulk_pipe : us->send_bulk_pipe;
+    
+    usb_fill_bulk_urb(urb, us->udev, pipe, NULL, cmd->length,
+                     storage_uas_data_callback, t);
+    urb->sg = cmd->sg;
+    urb->num_sgs = cmd->nents;
+    urb->stream_id = us->uas_streams ? t->index + 1 : 0;
+    
+    t->data_submitted = true;
+    t->data_ns = ktime_get_ns();
+    usb_anchor_urb(urb, &us->anchor);
+    result = usb_submit_urb(urb, GFP_ATOMIC);
+    if (result) {
+        usb_unanchor_urb(urb);
+        t->data_submitted = false;
+    }
+    
+    return result;
+}
+
+/* 命令IU发送完成 */
+static void storage_uas_cmd_callback(struct urb *urb)
+{
+    struct storage_uas_tag *t = urb->context;
+    struct usb_storage *us = t->us;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    t->pending &= ~UAS_PENDING_CMD;
+    if (urb->status) {
+        storage_stat_error(us, STORAGE_STAT_CMD);
+        storage_uas_set_error(t, urb->status);
+    } else {
+        /* 命令IU的完成通知可能晚于数据阶段到达 */
+        t->cmd->phase_ns = max(t->cmd->phase_ns,
+                               storage_stat_latency(us, t->cmd,
+                                                    STORAGE_STAT_CMD,
+                                                    t->cmd->start_ns));
+    }
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (urb->status && urb->status != -ENOENT &&
+        urb->status != -ECONNRESET && urb->status != -ESHUTDOWN) {
+        /* 设备没收到命令，状态IU不会再来，取消所有URB */
+        dev_err(&us->interface->dev, "发送命令IU失败: %d\n", urb->status);
+        usb_unlink_anchored_urbs(&us->anchor);
+    }
+    
+    storage_uas_try_finish(us, t);
+}
+
+/* 数据URB完成 */
+static void storage_uas_data_callback(struct urb *urb)
+{
+    struct storage_uas_tag *t = urb->context;
+    struct usb_storage *us = t->us;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    t->pending &= ~UAS_PENDING_DATA;
+    t->cmd->actual = urb->actual_length;
+    if (urb->status) {
+        dev_err(&us->interface->dev, "数据传输失败: %d\n", urb->status);
+        storage_stat_error(us, STORAGE_STAT_DATA);
+        storage_uas_set_error(t, urb->status);
+    } else {
+        /* 数据阶段从提交数据URB算起，之后等待状态IU */
+        t->cmd->phase_ns = storage_stat_latency(us, t->cmd, STORAGE_STAT_DATA,
+                                                t->data_ns);
+        if (t->cmd->actual < t->cmd->length)
+            this_cpu_inc(us->stats->short_transfers);
+    }
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    storage_uas_try_finish(us, t);
+}
+
+/* 状态URB出错：有streams时只影响本标签，否则所有等待状态的标签都失败 */
+static void storage_uas_stat_error(struct usb_storage *us,
+                                   struct storage_uas_tag *s, int status)
+{
+    struct storage_uas_tag *t;
+    unsigned long flags;
+    unsigned int i;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    for (i = 0; i < us->uas_ntags; i++) {
+        t = &us->uas_tags[i];
+        if (us->uas_streams && t != s)
+            continue;
+        if (!t->cmd || !(t->pending & UAS_PENDING_STATUS))
+            continue;
+        t->pending &= ~UAS_PENDING_STATUS;
+        storage_uas_set_error(t, status);
+        if (!t->data_submitted)
+            t->pending &= ~UAS_PENDING_DATA;
+        storage_uas_unlink_data(t);
+    }
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    for (i = 0; i < us->uas_ntags; i++)
+        storage_uas_try_finish(us, &us->uas_tags[i]);
+}
+
+/* 状态管道收到一个IU：按IU中的标签分发 */
+static void storage_uas_stat_callback(struct urb *urb)
+{
+    struct storage_uas_tag *s = urb->context;
+    struct usb_storage *us = s->us;
+    struct sense_iu *sense = s->sense;
+    struct storage_uas_tag *t;
+    unsigned long flags;
+    unsigned int tag;
+    unsigned int len;
+    bool ready = false;
+    int result;
+    
+    /*
+     * 没有streams时状态URB和IU缓冲区在标签之间共用，IU读完之前
+     * 不能清除忙标志，否则可能被重新提交
+     */
+    if (urb->status) {
+        clear_bit(s->index, us->uas_stat_busy);
+        if (urb->status != -ENOENT && urb->status != -ECONNRESET &&
+            urb->status != -ESHUTDOWN)
+            dev_err(&us->interface->dev, "接收状态IU失败: %d\n",
+                    urb->status);
+        storage_stat_error(us, STORAGE_STAT_STATUS);
+        storage_uas_stat_error(us, s, urb->status);
+        return;
+    }
+    
+    tag = be16_to_cpu(sense->tag);
+    if (tag == 0 || tag > us->uas_ntags) {
+        clear_bit(s->index, us->uas_stat_busy);
+        this_cpu_inc(us->stats->tag_mismatches);
+        dev_err(&us->interface->dev, "状态IU标签无效: %u\n", tag);
+        storage_uas_stat_error(us, s, -EIO);
+        return;
+    }
+    t = &us->uas_tags[tag - 1];
+    
+    spin_lock_irqsave(&us->lock, flags);
+    if (!t->cmd) {
+        clear_bit(s->index, us->uas_stat_busy);
+        spin_unlock_irqrestore(&us->lock, flags);
+        this_cpu_inc(us->stats->tag_mismatches);
+        dev_err(&us->interface->dev, "状态IU标签不匹配: %u\n", tag);
+        return;
+    }
+    
+    switch (sense->iu_id) {
+    case IU_ID_STATUS:
+        t->pending &= ~UAS_PENDING_STATUS;
+        storage_stat_latency(us, t->cmd, STORAGE_STAT_STATUS, t->cmd->phase_ns);
+        if (sense->status != SAM_STAT_GOOD) {
+            storage_stat_error(us, STORAGE_STAT_STATUS);
+            dev_err(&us->interface->dev, "命令失败: 状态=0x%02x\n",
+                    sense->status);
+            if (sense->status == SAM_STAT_CHECK_CONDITION) {
+                len = min_t(unsigned int, be16_to_cpu(sense->len),
+                            SCSI_SENSE_BUFFERSIZE);
+                storage_handle_sense(t->cmd->lun, sense->sense, len);
+                if (t->cmd->sense) {
+                    t->cmd->sense_len = min(len, STORAGE_PT_SENSE_LEN);
+                    memcpy(t->cmd->sense, sense->sense, t->cmd->sense_len);
+                }
+            }
+            storage_uas_set_error(t, -EIO);
+            storage_uas_unlink_data(t);
+        }
+        /* 没有收到READY就结束，说明没有数据阶段 */
+        if (!t->data_submitted)
+            t->pending &= ~UAS_PENDING_DATA;
+        break;
+    case IU_ID_READ_READY:
+    case IU_ID_WRITE_READY:
+        ready = !us->uas_streams && !t->data_submitted &&
+                (t->pending & UAS_PENDING_DATA);
+        break;
+    default:
+        /* RESPONSE IU等：设备拒绝了这条命令 */
+        dev_err(&us->interface->dev, "意外的IU: 0x%02x\n", sense->iu_id);
+        storage_stat_error(us, STORAGE_STAT_STATUS);
+        t->pending &= ~UAS_PENDING_STATUS;
+        storage_uas_set_error(t, -EIO);
+        if (!t->data_submitted)
+            t->pending &= ~UAS_PENDING_DATA;
+        storage_uas_unlink_data(t);
+        break;
+    }
+    /* IU已经处理完，状态URB可以再用 */
+    clear_bit(s->index, us->uas_stat_busy);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (ready) {
+        /* 先补一个状态URB接收最终的状态IU，再开始数据阶段 */
+        result = storage_uas_post_status(us, t);
+        if (!result)
+            result = storage_uas_submit_data(us, t);
+        if (result)
+            storage_uas_stat_error(us, NULL, result);
+        return;
+    }
+    
+    storage_uas_try_finish(us, t);
+}
+
+/* 在标签上发出一条命令：依次提交状态、数据（有streams时）和命令IU */
+static int storage_uas_start(struct usb_storage *us, struct storage_uas_tag *t)
+{
+    struct storage_cmd *cmd = t->cmd;
+    struct command_iu *iu = t->iu;
+    unsigned long flags;
+    int result;
+    
+    memset(iu, 0, sizeof(*iu));
+    iu->iu_id = IU_ID_COMMAND;
+    iu->tag = cpu_to_be16(t->index + 1);
+    iu->prio_attr = UAS_SIMPLE_TAG;
+    int_to_scsilun(cmd->lun->lun, &iu->lun);
+    memcpy(iu->cdb, cmd->cdb, cmd->cdb_len);
+    cmd->tag = t->index + 1;
+    cmd->start_ns = ktime_get_ns();
+    cmd->phase_ns = cmd->start_ns;
+    
+    t->data_submitted = false;
+    t->timed_out = false;
+    t->deadline = jiffies + msecs_to_jiffies(cmd->timeout_ms ?:
+                                             STORAGE_DATA_TIMEOUT);
+    t->pending = UAS_PENDING_CMD | UAS_PENDING_STATUS |
+                 (cmd->length ? UAS_PENDING_DATA : 0);
+    
+    if (!timer_pending(&us->timer))
+        mod_timer(&us->timer, jiffies + HZ);
+    
+    result = storage_uas_post_status(us, t);
+    if (result)
+        goto error;
+    
+    if (us->uas_streams && cmd->length) {
+        result = storage_uas_submit_data(us, t);
+        if (result)
+            goto error;
+    }
+    
+    usb_fill_bulk_urb(t->cmd_urb, us->udev, us->cmd_pipe,
+                     iu, sizeof(*iu), storage_uas_cmd_callback, t);
+    usb_anchor_urb(t->cmd_urb, &us->anchor);
+    result = usb_submit_urb(t->cmd_urb, GFP_ATOMIC);
+    if (result) {
+        usb_unanchor_urb(t->cmd_urb);
+        goto error;
+    }
+    
+    return 0;
+    
+error:
+    /* 已提交的URB被取消后由回调结束本标签 */
+    dev_err(&us->interface->dev, "提交UAS命令失败: %d\n", result);
+    spin_lock_irqsave(&us->lock, flags);
+    t->pending &= ~UAS_PENDING_CMD;
+    storage_uas_set_error(t, result);
+    spin_unlock_irqrestore(&us->lock, flags);
+    storage_uas_stat_error(us, us->uas_streams ? t : NULL, result);
+    return result;
+}
+
+/*
+ * 有空闲标签就从队列取命令发出。发出失败的命令已经带着错误结束，
+ * 继续处理队列里剩下的命令，不让它们等不到下一次唤醒
+ */
+static void storage_uas_kick(struct usb_storage *us)
+{
+    struct storage_cmd *cmd;
+    struct storage_uas_tag *t;
+    unsigned long flags;
+    unsigned int idx;
+    
+    for (;;) {
+        spin_lock_irqsave(&us->lock, flags);
+        idx = find_first_zero_bit(us->uas_tag_busy, us->uas_ntags);
+        cmd = idx < us->uas_ntags ? storage_dequeue(us) : NULL;
+        if (!cmd) {
+            spin_unlock_irqrestore(&us->lock, flags);
+            return;
+        }
+        set_bit(idx, us->uas_tag_busy);
+        t = &us->uas_tags[idx];
+        t->cmd = cmd;
+        spin_unlock_irqrestore(&us->lock, flags);
+        
+        storage_uas_start(us, t);
+    }
+}
+
+/* UAS超时检查：每秒扫描一次，有超时的标签就取消所有URB */
+static void storage_uas_timeout(struct timer_list *timer)
+{
+    struct usb_storage *us = from_timer(us, timer, timer);
+    struct storage_uas_tag *t;
+    unsigned long flags;
+    bool expired = false;
+    bool busy = false;
+    unsigned int i;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    for (i = 0; i < us->uas_ntags; i++) {
+        t = &us->uas_tags[i];
+        if (!t->cmd)
+            continue;
+        busy = true;
+        if (time_after_eq(jiffies, t->deadline)) {
+            t->timed_out = true;
+            expired = true;
+        }
+    }
+    if (busy && !us->disconnected)
+        mod_timer(&us->timer, jiffies + HZ);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (expired) {
+        dev_warn(&us->interface->dev, "UAS命令超时\n");
+        usb_unlink_anchored_urbs(&us->anchor);
+    }
+}
+
+static const struct storage_transport storage_uas_transport = {
+    .name = "UAS",
+    .kick = storage_uas_kick,
+};
+
+/* 从端点的额外描述符中找到UAS的Pipe Usage描述符 */
+static int storage_uas_pipe_id(struct usb_host_endpoint *ep)
+{
+    unsigned char *buf = ep->extra;
+    int len = ep->extralen;
+    
+    while (len >= 3) {
+        if (buf[0] < 2 || buf[0] > len)
+            break;
+        if (buf[1] == USB_DT_PIPE_USAGE && buf[0] >= 3)
+            return buf[2];
+        len -= buf[0];
+        buf += buf[0];
+    }
+    
+    return 0;
+}
+
+/* 查找UAS备用设置，找到时返回它的四个端点 */
+static struct usb_host_interface *
+storage_uas_find_alt(struct usb_interface *interface,
+                     struct usb_host_endpoint *eps[4])
+{
+    struct usb_host_interface *alt;
+    int i, j, id;
+    
+    for (i = 0; i < interface->num_altsetting; i++) {
+        alt = &interface->altsetting[i];
+        if (alt->desc.bInterfaceClass != USB_CLASS_MASS_STORAGE ||
+            alt->desc.bInterfaceProtocol != STORAGE_PR_UAS)
+            continue;
+        
+        memset(eps, 0, 4 * sizeof(eps[0]));
+        for (j = 0; j < alt->desc.bNumEndpoints; j++) {
+            id = storage_uas_pipe_id(&alt->endpoint[j]);
+            if (id >= CMD_PIPE_ID && id <= DATA_OUT_PIPE_ID &&
+                usb_endpoint_xfer_bulk(&alt->endpoint[j].desc))
+                eps[id - 1] = &alt->endpoint[j];
+        }
+        
+        if (eps[0] && eps[1] && eps[2] && eps[3])
+            return alt;
+    }
+    
+    return NULL;
+}
+
+/* 释放UAS资源 */
+static void storage_uas_free(struct usb_storage *us)
+{
+    unsigned int i;
+    
+    if (us->uas_streams)
+        usb_free_streams(us->interface, us->uas_eps, 3, GFP_NOIO);
+    
+    for (i = 0; us->uas_tags && i < us->uas_ntags; i++) {
+        usb_free_urb(us->uas_tags[i].cmd_urb);
+        usb_free_urb(us->uas_tags[i].data_urb);
+        usb_free_urb(us->uas_tags[i].stat_urb);
+        kfree(us->uas_tags[i].iu);
+        kfree(us->uas_tags[i].sense);
+    }
+    kfree(us->uas_tags);
+    bitmap_free(us->uas_tag_busy);
+    bitmap_free(us->uas_stat_busy);
+    us->uas_tags = NULL;
+    us->uas_tag_busy = NULL;
+    us->uas_stat_busy = NULL;
+    us->uas_streams = 0;
+}
+
+/*
+ * 切换到UAS备用设置并分配每个标签的URB。返回-ENODEV表示设备
+ * 或主机控制器不支持UAS，调用者回退到BOT
+ */
+static int storage_uas_init(struct usb_storage *us)
+{
+    struct usb_interface *interface = us->interface;
+    struct usb_host_endpoint *eps[4];
+    struct usb_host_interface *alt;
+    struct storage_uas_tag *t;
+    unsigned int i;
+    int result;
+    
+    alt = storage_uas_find_alt(interface, eps);
+    if (!alt)
+        return -ENODEV;
+    
+    /* 数据阶段直接使用sg表，主机控制器必须支持SG */
+    if (!us->udev->bus->sg_tablesize) {
+        dev_warn(&interface->dev, "主机控制器不支持SG，使用BOT\n");
+        return -ENODEV;
+    }
+    
+    result = usb_set_interface(us->udev, alt->desc.bInterfaceNumber,
+                               alt->desc.bAlternateSetting);
+    if (result)
+        return result;
+    
+    us->cmd_pipe = usb_sndbulkpipe(us->udev, usb_endpoint_num(&eps[0]->desc));
+    us->status_pipe = usb_rcvbulkpipe(us->udev, usb_endpoint_num(&eps[1]->desc));
+    us->recv_bulk_pipe = usb_rcvbulkpipe(us->udev, usb_endpoint_num(&eps[2]->desc));
+    us->send_bulk_pipe = usb_sndbulkpipe(us->udev, usb_endpoint_num(&eps[3]->desc));
+    
+    /* SuperSpeed用streams区分标签，stream ID从1开始 */
+    us->uas_ntags = STORAGE_UAS_NOSTREAM_TAGS;
+    if (us->udev->speed >= USB_SPEED_SUPER) {
+        us->uas_eps[0] = eps[1];
+        us->uas_eps[1] = eps[2];
+        us->uas_eps[2] = eps[3];
+        result = usb_alloc_streams(interface, us->uas_eps, 3,
+                                   STORAGE_UAS_MAX_TAGS, GFP_NOIO);
+        if (result < 2) {
+            dev_err(&interface->dev, "分配streams失败: %d\n", result);
+            goto error_alt;
+        }
+        us->uas_streams = result;
+        us->uas_ntags = result;
+    }
+    
+    result = -ENOMEM;
+    us->uas_tags = kcalloc(us->uas_ntags, sizeof(*us->uas_tags), GFP_KERNEL);
+    us->uas_tag_busy = bitmap_zalloc(us->uas_ntags, GFP_KERNEL);
+    us->uas_stat_busy = bitmap_zalloc(us->uas_ntags, GFP_KERNEL);
+    if (!us->uas_tags || !us->uas_tag_busy || !us->uas_stat_busy)
+        goto error;
+    
+    for (i = 0; i < us->uas_ntags; i++) {
+        t = &us->uas_tags[i];
+        t->us = us;
+        t->index = i;
+        t->cmd_urb = usb_alloc_urb(0, GFP_KERNEL);
+        t->data_urb = usb_alloc_urb(0, GFP_KERNEL);
+        t->stat_urb = usb_alloc_urb(0, GFP_KERNEL);
+        t->iu = kmalloc(sizeof(*t->iu), GFP_KERNEL);
+        t->sense = kmalloc(sizeof(*t->sense), GFP_KERNEL);
+        if (!t->cmd_urb || !t->data_urb || !t->stat_urb ||
+            !t->iu || !t->sense)
+            goto error;
+    }
+    
+    us->transport = &storage_uas_transport;
+    timer_setup(&us->timer, storage_uas_timeout, 0);
+    
+    dev_info(&interface->dev, "使用UAS: %u个标签, %d个streams\n",
+             us->uas_ntags, us->uas_streams);
+    
+    return 0;
+    
+error:
+    storage_uas_free(us);
+error_alt:
+    usb_set_interface(us->udev, interface->altsetting[0].desc.bInterfaceNumber,
+                      interface->altsetting[0].desc.bAlternateSetting);
+    return result;
+}
+
+/* 把命令交给当前传输层 */
+static void storage_kick(struct usb_storage *us)
+{
+    us->transport->kick(us);
+}
+
+/* 异步提交命令，完成时调用cmd->done */
+static int storage_submit_command(struct usb_storage *us,
+                                 struct storage_cmd *cmd)
+{
+    unsigned long flags;
+    
+    cmd->actual = 0;
+    cmd->residue = 0;
+    cmd->result = 0;
+    cmd->retries = 0;
+    cmd->bus_bytes = 0;
+    
+    spin_lock_irqsave(&us->lock, flags);
+    if (us->disconnected) {
+        spin_unlock_irqrestore(&us->lock, flags);
+        return -ENODEV;
+    }
+    list_add_tail(&cmd->node, &cmd->lun->cmd_queue);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    storage_kick(us);
+    return 0;
+}
+
+/* 同步命令的完成回调 */
+static void storage_sync_done(struct storage_cmd *cmd)
+{
+    struct usb_storage *us = cmd->context;
+    
+    WRITE_ONCE(us->sync_done_ns, ktime_get_ns());
+    complete(&us->command_done);
+}
+
+/*
+ * 等待同步命令完成。快速SSD上小命令的完成中断和唤醒线程占了延迟
+ * 的一大块，不超过poll_max_kb的命令先忙等poll_budget_us，超出预算
+ * 再睡眠。两种情况下从完成到继续执行的时间分别计入统计
+ */
+static void storage_sync_wait(struct usb_storage *us, unsigned int length)
+{
+    unsigned int budget = READ_ONCE(poll_budget_us);
+    u64 start, end, now;
+    
+    if (budget && length <= READ_ONCE(poll_max_kb) * 1024) {
+        start = ktime_get_ns();
+        end = start + (u64)budget * NSEC_PER_USEC;
+        do {
+            if (completion_done(&us->command_done)) {
+                now = ktime_get_ns();
+                atomic64_add(now - start, &us->poll_spin_ns);
+                atomic64_add(now - READ_ONCE(us->sync_done_ns),
+                             &us->poll_observe_ns);
+                atomic64_inc(&us->poll_hits);
+                wait_for_completion(&us->command_done);
+                return;
+            }
+            cpu_relax();
+            now = ktime_get_ns();
+        } while (now < end);
+        atomic64_add(now - start, &us->poll_spin_ns);
+        atomic64_inc(&us->poll_misses);
+    }
+    
+    wait_for_completion(&us->command_done);
+    atomic64_add(ktime_get_ns() - READ_ONCE(us->sync_done_ns), &us->wake_ns);
+    atomic64_inc(&us->wake_count);
+}
+
+/* 同步执行一条已经填好的命令 */
+static int storage_execute_cmd(struct usb_storage *us, struct storage_cmd *scmd)
+{
+    int result;
+    
+    scmd->done = storage_sync_done;
+    scmd->context = us;
+    
+    mutex_lock(&us->io_mutex);
+    
+    /* 提交命令，三个阶段在回调中完成 */
+    reinit_completion(&us->command_done);
+    result = storage_submit_command(us, scmd);
+    if (result)
+        goto out;
+    
+    /* 等待CSW校验完成 */
+    storage_sync_wait(us, scmd->length);
+    result = scmd->result;
+    
+out:
+    mutex_unlock(&us->io_mutex);
+    return result;
+}
+
+/* 执行SCSI命令 */
+static int storage_execute_sg(struct storage_lun *lun,
+                              unsigned char *cmd, int cmd_len,
+                              struct scatterlist *sg, unsigned int nents,
+                              unsigned int length, int direction)
+{
+    struct storage_cmd scmd = {
+        .cdb_len   = cmd_len,
+        .sg        = sg,
+        .nents     = nents,
+        .length    = length,
+        .direction = direction,
+        .lun       = lun,
+    };
+    
+    memcpy(scmd.cdb, cmd, cmd_len);
+    return storage_execute_cmd(lun->us, &scmd);
+}
+
+/* 同步执行一条命令，数据在一个连续缓冲区中 */
+static int storage_execute_command(struct storage_lun *lun,
+                                  unsigned char *cmd, int cmd_len,
+                                  void *buffer, unsigned int buf_len,
+                                  int direction)
+{
+    struct scatterlist sg;
+    
+    /* buffer必须可以DMA（kmalloc分配，不能在栈上） */
+    if (buf_len == 0)
+        return storage_execute_sg(lun, cmd, cmd_len, NULL, 0, 0, direction);
+    
+    sg_init_one(&sg, buffer, buf_len);
+    return storage_execute_sg(lun, cmd, cmd_len, &sg, 1, buf_len, direction);
+}
+
+/* INQUIRY命令 - 获取设备信息 */
+static int storage_inquiry_id(struct storage_lun *lun, char *vendor,
+                              char *product, u8 *version)
+{
+    unsigned char cmd[6] = {
+        INQUIRY,        /* 操作码 */
+        0,              /* LUN/EVPD */
+        0,              /* 页面码 */
+        0,              /* 保留 */
+        36,             /* 分配长度 */
+        0               /* 控制 */
+    };
+    unsigned char *data;
+    int result;
+    
+    /* 数据阶段直接DMA，缓冲区不能放在栈上 */
+    data = kmalloc(36, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    
+    result = storage_execute_command(lun, cmd, 6,
+                                    data, 36, DMA_FROM_DEVICE);
+    
+    if (result) {
+        dev_err(&lun->us->interface->dev, "INQUIRY命令失败\n");
+        goto out;
+    }
+    
+    /* 解析设备信息 */
+    memcpy(vendor, &data[8], 8);
+    vendor[8] = '\0';
+    memcpy(product, &data[16], 16);
+    product[16] = '\0';
+    *version = data[2];
+    
+out:
+    kfree(data);
+    return result;
+}
+
+/* INQUIRY并保存到lun */
+static int storage_inquiry(struct storage_lun *lun)
+{
+    int result;
+    
+    result = storage_inquiry_id(lun, lun->vendor, lun->product, &lun->version);
+    if (result)
+        return result;
+    
+    dev_info(&lun->us->interface->dev,
+            "LUN %u: %.8s %.16s\n",
+            lun->lun, lun->vendor, lun->product);
+    return 0;
+}
+
+/* TEST UNIT READY命令 */
+static int storage_test_unit_ready(struct storage_lun *lun)
+{
+    unsigned char cmd[6] = {
+        TEST_UNIT_READY,
+        0, 0, 0, 0, 0
+    };
+    
+    return storage_execute_command(lun, cmd, 6, NULL, 0, DMA_NONE);
+}
+
+/*
+ * SYNCHRONIZE CACHE(10)：让设备把自己的写缓存落盘。回ILLEGAL REQUEST
+ * 的U盘没有易失缓存，以后不再发送；UNIT ATTENTION重试一次
+ */
+static int storage_sync_cache(struct storage_lun *lun)
+{
+    u8 sense[STORAGE_PT_SENSE_LEN];
+    struct storage_cmd scmd;
+    int tries;
+    u8 key;
+    int result = 0;
+    
+    if (READ_ONCE(lun->no_sync_cache))
+        return 0;
+    
+    for (tries = 0; tries < 2; tries++) {
+        memset(&scmd, 0, sizeof(scmd));
+        scmd.cdb[0] = SYNCHRONIZE_CACHE;
+        scmd.cdb_len = 10;
+        scmd.direction = DMA_NONE;
+        scmd.lun = lun;
+        scmd.sense = sense;
+        
+        result = storage_execute_cmd(lun->us, &scmd);
+        if (!result || scmd.sense_len < 3)
+            return result;
+        
+        key = (sense[0] & 0x7f) >= 0x72 ? sense[1] & 0x0f : sense[2] & 0x0f;
+        if (key == ILLEGAL_REQUEST) {
+            WRITE_ONCE(lun->no_sync_cache, true);
+            return 0;
+        }
+        if (key != UNIT_ATTENTION)
+            break;
+    }
+    
+    return result;
+}
+
+/* READ CAPACITY(16)命令 - 容量超过2^32块时使用 */
+static int storage_get_capacity16(struct storage_lun *lun, u64 *capacity,
+                                  u32 *block_size, bool *lbpme)
+{
+    unsigned char cmd[16] = {
+        SERVICE_ACTION_IN_16,
+        SAI_READ_CAPACITY_16,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 32,    /* 分配长度 */
+        0, 0
+    };
+    unsigned char *data;
+    int result;
+    
+    data = kmalloc(32, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    
+    result = storage_execute_command(lun, cmd, 16,
+                                    data, 32, DMA_FROM_DEVICE);
+    
+    if (result) {
+        dev_err(&lun->us->interface->dev, "READ_CAPACITY(16)命令失败\n");
+        goto out;
+    }
+    
+    *capacity = get_unaligned_be64(data) + 1;
+    *block_size = get_unaligned_be32(data + 8);
+    *lbpme = data[14] & 0x80;
+    
+out:
+    kfree(data);
+    return result;
+}
+
+/* READ CAPACITY命令 - 获取容量，不修改lun */
+static int storage_get_capacity(struct storage_lun *lun, u64 *capacity,
+                                u32 *block_size, bool *lbpme)
+{
+    unsigned char cmd[10] = {
+        READ_CAPACITY,
+        0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+    unsigned char *data;
+    int result;
+    u32 max_lba;
+    
+    data = kmalloc(8, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    
+    result = storage_execute_command(lun, cmd, 10,
+                                    data, 8, DMA_FROM_DEVICE);
+    
+    if (result) {
+        dev_err(&lun->us->interface->dev, "READ_CAPACITY命令失败\n");
+        goto out;
+    }
+    
+    /* 解析容量信息 */
+    max_lba = be32_to_cpup((__be32 *)data);
+    
+    *capacity = (u64)max_lba + 1;
+    *block_size = be32_to_cpup((__be32 *)(data + 4));
+    *lbpme = false;
+    
+    /* 最大LBA为0xffffffff表示容量需要用READ CAPACITY(16)读取 */
+    if (max_lba == U32_MAX)
+        result = storage_get_capacity16(lun, capacity, block_size, lbpme);
+    
+out:
+    kfree(data);
+    return result;
+}
+
+/* 读取容量并保存到lun */
+static int storage_read_capacity(struct storage_lun *lun)
+{
+    u64 capacity;
+    u32 block_size;
+    bool lbpme;
+    int result;
+    
+    result = storage_get_capacity(lun, &capacity, &block_size, &lbpme);
+    if (result)
+        return result;
+    
+    lun->capacity = capacity;
+    lun->block_size = block_size;
+    lun->lbpme = lbpme;
+    
+    dev_info(&lun->us->interface->dev,
+            "容量: %llu块 x %u字节 = %llu MB\n",
+            lun->capacity, lun->block_size,
+            (lun->capacity * lun->block_size) >> 20);
+    return 0;
+}
+
+/* INQUIRY EVPD：读取一个VPD页，返回页长度（不含4字节页头） */
+static int storage_inquiry_vpd(struct storage_lun *lun, u8 page,
+                               unsigned char *buf, unsigned int len)
+{
+    unsigned char cmd[6] = { INQUIRY, 1, page, 0, len, 0 };
+    int result;
+    
+    memset(buf, 0, len);
+    result = storage_execute_command(lun, cmd, 6, buf, len, DMA_FROM_DEVICE);
+    if (result)
+        return result;
+    if (buf[1] != page)
+        return -EIO;
+    
+    return get_unaligned_be16(&buf[2]);
+}
+
+/*
+ * 检测discard支持：READ CAPACITY(16)的LBPME位表示设备做精简配置，
+ * Logical Block Provisioning页（B2h）说明支持UNMAP还是WRITE SAME
+ * 加UNMAP位，Block Limits页（B0h）给出每条命令的块数和描述符数上限。
+ * SPC-3之前的设备常在VPD请求上出错，不去检测
+ */
+static void storage_probe_discard(struct storage_lun *lun)
+{
+    struct device *dev = &lun->us->interface->dev;
+    bool has_b0 = false, has_b2 = false;
+    bool lbpu, lbpws, lbpme = false;
+    unsigned char *buf;
+    u64 max_ws = 0;
+    u64 capacity;
+    u32 block_size;
+    int len, i;
+    
+    lun->unmap_mode = STORAGE_UNMAP_NONE;
+    if (lun->version < STORAGE_SCSI_SPC3)
+        return;
+    
+    buf = kmalloc(STORAGE_VPD_LEN, GFP_KERNEL);
+    if (!buf)
+        return;
+    
+    /* 只取LBP位，容量和块大小以READ CAPACITY的结果为准 */
+    if (storage_get_capacity16(lun, &capacity, &block_size, &lbpme))
+        goto out;
+    lun->lbpme = lbpme;
+    if (!lbpme)
+        goto out;
+    
+    /* 支持的VPD页列表 */
+    len = storage_inquiry_vpd(lun, 0x00, buf, STORAGE_VPD_LEN);
+    if (len < 0)
+        goto out;
+    for (i = 4; i < min(len + 4, STORAGE_VPD_LEN); i++) {
+        has_b0 |= buf[i] == 0xb0;
+        has_b2 |= buf[i] == 0xb2;
+    }
+    if (!has_b2)
+        goto out;
+    
+    if (storage_inquiry_vpd(lun, 0xb2, buf, 8) < 0)
+        goto out;
+    lbpu = buf[5] & 0x80;
+    lbpws = buf[5] & 0x40;
+    
+    if (has_b0 && storage_inquiry_vpd(lun, 0xb0, buf, STORAGE_VPD_LEN) >= 0x3c) {
+        lun->max_unmap_blocks = get_unaligned_be32(&buf[20]);
+        lun->max_unmap_desc = get_unaligned_be32(&buf[24]);
+        lun->unmap_granularity = get_unaligned_be32(&buf[28]);
+        max_ws = get_unaligned_be64(&buf[36]);
+    }
+    lun->unmap_granularity = max(lun->unmap_granularity, 1U);
+    
+    if (lbpu && lun->max_unmap_blocks && lun->max_unmap_desc) {
+        lun->unmap_mode = STORAGE_UNMAP_UNMAP;
+        lun->max_unmap_desc = min_t(u32, lun->max_unmap_desc,
+                                    STORAGE_UNMAP_MAX_DESC);
+    } else if (lbpws) {
+        lun->unmap_mode = STORAGE_UNMAP_WS16;
+        lun->max_unmap_blocks = min_t(u64, max_ws ?: STORAGE_WS16_MAX_BLOCKS,
+                                      U32_MAX);
+        lun->max_unmap_desc = 1;
+    }
+    
+    if (lun->unmap_mode != STORAGE_UNMAP_NONE)
+        dev_info(dev, "LUN %u支持discard（%s），每条最多%u块、%u个范围，粒度%u块\n",
+                 lun->lun,
+                 lun->unmap_mode == STORAGE_UNMAP_UNMAP ? "UNMAP" : "WRITE SAME",
+                 lun->max_unmap_blocks, lun->max_unmap_desc,
+                 lun->unmap_granularity);
+    
+out:
+    kfree(buf);
+}
+
+/*
+ * 填写读写CDB，LBA或块数超出10字节CDB范围时用16字节CDB，
+ * 返回CDB长度。cdb至少16字节
+ */
+static int storage_rw_cdb(unsigned char *cdb, bool write, u64 lba, u32 blocks)
+{
+    memset(cdb, 0, 16);
+    
+    if (lba > U32_MAX || blocks > U16_MAX) {
+        cdb[0] = write ? WRITE_16 : READ_16;
+        put_unaligned_be64(lba, &cdb[2]);
+        put_unaligned_be32(blocks, &cdb[10]);
+        return 16;
+    }
+    
+    cdb[0] = write ? WRITE_10 : READ_10;
+    put_unaligned_be32(lba, &cdb[2]);
+    put_unaligned_be16(blocks, &cdb[7]);
+    return 10;
+}
+
+/* 结束一个块请求 */
+static void storage_end_rq(struct storage_cmd *cmd, blk_status_t status)
+{
+    /* 轮询队列的请求留给提交者在->poll中结束，不在中断里唤醒 */
+    if (cmd->polled) {
+        cmd->poll_status = status;
+        cmd->done_ns = ktime_get_ns();
+        llist_add(&cmd->poll_node, &cmd->lun->poll_done);
+        return;
+    }
+    
+    blk_mq_end_request(blk_mq_rq_from_pdu(cmd), status);
+}
+
+/*
+ * 扇区缓存：按页缓存读到和写下去的数据，所有LUN共用一个LRU和
+ * cache_kb的容量上限。写入是直写的：派发时删除重叠的页并把LUN的
+ * 缓存代数加一，完成时再用写下去的数据填回缓存；读请求完成时如果
+ * 代数没变（期间没有写入），读到的数据也放进缓存
+ */
+static struct hlist_head *storage_cache_bucket(struct usb_storage *us,
+                                               struct storage_lun *lun,
+                                               u64 index)
+{
+    return &us->cache_hash[hash_64(index ^ ((u64)lun->lun << 56),
+                                   STORAGE_CACHE_HASH_BITS)];
+}
+
+/* 调用时持有cache_lock */
+static struct storage_cache_entry *storage_cache_find(struct usb_storage *us,
+                                                      struct storage_lun *lun,
+                                                      u64 index)
+{
+    struct storage_cache_entry *e;
+    
+    hlist_for_each_entry(e, storage_cache_bucket(us, lun, index), hash) {
+        if (e->lun == lun && e->index == index)
+            return e;
+    }
+    
+    return NULL;
+}
+
+/* 调用时持有cache_lock */
+static void storage_cache_drop(struct usb_storage *us,
+                               struct storage_cache_entry *e)
+{
+    hlist_del(&e->hash);
+    list_del(&e->lru);
+    us->cache_pages--;
+    __free_page(e->page);
+    kfree(e);
+}
+
+/* 超出容量时从LRU尾部淘汰，调用时持有cache_lock */
+static void storage_cache_shrink(struct usb_storage *us)
+{
+    unsigned long max_pages = (READ_ONCE(cache_kb) * 1024UL) >> PAGE_SHIFT;
+    
+    while (us->cache_pages > max_pages) {
+        storage_cache_drop(us, list_last_entry(&us->cache_lru,
+                                               struct storage_cache_entry, lru));
+        us->cache_evictions++;
+    }
+}
+
+/*
+ * 取一页用于写入数据：已缓存的直接返回，否则新建。预读的页放在
+ * LRU尾部，没被用到时最先淘汰。调用时持有cache_lock
+ */
+static struct storage_cache_entry *storage_cache_get(struct usb_storage *us,
+                                                     struct storage_lun *lun,
+                                                     u64 index, bool readahead)
+{
+    struct storage_cache_entry *e;
+    
+    e = storage_cache_find(us, lun, index);
+    if (e) {
+        list_move(&e->lru, &us->cache_lru);
+        return e;
+    }
+    
+    e = kmalloc(sizeof(*e), GFP_ATOMIC);
+    if (!e)
+        return NULL;
+    e->page = alloc_page(GFP_ATOMIC);
+    if (!e->page) {
+        kfree(e);
+        return NULL;
+    }
+    
+    e->lun = lun;
+    e->index = index;
+    e->readahead = readahead;
+    hlist_add_head(&e->hash, storage_cache_bucket(us, lun, index));
+    if (readahead)
+        list_add_tail(&e->lru, &us->cache_lru);
+    else
+        list_add(&e->lru, &us->cache_lru);
+    us->cache_pages++;
+    us->cache_inserts++;
+    
+    return e;
+}
+
+/* 请求覆盖的页全部命中时直接从缓存复制数据，返回true */
+static bool storage_cache_read(struct storage_lun *lun, struct request *rq)
+{
+    struct usb_storage *us = lun->us;
+    u64 pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+    u64 first = pos >> PAGE_SHIFT;
+    u64 last = (pos + blk_rq_bytes(rq) - 1) >> PAGE_SHIFT;
+    struct storage_cache_entry *e;
+    struct req_iterator iter;
+    struct bio_vec bv;
+    unsigned long flags;
+    unsigned int done, n;
+    u64 i;
+    void *dst;
+    
+    if (!READ_ONCE(cache_kb))
+        return false;
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    if (!us->cache_pages)
+        goto miss;
+    for (i = first; i <= last; i++) {
+        if (!storage_cache_find(us, lun, i))
+            goto miss;
+    }
+    
+    rq_for_each_segment(bv, rq, iter) {
+        dst = bvec_kmap_local(&bv);
+        for (done = 0; done < bv.bv_len; done += n, pos += n) {
+            e = storage_cache_find(us, lun, pos >> PAGE_SHIFT);
+            n = min_t(unsigned int, bv.bv_len - done,
+                      PAGE_SIZE - offset_in_page(pos));
+            memcpy(dst + done, page_address(e->page) + offset_in_page(pos), n);
+        }
+        kunmap_local(dst);
+    }
+    
+    for (i = first; i <= last; i++) {
+        e = storage_cache_find(us, lun, i);
+        list_move(&e->lru, &us->cache_lru);
+        if (e->readahead) {
+            e->readahead = false;
+            us->ra_hits++;
+        }
+    }
+    us->cache_hits++;
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+    return true;
+    
+miss:
+    us->cache_misses++;
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+    return false;
+}
+
+/*
+ * 读写成功后把请求完整覆盖的页放进缓存，已缓存的页更新内容。在URB
+ * 完成回调里关中断执行，只处理不超过STORAGE_CACHE_FILL_MAX的请求；
+ * 大请求多半是顺序读写，由预读负责
+ */
+static void storage_cache_fill(struct storage_cmd *cmd)
+{
+    struct storage_lun *lun = cmd->lun;
+    struct usb_storage *us = lun->us;
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    u64 pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+    u64 end = pos + blk_rq_bytes(rq);
+    struct storage_cache_entry *e = NULL;
+    struct req_iterator iter;
+    struct bio_vec bv;
+    unsigned long flags;
+    unsigned int done, n;
+    void *src;
+    
+    if (!READ_ONCE(cache_kb) || end - pos > STORAGE_CACHE_FILL_MAX)
+        return;
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    if (cmd->cache_gen != lun->cache_gen)
+        goto out;
+    
+    rq_for_each_segment(bv, rq, iter) {
+        src = bvec_kmap_local(&bv);
+        for (done = 0; done < bv.bv_len; done += n, pos += n) {
+            n = min_t(unsigned int, bv.bv_len - done,
+                      PAGE_SIZE - offset_in_page(pos));
+            
+            /* 只缓存完整的页，页的第一段到达时取出缓存项 */
+            if (!offset_in_page(pos))
+                e = pos + PAGE_SIZE <= end ?
+                    storage_cache_get(us, lun, pos >> PAGE_SHIFT, false) :
+                    NULL;
+            if (e)
+                memcpy(page_address(e->page) + offset_in_page(pos),
+                       src + done, n);
+        }
+        kunmap_local(src);
+    }
+    storage_cache_shrink(us);
+    
+out:
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+}
+
+/* 删除LUN上和[pos, pos + len)重叠的页，并让进行中的读不再填充缓存 */
+static void storage_cache_invalidate(struct storage_lun *lun, u64 pos, u64 len)
+{
+    struct usb_storage *us = lun->us;
+    struct storage_cache_entry *e, *next;
+    u64 first = pos >> PAGE_SHIFT;
+    u64 last = (pos + len - 1) >> PAGE_SHIFT;
+    unsigned long flags;
+    u64 i;
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    lun->cache_gen++;
+    
+    if (!us->cache_pages || !len)
+        goto out;
+    
+    if (last - first + 1 > us->cache_pages) {
+        list_for_each_entry_safe(e, next, &us->cache_lru, lru) {
+            if (e->lun == lun && e->index >= first && e->index <= last) {
+                storage_cache_drop(us, e);
+                us->cache_invalidations++;
+            }
+        }
+    } else {
+        for (i = first; i <= last; i++) {
+            e = storage_cache_find(us, lun, i);
+            if (e) {
+                storage_cache_drop(us, e);
+                us->cache_invalidations++;
+            }
+        }
+    }
+    
+out:
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+}
+
+/* 释放所有缓存，设备已停止 */
+static void storage_cache_free(struct usb_storage *us)
+{
+    struct storage_cache_entry *e, *next;
+    
+    list_for_each_entry_safe(e, next, &us->cache_lru, lru)
+        storage_cache_drop(us, e);
+    kfree(us->cache_hash);
+}
+
+/* 预读完成：代数没变（期间没有写入）时把数据放进缓存 */
+static void storage_readahead_done(struct storage_cmd *cmd)
+{
+    struct storage_readahead *ra = cmd->context;
+    struct storage_lun *lun = cmd->lun;
+    struct usb_storage *us = lun->us;
+    u64 index = (cmd->lba << ilog2(lun->block_size)) >> PAGE_SHIFT;
+    struct storage_cache_entry *e;
+    unsigned long flags;
+    unsigned int i;
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    lun->ra_busy = false;
+    if (!cmd->result && cmd->actual == cmd->length &&
+        ra->gen == lun->cache_gen) {
+        for (i = 0; i < ra->npages; i++) {
+            if (storage_cache_find(us, lun, index + i))
+                continue;
+            e = storage_cache_get(us, lun, index + i, true);
+            if (!e)
+                break;
+            copy_highpage(e->page, ra->pages[i]);
+            us->ra_pages++;
+        }
+        storage_cache_shrink(us);
+    }
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+    
+    for (i = 0; i < ra->npages; i++)
+        __free_page(ra->pages[i]);
+    kfree(ra->pages);
+    kfree(ra);
+}
+
+/*
+ * 顺序读检测：连续两次读接在上一次结尾时，从下一页开始预读
+ * cache_readahead_kb，每个LUN同时只有一个预读
+ */
+static void storage_cache_readahead(struct storage_lun *lun, u64 lba,
+                                    u32 blocks)
+{
+    struct usb_storage *us = lun->us;
+    unsigned int bshift = ilog2(lun->block_size);
+    unsigned int npages = (READ_ONCE(cache_readahead_kb) * 1024) >> PAGE_SHIFT;
+    struct storage_readahead *ra;
+    unsigned long flags;
+    u64 start, ra_blocks;
+    unsigned int i;
+    u64 gen;
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    if (lba == lun->seq_next)
+        lun->seq_count++;
+    else
+        lun->seq_count = 0;
+    lun->seq_next = lba + blocks;
+    
+    start = DIV_ROUND_UP_ULL((lba + blocks) << bshift, PAGE_SIZE);
+    ra_blocks = (u64)npages << (PAGE_SHIFT - bshift);
+    if (lun->seq_count < 2 || lun->ra_busy || !npages ||
+        bshift > PAGE_SHIFT || !READ_ONCE(cache_kb) ||
+        storage_cache_find(us, lun, start) ||
+        ((start << PAGE_SHIFT) >> bshift) + ra_blocks > lun->capacity) {
+        spin_unlock_irqrestore(&us->cache_lock, flags);
+        return;
+    }
+    lun->ra_busy = true;
+    /*
+     * 代数在检查写合并缓冲区之前取：之后到达的写入会让它过期，不会
+     * 出现写入已进缓冲区、预读却拿到新代数的情况
+     */
+    gen = lun->cache_gen;
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+    
+    /* 写合并缓冲区里还有没写回的数据时，介质上的内容是旧的 */
+    if (lun->wc && storage_wc_overlaps(lun->wc, (start << PAGE_SHIFT) >> bshift,
+                                       ra_blocks))
+        goto clear;
+    
+    ra = kzalloc(struct_size(ra, sg, npages), GFP_ATOMIC);
+    if (!ra)
+        goto error;
+    ra->pages = kcalloc(npages, sizeof(*ra->pages), GFP_ATOMIC);
+    if (!ra->pages)
+        goto error;
+    
+    sg_init_table(ra->sg, npages);
+    for (ra->npages = 0; ra->npages < npages; ra->npages++) {
+        ra->pages[ra->npages] = alloc_page(GFP_ATOMIC);
+        if (!ra->pages[ra->npages])
+            goto error;
+        sg_set_page(&ra->sg[ra->npages], ra->pages[ra->npages], PAGE_SIZE, 0);
+    }
+    
+    ra->cmd.lun = lun;
+    ra->cmd.lba = (start << PAGE_SHIFT) >> bshift;
+    ra->cmd.blocks = ra_blocks;
+    ra->cmd.direction = DMA_FROM_DEVICE;
+    ra->cmd.cdb_len = storage_rw_cdb(ra->cmd.cdb, false, ra->cmd.lba,
+                                     ra->cmd.blocks);
+    ra->cmd.sg = ra->sg;
+    ra->cmd.nents = npages;
+    ra->cmd.length = npages * PAGE_SIZE;
+    ra->cmd.done = storage_readahead_done;
+    ra->cmd.context = ra;
+    INIT_LIST_HEAD(&ra->cmd.merged);
+    
+    spin_lock_irqsave(&us->cache_lock, flags);
+    ra->gen = gen;
+    us->ra_issued++;
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+    
+    if (storage_submit_command(us, &ra->cmd)) {
+        ra->cmd.result = -ENODEV;
+        storage_readahead_done(&ra->cmd);
+    }
+    return;
+    
+error:
+    if (ra) {
+        for (i = 0; ra->pages && i < ra->npages; i++)
+            __free_page(ra->pages[i]);
+        kfree(ra->pages);
+        kfree(ra);
+    }
+clear:
+    spin_lock_irqsave(&us->cache_lock, flags);
+    lun->ra_busy = false;
+    spin_unlock_irqrestore(&us->cache_lock, flags);
+}
+
+/*
+ * 解析sense数据（固定或描述符格式），返回sense key。UNIT ATTENTION
+ * 表示介质可能已经更换，清空这个LUN的缓存
+ */
+static int storage_handle_sense(struct storage_lun *lun, const u8 *sense,
+                                unsigned int len)
+{
+    u8 key, asc;
+    
+    if (len < 3)
+        return -1;
+    
+    if ((sense[0] & 0x7f) >= 0x72) {
+        key = sense[1] & 0x0f;
+        asc = sense[2];
+    } else {
+        key = sense[2] & 0x0f;
+        asc = len > 12 ? sense[12] : 0;
+    }
+    
+    if (key == UNIT_ATTENTION) {
+        dev_info(&lun->us->interface->dev,
+                 "LUN %u: UNIT ATTENTION（ASC 0x%02x），清空缓存\n",
+                 lun->lun, asc);
+        storage_cache_invalidate(lun, 0, U64_MAX);
+    }
+    
+    return key;
+}
+
+/* 读写请求结束，成功时数据放进扇区缓存 */
+static void storage_end_rw(struct storage_cmd *cmd, blk_status_t status)
+{
+    if (status == BLK_STS_OK)
+        storage_cache_fill(cmd);
+    storage_end_rq(cmd, status);
+}
+
+/*
+ * 块请求完成：CSW校验后在回调上下文中调用。合并后的命令按数据
+ * 顺序拆回各个请求，完整传输到的请求成功，其余按错误结束
+ */
+static void storage_rq_done(struct storage_cmd *cmd)
+{
+    struct storage_cmd *part, *next;
+    unsigned int good, offset;
+    blk_status_t status;
+    
+    if (cmd->result) {
+        status = errno_to_blk_status(cmd->result);
+        good = 0;
+    } else {
+        status = BLK_STS_IOERR;  /* 短传输 */
+        good = min(cmd->actual, cmd->length - min(cmd->residue, cmd->length));
+    }
+    
+    offset = cmd->req_length;
+    list_for_each_entry_safe(part, next, &cmd->merged, node) {
+        list_del_init(&part->node);
+        offset += part->req_length;
+        storage_end_rw(part, offset <= good ? BLK_STS_OK : status);
+    }
+    
+    storage_end_rw(cmd, cmd->req_length <= good ? BLK_STS_OK : status);
+}
+
+/* discard完成：一条UNMAP覆盖的所有请求同成同败 */
+static void storage_discard_done(struct storage_cmd *cmd)
+{
+    blk_status_t status = errno_to_blk_status(cmd->result);
+    struct storage_cmd *part, *next;
+    
+    kfree(cmd->buf);
+    cmd->buf = NULL;
+    
+    list_for_each_entry_safe(part, next, &cmd->merged, node) {
+        list_del_init(&part->node);
+        storage_end_rq(part, status);
+    }
+    
+    storage_end_rq(cmd, status);
+}
+
+static void storage_build_rw_cdb(struct storage_cmd *cmd)
+{
+    cmd->cdb_len = storage_rw_cdb(cmd->cdb, cmd->direction == DMA_TO_DEVICE,
+                                  cmd->lba, cmd->blocks);
+}
+
+/* 合并批次按LUN和LBA排序 */
+static int storage_merge_cmp(void *priv, const struct list_head *a,
+                             const struct list_head *b)
+{
+    struct storage_cmd *ca = list_entry(a, struct storage_cmd, node);
+    struct storage_cmd *cb = list_entry(b, struct storage_cmd, node);
+    
+    if (ca->lun->lun != cb->lun->lun)
+        return ca->lun->lun < cb->lun->lun ? -1 : 1;
+    if (ca->lba < cb->lba)
+        return -1;
+    return ca->lba > cb->lba;
+}
+
+/* cmd能否接在以head开头、以tail结尾的命令后面 */
+static bool storage_can_merge(struct usb_storage *us, struct storage_cmd *head,
+                              struct storage_cmd *tail, struct storage_cmd *cmd)
+{
+    struct usb_bus *bus = us->udev->bus;
+    u64 limit = (u64)READ_ONCE(us->max_transfer_kb) * 1024;
+    
+    if (cmd->lun != head->lun || cmd->direction != head->direction ||
+        head->lba + head->blocks != cmd->lba)
+        return false;
+    
+    if ((u64)head->length + cmd->length > limit ||
+        (u64)head->blocks + cmd->blocks > U32_MAX)
+        return false;
+    
+    if (bus->sg_tablesize && head->nents + cmd->nents > bus->sg_tablesize)
+        return false;
+    
+    /* 接合处的sg表项也必须满足wMaxPacketSize整数倍的限制 */
+    if (!bus->no_sg_constraint &&
+        tail->sg[tail->req_nents - 1].length %
+        usb_maxpacket(us->udev, us->recv_bulk_pipe))
+        return false;
+    
+    return true;
+}
+
+/* 把cmd的sg表链接到tail之后，作为head的一部分 */
+static void storage_merge_append(struct storage_cmd *head,
+                                 struct storage_cmd *tail,
+                                 struct storage_cmd *cmd)
+{
+    sg_unmark_end(&tail->sg[tail->req_nents - 1]);
+    sg_chain(tail->sg, tail->req_nents + 1, cmd->sg);
+    
+    list_add_tail(&cmd->node, &head->merged);
+    head->nents += cmd->nents;
+    head->length += cmd->length;
+    head->blocks += cmd->blocks;
+}
+
+/* discard请求cmd能否并入以head开头的命令 */
+static bool storage_can_merge_discard(struct storage_cmd *head,
+                                      struct storage_cmd *cmd)
+{
+    struct storage_lun *lun = head->lun;
+    
+    if (cmd->lun != lun ||
+        (u64)head->blocks + cmd->blocks > lun->max_unmap_blocks)
+        return false;
+    
+    /* WRITE SAME一次只能覆盖一个连续范围 */
+    if (lun->unmap_mode == STORAGE_UNMAP_WS16)
+        return head->lba + head->blocks == cmd->lba;
+    
+    return head->ranges + cmd->ranges <= lun->max_unmap_desc;
+}
+
+/* 把一个discard请求的每个bio写成UNMAP块描述符，返回写入的个数 */
+static unsigned int storage_fill_unmap_desc(struct storage_cmd *cmd,
+                                            unsigned char *desc)
+{
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    unsigned int shift = ilog2(cmd->lun->block_size) - SECTOR_SHIFT;
+    unsigned int n = 0;
+    struct bio *bio;
+    
+    __rq_for_each_bio(bio, rq) {
+        put_unaligned_be64(bio->bi_iter.bi_sector >> shift, desc);
+        put_unaligned_be32(bio_sectors(bio) >> shift, desc + 8);
+        desc += 16;
+        n++;
+    }
+    
+    return n;
+}
+
+/*
+ * 发出一批discard：UNMAP把所有请求的范围写进同一个参数列表，
+ * WRITE SAME(16)发送一个全零块并置UNMAP位
+ */
+static void storage_discard_issue(struct usb_storage *us,
+                                  struct storage_cmd *head)
+{
+    struct storage_lun *lun = head->lun;
+    struct storage_cmd *part;
+    unsigned int len, n;
+    unsigned char *buf;
+    int result;
+    
+    if (lun->unmap_mode == STORAGE_UNMAP_UNMAP)
+        len = 8 + head->ranges * 16;
+    else
+        len = lun->block_size;
+    
+    buf = kzalloc(len, GFP_ATOMIC);
+    if (!buf) {
+        result = -ENOMEM;
+        goto error;
+    }
+    
+    memset(head->cdb, 0, sizeof(head->cdb));
+    if (lun->unmap_mode == STORAGE_UNMAP_UNMAP) {
+        n = storage_fill_unmap_desc(head, buf + 8);
+        list_for_each_entry(part, &head->merged, node)
+            n += storage_fill_unmap_desc(part, buf + 8 + n * 16);
+        len = 8 + n * 16;
+        put_unaligned_be16(len - 2, &buf[0]);
+        put_unaligned_be16(n * 16, &buf[2]);
+        
+        head->cdb[0] = UNMAP;
+        put_unaligned_be16(len, &head->cdb[7]);
+        head->cdb_len = 10;
+    } else {
+        head->cdb[0] = WRITE_SAME_16;
+        head->cdb[1] = 0x08;    /* UNMAP */
+        put_unaligned_be64(head->lba, &head->cdb[2]);
+        put_unaligned_be32(head->blocks, &head->cdb[10]);
+        head->cdb_len = 16;
+    }
+    
+    head->buf = buf;
+    sg_init_one(head->sg, buf, len);
+    head->nents = 1;
+    head->length = len;
+    head->done = storage_discard_done;
+    
+    atomic64_inc(&us->discard_cmds);
+    atomic64_add(head->ranges, &us->discard_ranges);
+    
+    result = storage_submit_command(us, head);
+    if (result)
+        goto error;
+    return;
+    
+error:
+    head->result = result;
+    storage_discard_done(head);
+}
+
+/* 发出一条（可能合并过的）读写命令 */
+static void storage_merge_issue(struct usb_storage *us, struct storage_cmd *head)
+{
+    int result;
+    
+    storage_build_rw_cdb(head);
+    
+    atomic64_inc(&us->merge_transfers);
+    atomic64_add(head->length, &us->merge_bytes);
+    
+    result = storage_submit_command(us, head);
+    if (result) {
+        head->result = result;
+        head->done(head);
+    }
+}
+
+/* 取出已排队的请求，把LBA连续的请求合并成一条大命令发出 */
+static void storage_merge_flush(struct usb_storage *us)
+{
+    struct storage_cmd *cmd, *next, *head = NULL, *tail = NULL;
+    struct storage_cmd *dhead = NULL;
+    unsigned long flags;
+    LIST_HEAD(batch);
+    
+    spin_lock_irqsave(&us->lock, flags);
+    list_splice_init(&us->merge_list, &batch);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    list_sort(NULL, &batch, storage_merge_cmp);
+    
+    list_for_each_entry_safe(cmd, next, &batch, node) {
+        list_del_init(&cmd->node);
+        
+        /* discard不传输数据，同一LUN的范围收集到一个参数列表里 */
+        if (cmd->discard) {
+            if (dhead && storage_can_merge_discard(dhead, cmd)) {
+                list_add_tail(&cmd->node, &dhead->merged);
+                dhead->ranges += cmd->ranges;
+                dhead->blocks += cmd->blocks;
+                continue;
+            }
+            if (dhead)
+                storage_discard_issue(us, dhead);
+            dhead = cmd;
+            continue;
+        }
+        
+        if (head && storage_can_merge(us, head, tail, cmd)) {
+            storage_merge_append(head, tail, cmd);
+            tail = cmd;
+            continue;
+        }
+        
+        if (head)
+            storage_merge_issue(us, head);
+        head = tail = cmd;
+    }
+    
+    if (head)
+        storage_merge_issue(us, head);
+    if (dhead)
+        storage_discard_issue(us, dhead);
+}
+
+/* 缓冲区中偏移off处的地址，页面来自alloc_page(GFP_KERNEL)，不在高端内存 */
+static void *storage_wc_addr(struct page **pages, unsigned int off)
+{
+    return page_address(pages[off >> PAGE_SHIFT]) + offset_in_page(off);
+}
+
+/* 用缓冲区开头的len字节填写sg表，返回表项数 */
+static unsigned int storage_wc_map(struct storage_wc *wc, struct page **pages,
+                                   unsigned int len)
+{
+    unsigned int n = DIV_ROUND_UP(len, PAGE_SIZE);
+    unsigned int i;
+    
+    sg_init_table(wc->sg, n);
+    for (i = 0; i < n; i++)
+        sg_set_page(&wc->sg[i], pages[i],
+                    min_t(unsigned int, len - i * PAGE_SIZE, PAGE_SIZE), 0);
+    
+    return n;
+}
+
+/* 把写请求的数据复制到缓冲区偏移off处 */
+static void storage_wc_copy_in(struct storage_wc *wc, unsigned int off,
+                               struct request *rq)
+{
+    struct req_iterator iter;
+    struct bio_vec bv;
+    unsigned int done, n;
+    void *src;
+    
+    rq_for_each_segment(bv, rq, iter) {
+        src = bvec_kmap_local(&bv);
+        for (done = 0; done < bv.bv_len; done += n, off += n) {
+            n = min_t(unsigned int, bv.bv_len - done,
+                      PAGE_SIZE - offset_in_page(off));
+            memcpy(storage_wc_addr(wc->pages, off), src + done, n);
+        }
+        kunmap_local(src);
+    }
+}
+
+/* 让当前块尽快写回，调用时持有wc->lock */
+static void storage_wc_kick(struct storage_wc *wc, enum storage_wc_reason reason)
+{
+    if (wc->state != STORAGE_WC_DIRTY)
+        return;
+    
+    wc->reason = reason;
+    mod_delayed_work(storage_wq, &wc->flush_work, 0);
+}
+
+/*
+ * 写回当前块：有缺的逻辑块时先读出第一个到最后一个缺块之间的
+ * 范围补齐，再用一条命令写整个块
+ */
+static int storage_wc_writeback(struct storage_wc *wc)
+{
+    struct storage_lun *lun = wc->lun;
+    struct usb_storage *us = lun->us;
+    unsigned int bshift = ilog2(lun->block_size);
+    unsigned int first, last, b, nents, len;
+    unsigned char cdb[16];
+    int cdb_len;
+    int result;
+    
+    first = find_first_zero_bit(wc->valid, wc->blocks);
+    if (first < wc->blocks) {
+        for (last = wc->blocks - 1; test_bit(last, wc->valid); last--)
+            ;
+        len = (last - first + 1) << bshift;
+        nents = storage_wc_map(wc, wc->fill, len);
+        cdb_len = storage_rw_cdb(cdb, false, wc->lba + first, last - first + 1);
+        result = storage_execute_sg(lun, cdb, cdb_len, wc->sg, nents, len,
+                                    DMA_FROM_DEVICE);
+        if (result)
+            return result;
+        
+        for (b = first; b <= last; b++) {
+            if (test_bit(b, wc->valid))
+                continue;
+            memcpy(storage_wc_addr(wc->pages, b << bshift),
+                   storage_wc_addr(wc->fill, (b - first) << bshift),
+                   lun->block_size);
+        }
+        atomic64_add(len, &us->wc_fill_bytes);
+    } else {
+        atomic64_inc(&us->wc_full_chunks);
+    }
+    
+    len = wc->blocks << bshift;
+    nents = storage_wc_map(wc, wc->pages, len);
+    cdb_len = storage_rw_cdb(cdb, true, wc->lba, wc->blocks);
+    result = storage_execute_sg(lun, cdb, cdb_len, wc->sg, nents, len,
+                                DMA_TO_DEVICE);
+    if (!result)
+        atomic64_add(len, &us->wc_dev_bytes);
+    
+    return result;
+}
+
+/* 写回工作：截止时间到、需要腾出缓冲区或收到FLUSH时运行 */
+static void storage_wc_flush_work(struct work_struct *work)
+{
+    struct storage_wc *wc = container_of(to_delayed_work(work),
+                                         struct storage_wc, flush_work);
+    struct storage_lun *lun = wc->lun;
+    struct usb_storage *us = lun->us;
+    struct storage_cmd *cmd, *next;
+    blk_status_t status = BLK_STS_OK;
+    LIST_HEAD(waiters);
+    bool rerun;
+    int error = 0;
+    int result;
+    
+    spin_lock(&wc->lock);
+    if (wc->state == STORAGE_WC_DIRTY) {
+        wc->state = STORAGE_WC_FLUSHING;
+        spin_unlock(&wc->lock);
+        
+        atomic64_inc(&us->wc_flushes[wc->reason]);
+        result = storage_wc_writeback(wc);
+        if (result) {
+            /* 缓冲区中的数据已经确认给上层，记下来由下一个FLUSH报告 */
+            atomic64_inc(&us->wc_errors);
+            dev_err(&us->interface->dev,
+                    "LUN %u写合并写回失败（LBA %llu）: %d\n",
+                    lun->lun, wc->lba, result);
+        }
+        
+        spin_lock(&wc->lock);
+        wc->state = STORAGE_WC_IDLE;
+        if (result && !wc->error)
+            wc->error = result;
+    }
+    list_splice_init(&wc->waiters, &waiters);
+    if (!list_empty(&waiters)) {
+        error = wc->error;
+        wc->error = 0;
+    }
+    rerun = wc->rerun;
+    wc->rerun = false;
+    spin_unlock(&wc->lock);
+    
+    /* 缓冲区写回后再让设备把自己的写缓存落盘，FLUSH才算完成 */
+    if (!list_empty(&waiters)) {
+        result = storage_sync_cache(lun);
+        if (!error)
+            error = result;
+        status = errno_to_blk_status(error);
+    }
+    
+    list_for_each_entry_safe(cmd, next, &waiters, node) {
+        list_del_init(&cmd->node);
+        storage_end_rq(cmd, status);
+    }
+    
+    if (rerun)
+        blk_mq_run_hw_queues(lun->disk->queue, true);
+}
+
+/* [lba, lba + blocks)是否和还没写回的块重叠 */
+static bool storage_wc_overlaps(struct storage_wc *wc, u64 lba, u64 blocks)
+{
+    unsigned long flags;
+    bool overlap;
+    
+    spin_lock_irqsave(&wc->lock, flags);
+    overlap = wc->state != STORAGE_WC_IDLE &&
+              lba < wc->lba + wc->blocks && wc->lba < lba + blocks;
+    spin_unlock_irqrestore(&wc->lock, flags);
+    
+    return overlap;
+}
+
+/*
+ * 写合并入口，返回true表示请求已由写合并处理，*status是queue_rq
+ * 的返回值。落在一个块内的小写入复制进缓冲区后立即完成；和当前
+ * 块重叠的其他请求要等块写回后再派发
+ */
+static bool storage_wc_queue(struct storage_lun *lun, struct request *rq,
+                             blk_status_t *status)
+{
+    struct storage_wc *wc = lun->wc;
+    struct storage_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    unsigned int bshift = ilog2(lun->block_size);
+    u64 lba = blk_rq_pos(rq) >> (bshift - SECTOR_SHIFT);
+    u32 blocks = blk_rq_bytes(rq) >> bshift;
+    u64 chunk = lba & ~(u64)(wc->chunk_blocks - 1);
+    
+    *status = BLK_STS_OK;
+    spin_lock(&wc->lock);
+    
+    /* FLUSH都交给写回工作：先写回缓冲区，再发SYNCHRONIZE CACHE */
+    if (req_op(rq) == REQ_OP_FLUSH) {
+        blk_mq_start_request(rq);
+        list_add_tail(&cmd->node, &wc->waiters);
+        if (wc->state == STORAGE_WC_DIRTY)
+            storage_wc_kick(wc, STORAGE_WC_SYNC);
+        else
+            mod_delayed_work(storage_wq, &wc->flush_work, 0);
+        spin_unlock(&wc->lock);
+        return true;
+    }
+    
+    /* 落在一个块内的小写入 */
+    if (req_op(rq) == REQ_OP_WRITE &&
+        blocks < wc->chunk_blocks &&
+        lba + blocks <= chunk + wc->chunk_blocks &&
+        lba + blocks <= lun->capacity) {
+        if (wc->state == STORAGE_WC_IDLE) {
+            wc->state = STORAGE_WC_DIRTY;
+            wc->lba = chunk;
+            wc->blocks = min_t(u64, wc->chunk_blocks, lun->capacity - chunk);
+            bitmap_zero(wc->valid, wc->chunk_blocks);
+            wc->reason = STORAGE_WC_DEADLINE;
+            queue_delayed_work(storage_wq, &wc->flush_work,
+                               msecs_to_jiffies(wc_flush_ms));
+        }
+        
+        if (wc->state == STORAGE_WC_DIRTY && wc->lba == chunk) {
+            storage_wc_copy_in(wc, (lba - chunk) << bshift, rq);
+            bitmap_set(wc->valid, lba - chunk, blocks);
+            spin_unlock(&wc->lock);
+            
+            atomic64_add(blk_rq_bytes(rq), &lun->us->wc_host_bytes);
+            blk_mq_start_request(rq);
+            storage_end_rq(cmd, BLK_STS_OK);
+            return true;
+        }
+        goto busy;
+    }
+    
+    if (wc->state != STORAGE_WC_IDLE &&
+        lba < wc->lba + wc->blocks && wc->lba < lba + blocks)
+        goto busy;
+    
+    spin_unlock(&wc->lock);
+    return false;
+    
+busy:
+    storage_wc_kick(wc, STORAGE_WC_EVICT);
+    wc->rerun = true;
+    spin_unlock(&wc->lock);
+    *status = BLK_STS_DEV_RESOURCE;
+    return true;
+}
+
+/*
+ * 同步写回缓冲区中的数据，绕过写合并的直通命令发出前调用。调用者
+ * 持有pt_mutex，storage_wc_free在同一把锁下摘下缓冲区，所以这里
+ * 拿到的缓冲区不会被释放
+ */
+static void storage_wc_drain(struct storage_lun *lun)
+{
+    struct storage_wc *wc;
+    
+    lockdep_assert_held(&lun->us->pt_mutex);
+    wc = lun->wc;
+    if (!wc)
+        return;
+    
+    spin_lock(&wc->lock);
+    storage_wc_kick(wc, STORAGE_WC_SYNC);
+    spin_unlock(&wc->lock);
+    flush_delayed_work(&wc->flush_work);
+}
+
+/* 按块大小分配写合并缓冲区 */
+static int storage_wc_init(struct storage_lun *lun)
+{
+    unsigned int kb = clamp(wc_chunk_kb, STORAGE_WC_MIN_KB, STORAGE_WC_MAX_KB);
+    struct storage_wc *wc;
+    unsigned int i;
+    
+    wc = kzalloc(sizeof(*wc), GFP_KERNEL);
+    if (!wc)
+        return -ENOMEM;
+    
+    wc->lun = lun;
+    spin_lock_init(&wc->lock);
+    INIT_LIST_HEAD(&wc->waiters);
+    INIT_DELAYED_WORK(&wc->flush_work, storage_wc_flush_work);
+    wc->chunk_blocks = (roundup_pow_of_two(kb) * 1024) >> ilog2(lun->block_size);
+    wc->npages = DIV_ROUND_UP(wc->chunk_blocks * lun->block_size, PAGE_SIZE);
+    
+    wc->valid = bitmap_zalloc(wc->chunk_blocks, GFP_KERNEL);
+    wc->pages = kcalloc(wc->npages, sizeof(*wc->pages), GFP_KERNEL);
+    wc->fill = kcalloc(wc->npages, sizeof(*wc->fill), GFP_KERNEL);
+    wc->sg = kcalloc(wc->npages, sizeof(*wc->sg), GFP_KERNEL);
+    mutex_lock(&lun->us->pt_mutex);
+    lun->wc = wc;
+    mutex_unlock(&lun->us->pt_mutex);
+    if (!wc->valid || !wc->pages || !wc->fill || !wc->sg)
+        return -ENOMEM;
+    
+    for (i = 0; i < wc->npages; i++) {
+        wc->pages[i] = alloc_page(GFP_KERNEL);
+        wc->fill[i] = alloc_page(GFP_KERNEL);
+        if (!wc->pages[i] || !wc->fill[i])
+            return -ENOMEM;
+    }
+    
+    dev_info(&lun->us->interface->dev, "LUN %u写合并: 块大小%uKB\n",
+             lun->lun, roundup_pow_of_two(kb));
+    return 0;
+}
+
+/* 写回剩余数据并释放写合并缓冲区，块设备已经注销 */
+static void storage_wc_free(struct storage_lun *lun)
+{
+    struct storage_wc *wc;
+    unsigned int i;
+    
+    /* 等正在同步写回的直通命令退出，之后它看不到这个缓冲区 */
+    mutex_lock(&lun->us->pt_mutex);
+    wc = lun->wc;
+    lun->wc = NULL;
+    mutex_unlock(&lun->us->pt_mutex);
+    if (!wc)
+        return;
+    
+    mod_delayed_work(storage_wq, &wc->flush_work, 0);
+    flush_delayed_work(&wc->flush_work);
+    
+    for (i = 0; wc->pages && i < wc->npages; i++) {
+        if (wc->pages[i])
+            __free_page(wc->pages[i]);
+        if (wc->fill && wc->fill[i])
+            __free_page(wc->fill[i]);
+    }
+    kfree(wc->sg);
+    kfree(wc->fill);
+    kfree(wc->pages);
+    bitmap_free(wc->valid);
+    kfree(wc);
+}
+
+/* 读写请求先进入合并队列，批次的最后一个请求到达时统一发出 */
+static blk_status_t storage_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                     const struct blk_mq_queue_data *bd)
+{
+    struct storage_lun *lun = hctx->queue->queuedata;
+    struct usb_storage *us = lun->us;
+    struct request *rq = bd->rq;
+    struct storage_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    unsigned int shift = ilog2(lun->block_size) - SECTOR_SHIFT;
+    unsigned long flags;
+    struct bio *bio;
+    blk_status_t status;
+    
+    /* 缓存命中和写合并在这里直接结束，不经过轮询 */
+    cmd->polled = false;
+    
+    /*
+     * 读先检查写合并：和脏块重叠的读会退回重新派发，不能每次都计一次
+     * 缓存未命中、推进顺序检测。代数要在这个检查之前取，之后写进缓冲
+     * 区的数据会让它过期，完成时不会把介质上的旧数据填进缓存
+     */
+    cmd->cache_gen = READ_ONCE(lun->cache_gen);
+    if (req_op(rq) == REQ_OP_READ && lun->wc &&
+        storage_wc_queue(lun, rq, &status))
+        return status;
+    
+    /* 扇区缓存在写合并之前：写入和discard先让缓存失效 */
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+        if (storage_cache_read(lun, rq)) {
+            blk_mq_start_request(rq);
+            storage_end_rq(cmd, BLK_STS_OK);
+            return BLK_STS_OK;
+        }
+        storage_cache_readahead(lun, blk_rq_pos(rq) >> shift,
+                                blk_rq_bytes(rq) >> ilog2(lun->block_size));
+        break;
+    case REQ_OP_WRITE:
+    case REQ_OP_DISCARD:
+        storage_cache_invalidate(lun, blk_rq_pos(rq) << SECTOR_SHIFT,
+                                 blk_rq_bytes(rq));
+        break;
+    default:
+        break;
+    }
+    
+    if (req_op(rq) != REQ_OP_READ && lun->wc &&
+        storage_wc_queue(lun, rq, &status))
+        return status;
+    
+    cmd->discard = false;
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+        cmd->direction = DMA_FROM_DEVICE;
+        break;
+    case REQ_OP_WRITE:
+        cmd->direction = DMA_TO_DEVICE;
+        break;
+    case REQ_OP_DISCARD:
+        if (lun->unmap_mode == STORAGE_UNMAP_NONE)
+            return BLK_STS_NOTSUPP;
+        cmd->direction = DMA_TO_DEVICE;
+        cmd->discard = true;
+        break;
+    default:
+        return BLK_STS_NOTSUPP;
+    }
+    
+    cmd->lba = blk_rq_pos(rq) >> shift;
+    cmd->blocks = blk_rq_bytes(rq) >> ilog2(lun->block_size);
+    cmd->lun = lun;
+    
+    /* 数据阶段直接使用bio页，sg表末尾留一项用于合并时链接 */
+    sg_init_table(cmd->sg, us->max_segs + 1);
+    if (cmd->discard) {
+        /* 参数列表在发出时生成 */
+        cmd->length = 0;
+        cmd->nents = 0;
+        cmd->ranges = 0;
+        __rq_for_each_bio(bio, rq)
+            cmd->ranges++;
+    } else {
+        cmd->length = blk_rq_bytes(rq);
+        cmd->nents = blk_rq_map_sg(hctx->queue, rq, cmd->sg);
+    }
+    cmd->req_length = cmd->length;
+    cmd->req_nents = cmd->nents;
+    INIT_LIST_HEAD(&cmd->merged);
+    cmd->done = storage_rq_done;
+    cmd->context = us;
+    cmd->polled = hctx->type == HCTX_TYPE_POLL;
+    
+    blk_mq_start_request(rq);
+    atomic64_inc(&us->merge_requests);
+    
+    spin_lock_irqsave(&us->lock, flags);
+    list_add_tail(&cmd->node, &us->merge_list);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    if (bd->last)
+        storage_merge_flush(us);
+    
+    return BLK_STS_OK;
+}
+
+/* 块层在批次中途停止派发时调用 */
+static void storage_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+    struct storage_lun *lun = hctx->queue->queuedata;
+    
+    storage_merge_flush(lun->us);
+}
+
+/*
+ * io_uring IOPOLL或RWF_HIPRI的提交者在这里轮询：结束状态机已经完成
+ * 的请求，返回结束的个数
+ */
+static int storage_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+    struct storage_lun *lun = hctx->queue->queuedata;
+    struct usb_storage *us = lun->us;
+    struct storage_cmd *cmd, *next;
+    struct llist_node *list;
+    int found = 0;
+    u64 now;
+    
+    list = llist_del_all(&lun->poll_done);
+    if (!list)
+        return 0;
+    
+    now = ktime_get_ns();
+    list = llist_reverse_order(list);
+    llist_for_each_entry_safe(cmd, next, list, poll_node) {
+        atomic64_add(now - cmd->done_ns, &us->poll_observe_ns);
+        blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->poll_status);
+        found++;
+    }
+    atomic64_add(found, &us->poll_reaped);
+    
+    return found;
+}
+
+/* 硬件队列0处理普通请求，有轮询队列时硬件队列1专门处理轮询请求 */
+static void storage_map_queues(struct blk_mq_tag_set *set)
+{
+    set->map[HCTX_TYPE_DEFAULT].nr_queues = 1;
+    set->map[HCTX_TYPE_DEFAULT].queue_offset = 0;
+    blk_mq_map_queues(&set->map[HCTX_TYPE_DEFAULT]);
+    
+    if (set->nr_maps <= HCTX_TYPE_POLL)
+        return;
+    
+    set->map[HCTX_TYPE_READ].nr_queues = 0;
+    set->map[HCTX_TYPE_POLL].nr_queues = 1;
+    set->map[HCTX_TYPE_POLL].queue_offset = 1;
+    blk_mq_map_queues(&set->map[HCTX_TYPE_POLL]);
+}
+
+/* sg表紧跟在请求私有数据中的storage_cmd之后 */
+static int storage_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                                unsigned int hctx_idx, unsigned int numa_node)
+{
+    struct storage_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    
+    cmd->sg = (struct scatterlist *)(cmd + 1);
+    return 0;
+}
+
+static const struct blk_mq_ops storage_mq_ops = {
+    .queue_rq     = storage_queue_rq,
+    .commit_rqs   = storage_commit_rqs,
+    .init_request = storage_init_request,
+    .poll         = storage_poll,
+    .map_queues   = storage_map_queues,
+};
+
+static const struct block_device_operations storage_bdev_ops = {
+    .owner = THIS_MODULE,
+};
+
+/*
+ * 每种速度下单条命令的目标大小（KB）：传输时间要明显长于CBW/CSW
+ * 往返的固定开销，否则总线在命令之间空闲
+ */
+static unsigned int storage_speed_transfer_kb(enum usb_device_speed speed)
+{
+    switch (speed) {
+    case USB_SPEED_SUPER_PLUS:
+        return 2048;
+    case USB_SPEED_SUPER:
+        return 1024;
+    case USB_SPEED_HIGH:
+        return 256;
+    default:
+        return 64;
+    }
+}
+
+/*
+ * 根据批量端点和协商速度计算传输大小。SuperSpeed端点一次突发最多
+ * bMaxBurst + 1个包，按突发对齐的传输不会在末尾留下不满的突发；
+ * 首选大小是突发大小的整数倍，同时满足速度对应的目标大小
+ */
+static void storage_ep_sizing(struct usb_storage *us)
+{
+    unsigned int pipes[] = { us->recv_bulk_pipe, us->send_bulk_pipe };
+    struct usb_host_endpoint *ep;
+    unsigned int maxp, burst;
+    unsigned int i;
+    
+    us->ep_maxp = 0;
+    us->ep_burst = 1;
+    for (i = 0; i < ARRAY_SIZE(pipes); i++) {
+        ep = usb_pipe_endpoint(us->udev, pipes[i]);
+        if (!ep)
+            continue;
+        
+        maxp = usb_endpoint_maxp(&ep->desc);
+        burst = 1;
+        if (us->udev->speed >= USB_SPEED_SUPER)
+            burst = ep->ss_ep_comp.bMaxBurst + 1;
+        
+        if (maxp * burst > us->ep_maxp * us->ep_burst) {
+            us->ep_maxp = maxp;
+            us->ep_burst = burst;
+        }
+    }
+    
+    us->xfer_align = roundup_pow_of_two(max(us->ep_maxp * us->ep_burst,
+                                            (unsigned int)SECTOR_SIZE));
+    us->pref_transfer_kb = max(storage_speed_transfer_kb(us->udev->speed),
+                               us->xfer_align / 1024);
+    us->pref_transfer_kb = min(us->pref_transfer_kb,
+                               (unsigned int)STORAGE_MAX_TRANSFER_KB_MAX);
+    us->max_transfer_kb = us->pref_transfer_kb;
+    
+    dev_info(&us->interface->dev,
+             "%s，包大小%u，突发%u，对齐%u字节，首选传输%uKB\n",
+             usb_speed_string(us->udev->speed), us->ep_maxp, us->ep_burst,
+             us->xfer_align, us->pref_transfer_kb);
+}
+
+/* 注册块设备/dev/usbsN */
+static int storage_add_disk(struct storage_lun *lun)
+{
+    struct usb_storage *us = lun->us;
+    unsigned int sectors = max_sectors ?: us->pref_transfer_kb * 2;
+    struct queue_limits lim = {
+        .logical_block_size = lun->block_size,
+        .max_hw_sectors     = max(sectors, lun->block_size >> SECTOR_SHIFT),
+        /* 让文件系统和I/O调度器按突发对齐、按首选大小下发 */
+        .io_min             = max(us->xfer_align, lun->block_size),
+        .io_opt             = us->pref_transfer_kb * 1024,
+    };
+    struct usb_bus *bus = us->udev->bus;
+    struct gendisk *disk;
+    int result;
+    
+    /* sg表项数受主机控制器限制 */
+    us->max_segs = max(max_segments, 1U);
+    if (bus->sg_tablesize)
+        us->max_segs = min(us->max_segs, bus->sg_tablesize);
+    lim.max_segments = us->max_segs;
+    
+    /*
+     * 没有no_sg_constraint的控制器要求除最后一项外每个sg表项都是
+     * wMaxPacketSize的整数倍，让块层按此边界切分
+     */
+    if (!bus->no_sg_constraint)
+        lim.virt_boundary_mask = usb_maxpacket(us->udev, us->recv_bulk_pipe) - 1;
+    
+    /* 块层要求逻辑块大小是512到PAGE_SIZE之间的2的幂 */
+    if (lun->block_size < SECTOR_SIZE || lun->block_size > PAGE_SIZE ||
+        !is_power_of_2(lun->block_size)) {
+        dev_err(&us->interface->dev, "不支持的块大小: %u\n",
+                lun->block_size);
+        return -EINVAL;
+    }
+    
+    /* UNMAP时块层可以把多个不连续的discard bio合进一个请求 */
+    if (lun->unmap_mode != STORAGE_UNMAP_NONE) {
+        lim.max_hw_discard_sectors = min_t(u64,
+                (u64)lun->max_unmap_blocks * (lun->block_size >> SECTOR_SHIFT),
+                UINT_MAX >> 1);
+        lim.max_discard_segments = lun->max_unmap_desc;
+        lim.discard_granularity = lun->unmap_granularity * lun->block_size;
+    }
+    
+    /*
+     * 写合并相当于易失性写缓存，声明后块层会在fsync时发FLUSH。不声明
+     * FUA，块层把FUA写入拆成写入加FLUSH，由FLUSH保证落盘
+     */
+    if (wc_chunk_kb && lun->capacity) {
+        result = storage_wc_init(lun);
+        if (result)
+            goto error_wc;
+        lim.features |= BLK_FEAT_WRITE_CACHE;
+    }
+    
+    lun->tag_set.ops = &storage_mq_ops;
+    lun->tag_set.nr_hw_queues = 1;
+    lun->tag_set.queue_depth = clamp(queue_depth, 1U, BLK_MQ_MAX_DEPTH);
+    if (us->transport == &storage_uas_transport)
+        lun->tag_set.queue_depth = min(lun->tag_set.queue_depth, us->uas_ntags);
+    lun->tag_set.numa_node = NUMA_NO_NODE;
+    lun->tag_set.cmd_size = sizeof(struct storage_cmd) +
+                           (us->max_segs + 1) * sizeof(struct scatterlist);
+    lun->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    
+    /* 设备只有一条命令管道，一个轮询队列就够了 */
+    if (poll_queues) {
+        lun->tag_set.nr_hw_queues = 2;
+        lun->tag_set.nr_maps = HCTX_MAX_TYPES;
+        lim.features |= BLK_FEAT_POLL;
+    }
+    lun->tag_set.driver_data = lun;
+    
+    result = blk_mq_alloc_tag_set(&lun->tag_set);
+    if (result)
+        goto error_wc;
+    
+    disk = blk_mq_alloc_disk(&lun->tag_set, &lim, lun);
+    if (IS_ERR(disk)) {
+        result = PTR_ERR(disk);
+        goto error_tag_set;
+    }
+    
+    result = ida_alloc(&storage_index_ida, GFP_KERNEL);
+    if (result < 0)
+        goto error_disk;
+    lun->disk_index = result;
+    
+    disk->major = storage_major;
+    disk->first_minor = lun->disk_index * STORAGE_MINORS;
+    disk->minors = STORAGE_MINORS;
+    disk->fops = &storage_bdev_ops;
+    disk->private_data = lun;
+    snprintf(disk->disk_name, DISK_NAME_LEN, "usbs%d", lun->disk_index);
+    set_capacity(disk, lun->capacity << (ilog2(lun->block_size) - SECTOR_SHIFT));
+    
+    result = device_add_disk(&us->interface->dev, disk, NULL);
+    if (result)
+        goto error_ida;
+    
+    lun->disk = disk;
+    dev_info(&us->interface->dev, "LUN %u块设备: %s\n",
+             lun->lun, disk->disk_name);
+    
+    return 0;
+    
+error_ida:
+    ida_free(&storage_index_ida, lun->disk_index);
+    lun->disk_index = -1;
+error_disk:
+    put_disk(disk);
+error_tag_set:
+    blk_mq_free_tag_set(&lun->tag_set);
+error_wc:
+    storage_wc_free(lun);
+    return result;
+}
+
+/* 注销块设备，未完成的请求由状态机以错误结束 */
+static void storage_del_disk(struct storage_lun *lun)
+{
+    if (!lun->disk)
+        return;
+    
+    del_gendisk(lun->disk);
+    storage_wc_free(lun);
+    put_disk(lun->disk);
+    blk_mq_free_tag_set(&lun->tag_set);
+    ida_free(&storage_index_ida, lun->disk_index);
+    lun->disk = NULL;
+    lun->disk_index = -1;
+}
+
+/* 停止状态机：排队的命令以-ENODEV结束，正在执行的命令被取消 */
+static void storage_stop(struct usb_storage *us)
+{
+    struct storage_cmd *cmd, *next;
+    unsigned long flags;
+    unsigned int i;
+    LIST_HEAD(pending);
+    
+    spin_lock_irqsave(&us->lock, flags);
+    us->disconnected = true;
+    for (i = 0; i < us->nluns; i++)
+        list_splice_tail_init(&us->luns[i]->cmd_queue, &pending);
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    usb_kill_anchored_urbs(&us->anchor);
+    timer_shutdown_sync(&us->timer);
+    
+    /* 恢复工作可能还没运行就被取消，这时由这里结束当前命令 */
+    cancel_work_sync(&us->reset_work);
+    storage_finish(us, -ENODEV);
+    
+    list_for_each_entry_safe(cmd, next, &pending, node) {
+        list_del_init(&cmd->node);
+        cmd->result = -ENODEV;
+        cmd->done(cmd);
+    }
+}
+
+/* 分配一个逻辑单元并加入设备的LUN表 */
+static struct storage_lun *storage_alloc_lun(struct usb_storage *us,
+                                             unsigned int lun_nr)
+{
+    struct storage_lun *lun;
+    unsigned long flags;
+    
+    if (us->nluns >= STORAGE_MAX_LUNS)
+        return NULL;
+    
+    lun = kzalloc(sizeof(*lun), GFP_KERNEL);
+    if (!lun)
+        return NULL;
+    
+    lun->us = us;
+    lun->lun = lun_nr;
+    lun->disk_index = -1;
+    INIT_LIST_HEAD(&lun->cmd_queue);
+    
+    spin_lock_irqsave(&us->lock, flags);
+    us->luns[us->nluns++] = lun;
+    spin_unlock_irqrestore(&us->lock, flags);
+    
+    return lun;
+}
+
+/* BOT的GET MAX LUN请求，不支持多LUN的设备会STALL，按单LUN处理 */
+static int storage_get_max_lun(struct usb_storage *us)
+{
+    unsigned char *buf;
+    int result;
+    
+    buf = kmalloc(1, GFP_KERNEL);
+    if (!buf)
+        return 0;
+    
+    result = usb_control_msg(us->udev, usb_rcvctrlpipe(us->udev, 0),
+                            US_BULK_GET_MAX_LUN,
+                            USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                            0,
+                            us->interface->cur_altsetting->desc.bInterfaceNumber,
+                            buf, 1, STORAGE_CMD_TIMEOUT);
+    
+    result = (result == 1) ? min_t(int, buf[0], STORAGE_MAX_LUNS - 1) : 0;
+    kfree(buf);
+    
+    return result;
+}
+
+/* UAS用REPORT LUNS命令（通过LUN 0）列出逻辑单元 */
+static int storage_report_luns(struct usb_storage *us)
+{
+    unsigned int len = 8 + STORAGE_MAX_LUNS * 8;
+    unsigned char cmd[12] = { REPORT_LUNS };
+    unsigned char *data;
+    unsigned int i, count, lun_nr;
+    int result;
+    
+    data = kmalloc(len, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    
+    put_unaligned_be32(len, &cmd[6]);
+    result = storage_execute_command(us->luns[0], cmd, 12,
+                                    data, len, DMA_FROM_DEVICE);
+    if (result) {
+        /* 不支持REPORT LUNS时只用LUN 0 */
+        result = 0;
+        goto out;
+    }
+    
+    count = min(get_unaligned_be32(data) / 8, (u32)STORAGE_MAX_LUNS);
+    for (i = 0; i < count; i++) {
+        lun_nr = scsilun_to_int((struct scsi_lun *)&data[8 + i * 8]);
+        if (lun_nr == 0)
+            continue;
+        if (!storage_alloc_lun(us, lun_nr)) {
+            result = -ENOMEM;
+            break;
+        }
+    }
+    
+out:
+    kfree(data);
+    return result;
+}
+
+/* 在LUN 0之外发现其他逻辑单元 */
+static int storage_scan_luns(struct usb_storage *us)
+{
+    int max_lun, i;
+    
+    if (us->transport == &storage_uas_transport)
+        return storage_report_luns(us);
+    
+    max_lun = storage_get_max_lun(us);
+    for (i = 1; i <= max_lun; i++) {
+        if (!storage_alloc_lun(us, i))
+            return -ENOMEM;
+    }
+    
+    if (max_lun)
+        dev_info(&us->interface->dev, "%d个LUN\n", max_lun + 1);
+    
+    return 0;
+}
+
+/* 退避等待，返回true表示设备正在断开 */
+static bool storage_scan_sleep(struct usb_storage *us, unsigned int ms)
+{
+    wait_event_timeout(us->scan_wait, READ_ONCE(us->scan_abort),
+                       msecs_to_jiffies(ms));
+    return READ_ONCE(us->scan_abort);
+}
+
+/*
+ * 设备档案
+ *
+ * 热插拔工位上同一张卡一天要插拔几百次，每次都重复GET MAX LUN、
+ * INQUIRY、TEST UNIT READY退避和READ CAPACITY。有序列号的设备识别
+ * 完成后把结果记下来（LRU，最多profile_cache_size个），下次插入时
+ * 按档案立即注册块设备，然后在后台重新识别，不一致时重新注册
+ */
+static bool storage_profile_match(struct storage_profile *p,
+                                  struct usb_device *udev)
+{
+    return p->vid == le16_to_cpu(udev->descriptor.idVendor) &&
+           p->pid == le16_to_cpu(udev->descriptor.idProduct) &&
+           !strncmp(p->serial, udev->serial, sizeof(p->serial) - 1);
+}
+
+/* 查找档案并复制一份，找到时返回true */
+static bool storage_profile_lookup(struct usb_storage *us,
+                                   struct storage_profile *out)
+{
+    struct storage_profile *p;
+    bool found = false;
+    
+    if (!us->udev->serial || !us->udev->serial[0] ||
+        !READ_ONCE(profile_cache_size))
+        return false;
+    
+    mutex_lock(&storage_profile_mutex);
+    list_for_each_entry(p, &storage_profiles, node) {
+        if (!storage_profile_match(p, us->udev))
+            continue;
+        /* 换了传输方式（例如接到了只支持高速的口上）时重新识别 */
+        if (p->uas != (us->transport == &storage_uas_transport))
+            break;
+        p->hits++;
+        list_move(&p->node, &storage_profiles);
+        *out = *p;
+        found = true;
+        break;
+    }
+    mutex_unlock(&storage_profile_mutex);
+    
+    return found;
+}
+
+/* 保存识别结果，ready_ms是完整识别用的时间 */
+static void storage_profile_save(struct usb_storage *us, s64 ready_ms,
+                                 bool mismatch)
+{
+    struct storage_profile *p, *victim;
+    struct storage_profile_lun *pl;
+    struct storage_lun *lun;
+    unsigned int max = READ_ONCE(profile_cache_size);
+    unsigned int i;
+    
+    if (!us->udev->serial || !us->udev->serial[0] ||
+        !us->luns[0]->present)
+        return;
+    
+    mutex_lock(&storage_profile_mutex);
+    list_for_each_entry(p, &storage_profiles, node) {
+        if (storage_profile_match(p, us->udev))
+            goto found;
+    }
+    
+    if (!max)
+        goto out;
+    p = kzalloc(sizeof(*p), GFP_KERNEL);
+    if (!p)
+        goto out;
+    p->vid = le16_to_cpu(us->udev->descriptor.idVendor);
+    p->pid = le16_to_cpu(us->udev->descriptor.idProduct);
+    strscpy(p->serial, us->udev->serial, sizeof(p->serial));
+    list_add(&p->node, &storage_profiles);
+    storage_nprofiles++;
+    
+found:
+    list_move(&p->node, &storage_profiles);
+    p->uas = us->transport == &storage_uas_transport;
+    p->ready_ms = ready_ms;
+    if (mismatch)
+        p->mismatches++;
+    
+    p->nluns = 0;
+    for (i = 0; i < us->nluns; i++) {
+        lun = us->luns[i];
+        if (!lun->present)
+            continue;
+        pl = &p->luns[p->nluns++];
+        pl->lun = lun->lun;
+        memcpy(pl->vendor, lun->vendor, sizeof(pl->vendor));
+        memcpy(pl->product, lun->product, sizeof(pl->product));
+        pl->version = lun->version;
+        pl->ready = lun->capacity != 0;
+        pl->lbpme = lun->lbpme;
+        pl->capacity = lun->capacity;
+        pl->block_size = lun->block_size;
+        pl->unmap_mode = lun->unmap_mode;
+        pl->max_unmap_blocks = lun->max_unmap_blocks;
+        pl->max_unmap_desc = lun->max_unmap_desc;
+        pl->unmap_granularity = lun->unmap_granularity;
+    }
+    
+    /* 超出上限时从最久没用的开始淘汰 */
+    while (storage_nprofiles > max) {
+        victim = list_last_entry(&storage_profiles, struct storage_profile,
+                                 node);
+        list_del(&victim->node);
+        kfree(victim);
+        storage_nprofiles--;
+    }
+    
+out:
+    mutex_unlock(&storage_profile_mutex);
+}
+
+/* 模块卸载时释放所有档案 */
+static void storage_profile_clear(void)
+{
+    struct storage_profile *p, *next;
+    
+    list_for_each_entry_safe(p, next, &storage_profiles, node) {
+        list_del(&p->node);
+        kfree(p);
+    }
+    storage_nprofiles = 0;
+}
+
+/* debugfs: usb_storage_simple/profiles */
+static int storage_profiles_show(struct seq_file *m, void *v)
+{
+    struct storage_profile *p;
+    struct storage_profile_lun *pl;
+    unsigned int i;
+    
+    mutex_lock(&storage_profile_mutex);
+    list_for_each_entry(p, &storage_profiles, node) {
+        seq_printf(m, "%04x:%04x %s %s ready_ms %lld hits %u mismatches %u\n",
+                   p->vid, p->pid, p->serial, p->uas ? "uas" : "bot",
+                   p->ready_ms, p->hits, p->mismatches);
+        for (i = 0; i < p->nluns; i++) {
+            pl = &p->luns[i];
+            seq_printf(m, "  lun %u: %.8s %.16s %llu x %u%s\n",
+                       pl->lun, pl->vendor, pl->product,
+                       pl->capacity, pl->block_size,
+                       pl->unmap_mode != STORAGE_UNMAP_NONE ? " discard" : "");
+        }
+    }
+    mutex_unlock(&storage_profile_mutex);
+    
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(storage_profiles);
+
+/*
+ * 读取容量并注册块设备。没有介质的卡槽也注册块设备，容量为0
+ */
+static void storage_lun_publish(struct storage_lun *lun, bool ready)
+{
+    struct usb_storage *us = lun->us;
+    struct device *dev = &us->interface->dev;
+    int result = -ENODEV;
+    
+    if (ready)
+        result = storage_read_capacity(lun);
+    if (!result)
+        storage_probe_discard(lun);
+    if (result) {
+        dev_info(dev, "LUN %u未就绪或没有介质\n", lun->lun);
+        lun->capacity = 0;
+        lun->block_size = SECTOR_SIZE;
+    } else {
+        dev_info(dev, "LUN %u就绪，用时%lld ms\n", lun->lun,
+                 ktime_ms_delta(ktime_get(), us->probe_time));
+    }
+    
+    result = storage_add_disk(lun);
+    if (result)
+        dev_warn(dev, "LUN %u未注册块设备: %d\n", lun->lun, result);
+    lun->settled = true;
+}
+
+/* 按退避间隔发TEST UNIT READY，直到就绪、超过deadline或设备断开 */
+static int storage_lun_wait_ready(struct storage_lun *lun, ktime_t deadline,
+                                  unsigned int delay)
+{
+    for (;;) {
+        if (storage_test_unit_ready(lun) == 0)
+            return 0;
+        if (ktime_after(ktime_get(), deadline))
+            return -ETIMEDOUT;
+        if (storage_scan_sleep(lun->us, delay))
+            return -ENODEV;
+        delay = min(delay * 2, max(ready_max_delay_ms, 1U));
+    }
+}
+
+/*
+ * 后台校验按档案识别的LUN：重新INQUIRY、等待就绪、读容量，和档案
+ * 不一致时注销块设备，按实际结果重新注册；快速识别时没注册的在这里
+ * 注册。LBPME只有READ CAPACITY(16)才报告，这里不比较。返回0表示
+ * 一致，1表示不一致，负数表示没能校验
+ */
+static int storage_lun_validate(struct storage_lun *lun,
+                                struct storage_profile_lun *pl,
+                                ktime_t deadline, unsigned int delay)
+{
+    struct device *dev = &lun->us->interface->dev;
+    char vendor[9], product[17];
+    u64 capacity = 0;
+    u32 block_size = 0;
+    bool lbpme;
+    bool ready, match;
+    u8 version;
+    int result;
+    
+    result = storage_inquiry_id(lun, vendor, product, &version);
+    if (result)
+        return result;
+    
+    result = storage_lun_wait_ready(lun, deadline, delay);
+    if (result == -ENODEV)
+        return result;
+    ready = !result &&
+            !storage_get_capacity(lun, &capacity, &block_size, &lbpme);
+    
+    match = !strcmp(vendor, pl->vendor) && !strcmp(product, pl->product) &&
+            version == pl->version && ready == pl->ready &&
+            (!ready || (capacity == pl->capacity &&
+                        block_size == pl->block_size));
+    if (match && lun->settled)
+        return 0;
+    
+    if (!match) {
+        dev_warn(dev, "LUN %u和档案不一致，重新注册块设备\n", lun->lun);
+        storage_del_disk(lun);
+        memset(&lun->tag_set, 0, sizeof(lun->tag_set));
+        storage_cache_invalidate(lun, 0, U64_MAX);
+    }
+    memcpy(lun->vendor, vendor, sizeof(vendor));
+    memcpy(lun->product, product, sizeof(product));
+    lun->version = version;
+    storage_lun_publish(lun, ready);
+    
+    return !match;
+}
+
+/*
+ * 快速识别：有档案时按档案分配LUN，READ CAPACITY和档案一致的LUN
+ * 马上注册块设备，然后校验。返回false表示没有档案，需要完整识别
+ */
+static bool storage_scan_cached(struct usb_storage *us)
+{
+    struct device *dev = &us->interface->dev;
+    struct storage_profile *p;
+    struct storage_profile_lun *pl;
+    struct storage_lun *lun;
+    bool mismatch = false;
+    bool failed = false;
+    unsigned int delay;
+    unsigned int i;
+    u64 capacity;
+    u32 block_size;
+    bool lbpme;
+    int result;
+    
+    p = kmalloc(sizeof(*p), GFP_KERNEL);
+    if (!p)
+        return false;
+    if (!storage_profile_lookup(us, p)) {
+        kfree(p);
+        return false;
+    }
+    
+    /* LUN 0在probe中已经分配 */
+    for (i = 1; i < p->nluns; i++) {
+        if (!storage_alloc_lun(us, p->luns[i].lun))
+            break;
+    }
+    
+    for (i = 0; i < us->nluns; i++) {
+        lun = us->luns[i];
+        pl = &p->luns[i];
+        memcpy(lun->vendor, pl->vendor, sizeof(lun->vendor));
+        memcpy(lun->product, pl->product, sizeof(lun->product));
+        lun->version = pl->version;
+        lun->present = true;
+        if (pl->ready) {
+            /* 容量读不到或和档案不同时不按档案注册，留给校验 */
+            if (storage_get_capacity(lun, &capacity, &block_size, &lbpme) ||
+                capacity != pl->capacity || block_size != pl->block_size)
+                continue;
+            lun->capacity = pl->capacity;
+            lun->block_size = pl->block_size;
+            lun->lbpme = pl->lbpme;
+            lun->unmap_mode = pl->unmap_mode;
+            lun->max_unmap_blocks = pl->max_unmap_blocks;
+            lun->max_unmap_desc = pl->max_unmap_desc;
+            lun->unmap_granularity = pl->unmap_granularity;
+        } else {
+            lun->capacity = 0;
+            lun->block_size = SECTOR_SIZE;
+        }
+        
+        result = storage_add_disk(lun);
+        if (result)
+            dev_warn(dev, "LUN %u未注册块设备: %d\n", lun->lun, result);
+        lun->settled = true;
+    }
+    
+    WRITE_ONCE(us->ready_ms, ktime_ms_delta(ktime_get(), us->probe_time));
+    dev_info(dev, "按档案识别，%u个LUN，用时%lld ms（完整识别%lld ms）\n",
+             us->nluns, us->ready_ms, p->ready_ms);
+    
+    /* 上次就绪用了多久，首次重试就等它的四分之一 */
+    delay = max_t(s64, p->ready_ms / 4, max(ready_initial_ms, 1U));
+    delay = min(delay, max(ready_max_delay_ms, 1U));
+    
+    for (i = 0; i < us->nluns; i++) {
+        if (READ_ONCE(us->scan_abort))
+            goto out;
+        result = storage_lun_validate(us->luns[i], &p->luns[i],
+                                      ktime_add_ms(us->probe_time,
+                                                   ready_timeout_ms),
+                                      delay);
+        if (result < 0) {
+            dev_warn(dev, "LUN %u校验失败: %d\n", us->luns[i]->lun,
+                     result);
+            failed = true;
+        } else if (result) {
+            mismatch = true;
+        }
+    }
+    
+    /* 没能校验的不当作一致，不用这次的结果刷新档案 */
+    if (failed) {
+        dev_warn(dev, "档案校验未完成，保留原档案\n");
+        goto out;
+    }
+    storage_profile_save(us, ktime_ms_delta(ktime_get(), us->probe_time),
+                         mismatch);
+    dev_info(dev, "档案校验完成%s\n", mismatch ? "，已按实际结果更新" : "");
+    
+out:
+    kfree(p);
+    return true;
+}
+
+/*
+ * 异步识别：发现LUN，INQUIRY，然后对所有未就绪的LUN轮流发
+ * TEST UNIT READY，间隔从ready_initial_ms开始翻倍，不超过
+ * ready_max_delay_ms。每个LUN一就绪就注册块设备，总时间超过
+ * ready_timeout_ms后剩下的LUN按没有介质注册
+ */
+static void storage_scan_work(struct work_struct *work)
+{
+    struct usb_storage *us = container_of(work, struct usb_storage,
+                                          scan_work);
+    struct device *dev = &us->interface->dev;
+    ktime_t deadline;
+    unsigned int delay;
+    unsigned int pending;
+    unsigned int i;
+    
+    if (storage_scan_cached(us))
+        return;
+    
+    if (storage_scan_luns(us))
+        dev_warn(dev, "LUN发现失败，只识别已发现的LUN\n");
+    
+    for (i = 0; i < us->nluns; i++) {
+        if (READ_ONCE(us->scan_abort))
+            return;
+        us->luns[i]->present = storage_inquiry(us->luns[i]) == 0;
+    }
+    
+    /*
+     * LUN 0识别失败时放弃这个设备。释放接口会调用disconnect，它要
+     * 等本工作结束，所以交给另一个工作做，引用由它释放
+     */
+    if (!us->luns[0]->present) {
+        dev_err(dev, "INQUIRY失败，设备不可用\n");
+        kref_get(&us->kref);
+        usb_get_intf(us->interface);
+        queue_work(storage_wq, &us->release_work);
+        return;
+    }
+    
+    deadline = ktime_add_ms(us->probe_time, ready_timeout_ms);
+    delay = max(ready_initial_ms, 1U);
+    
+    for (;;) {
+        pending = 0;
+        for (i = 0; i < us->nluns; i++) {
+            struct storage_lun *lun = us->luns[i];
+            
+            if (!lun->present || lun->settled)
+                continue;
+            if (READ_ONCE(us->scan_abort))
+                return;
+            if (storage_test_unit_ready(lun) == 0)
+                storage_lun_publish(lun, true);
+            else
+                pending++;
+        }
+        
+        if (!pending || ktime_after(ktime_get(), deadline))
+            break;
+        if (storage_scan_sleep(us, delay))
+            return;
+        delay = min(delay * 2, max(ready_max_delay_ms, 1U));
+    }
+    
+    for (i = 0; i < us->nluns; i++) {
+        if (us->luns[i]->present && !us->luns[i]->settled)
+            storage_lun_publish(us->luns[i], false);
+    }
+    
+    WRITE_ONCE(us->ready_ms, ktime_ms_delta(ktime_get(), us->probe_time));
+    dev_info(dev, "识别完成，%u个LUN，用时%lld ms\n",
+             us->nluns, us->ready_ms);
+    storage_profile_save(us, us->ready_ms, false);
+}
+
+/* 注销所有LUN的块设备 */
+static void storage_remove_luns(struct usb_storage *us)
+{
+    unsigned int i;
+    
+    for (i = 0; i < us->nluns; i++)
+        storage_del_disk(us->luns[i]);
+}
+
+/* 释放所有LUN，状态机必须已经停止 */
+static void storage_free_luns(struct usb_storage *us)
+{
+    unsigned int i;
+    
+    for (i = 0; i < us->nluns; i++)
+        kfree(us->luns[i]);
+    us->nluns = 0;
+}
+
+/*
+ * debugfs: usb_storage_simple/<接口名>/
+ *   latency  各阶段延迟直方图和错误计数
+ *   reset    写入任意内容清零
+ */
+static const char * const storage_op_names[STORAGE_OP_NR] = {
+    "read", "write", "test_unit_ready", "inquiry", "read_capacity", "unmap",
+    "other",
+};
+
+static const char * const storage_phase_names[STORAGE_STAT_NR] = {
+    "command", "data", "status", "total",
+};
+
+static int storage_latency_show(struct seq_file *m, void *v)
 {
-    int result;
-    int actual_length;
+    struct usb_storage *us = m->private;
+    struct storage_stats *sum, *s;
+    unsigned int op, ph, b, last;
+    int cpu;
+    u64 total;
     
-    /* 准备CBW */
-    memset(us->cbw, 0, sizeof(struct bulk_cb_wrap));
-    us->cbw->Signature = cpu_to_le32(US_BULK_CB_SIGN);
-    us->cbw->Tag = ++us->tag;
-    us->cbw->DataTransferLength = cpu_to_le32(data_len);
-    us->cbw->Flags = (direction == DMA_FROM_DEVICE) ? US_BULK_FLAG_IN : US_BULK_FLAG_OUT;
-    us->cbw->Lun = 0;
-    us->cbw->Length = cmd_len;
-    memcpy(us->cbw->CDB, cmd, cmd_len);
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
     
-    /* 发送CBW */
-    result = usb_bulk_msg(us->udev, us->send_bulk_pipe,
-                         us->cbw, sizeof(struct bulk_cb_wrap),
-                         &actual_length, 5000);
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(us->stats, cpu);
+        for (op = 0; op < STORAGE_OP_NR; op++)
+            for (ph = 0; ph < STORAGE_STAT_NR; ph++)
+                for (b = 0; b < STORAGE_HIST_BUCKETS; b++)
+                    sum->hist[op][ph][b] += s->hist[op][ph][b];
+        for (ph = 0; ph < STORAGE_STAT_NR; ph++)
+            sum->errors[ph] += s->errors[ph];
+        sum->short_transfers += s->short_transfers;
+        sum->tag_mismatches += s->tag_mismatches;
+        sum->resets += s->resets;
+        sum->retries += s->retries;
+    }
     
-    if (result) {
-        dev_err(&us->interface->dev, "发送CBW失败: %d\n", result);
-        return result;
+    seq_printf(m, "errors command %llu data %llu status %llu\n",
+               sum->errors[STORAGE_STAT_CMD], sum->errors[STORAGE_STAT_DATA],
+               sum->errors[STORAGE_STAT_STATUS]);
+    seq_printf(m, "short_transfers %llu\n", sum->short_transfers);
+    seq_printf(m, "tag_mismatches %llu\n", sum->tag_mismatches);
+    seq_printf(m, "resets %llu\n", sum->resets);
+    seq_printf(m, "retries %llu\n", sum->retries);
+    seq_printf(m, "rto_command srtt %u us rttvar %u us samples %u\n",
+               us->rto[STORAGE_RTO_CTRL].srtt_us,
+               us->rto[STORAGE_RTO_CTRL].rttvar_us,
+               us->rto[STORAGE_RTO_CTRL].samples);
+    seq_printf(m, "rto_data_64k srtt %u us rttvar %u us samples %u\n",
+               us->rto[STORAGE_RTO_DATA].srtt_us,
+               us->rto[STORAGE_RTO_DATA].rttvar_us,
+               us->rto[STORAGE_RTO_DATA].samples);
+    
+    /* 只输出有数据的直方图，每行是桶的下界（微秒）和次数 */
+    for (op = 0; op < STORAGE_OP_NR; op++) {
+        for (ph = 0; ph < STORAGE_STAT_NR; ph++) {
+            u64 *hist = sum->hist[op][ph];
+            
+            total = 0;
+            last = 0;
+            for (b = 0; b < STORAGE_HIST_BUCKETS; b++) {
+                total += hist[b];
+                if (hist[b])
+                    last = b;
+            }
+            if (!total)
+                continue;
+            
+            seq_printf(m, "\n%s %s (%llu)\n", storage_op_names[op],
+                       storage_phase_names[ph], total);
+            for (b = 0; b <= last; b++)
+                seq_printf(m, "%10lu us: %llu\n",
+                           b ? 1UL << b : 0UL, hist[b]);
+        }
     }
     
+    kfree(sum);
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(storage_latency);
 
-/* 传输数据 */
-static int storage_transfer_data(struct usb_storage *us,
-                                unsigned char *buffer,
-                                unsigned int length,
-                                int direction)
+static ssize_t storage_reset_write(struct file *file, const char __user *buf,
+                                   size_t count, loff_t *ppos)
 {
-    int result;
-    int actual_length;
-    unsigned int pipe;
-    
-    if (length == 0)
-        return 0;
+    struct usb_storage *us = file->private_data;
+    int cpu;
     
-    /* 选择管道 */
-    pipe = (direction == DMA_FROM_DEVICE) ? 
-           us->recv_bulk_pipe : us->send_bulk_pipe;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(us->stats, cpu), 0, sizeof(struct storage_stats));
     
-    /* 传输数据 */
-    result = usb_bulk_msg(us->udev, pipe,
-                         buffer, length,
-                         &actual_length, 10000);
+    return count;
+}
+
+static const struct file_operations storage_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = storage_reset_write,
+    .llseek = noop_llseek,
+};
+
+/* 扇区缓存的计数 */
+static int storage_cache_show(struct seq_file *m, void *v)
+{
+    struct usb_storage *us = m->private;
+    unsigned long flags;
+    u64 hits, misses;
     
-    if (result) {
-        dev_err(&us->interface->dev, "数据传输失败: %d\n", result);
-        return result;
-    }
+    spin_lock_irqsave(&us->cache_lock, flags);
+    hits = us->cache_hits;
+    misses = us->cache_misses;
+    seq_printf(m, "capacity_kb %u\n", READ_ONCE(cache_kb));
+    seq_printf(m, "used_kb %lu\n", us->cache_pages << (PAGE_SHIFT - 10));
+    seq_printf(m, "hits %llu\n", hits);
+    seq_printf(m, "misses %llu\n", misses);
+    seq_printf(m, "inserts %llu\n", us->cache_inserts);
+    seq_printf(m, "evictions %llu\n", us->cache_evictions);
+    seq_printf(m, "invalidations %llu\n", us->cache_invalidations);
+    seq_printf(m, "readahead_issued %llu\n", us->ra_issued);
+    seq_printf(m, "readahead_pages %llu\n", us->ra_pages);
+    seq_printf(m, "readahead_hits %llu\n", us->ra_hits);
+    spin_unlock_irqrestore(&us->cache_lock, flags);
     
-    if (actual_length != length) {
-        dev_warn(&us->interface->dev,
-                "数据传输不完整: %d/%d\n",
-                actual_length, length);
-    }
+    seq_printf(m, "hit_ratio %llu%%\n",
+               hits + misses ? div64_u64(hits * 100, hits + misses) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(storage_cache);
+
+/*
+ * 轮询统计。saved_us估计轮询省下的时间：每次轮询发现的完成，按睡眠
+ * 等待时平均的唤醒延迟减去轮询发现的平均延迟计算
+ */
+static int storage_poll_show(struct seq_file *m, void *v)
+{
+    struct usb_storage *us = m->private;
+    u64 hits = atomic64_read(&us->poll_hits);
+    u64 reaped = atomic64_read(&us->poll_reaped);
+    u64 wakes = atomic64_read(&us->wake_count);
+    u64 observe = hits + reaped ?
+                  div64_u64(atomic64_read(&us->poll_observe_ns), hits + reaped) : 0;
+    u64 wake = wakes ? div64_u64(atomic64_read(&us->wake_ns), wakes) : 0;
     
+    seq_printf(m, "spin_us %llu\n",
+               div_u64(atomic64_read(&us->poll_spin_ns), NSEC_PER_USEC));
+    seq_printf(m, "sync_hits %llu\n", hits);
+    seq_printf(m, "sync_misses %llu\n", (u64)atomic64_read(&us->poll_misses));
+    seq_printf(m, "block_reaped %llu\n", reaped);
+    seq_printf(m, "poll_latency_ns %llu\n", observe);
+    seq_printf(m, "wake_latency_ns %llu\n", wake);
+    seq_printf(m, "saved_us %llu\n",
+               wakes && wake > observe ?
+               div_u64((hits + reaped) * (wake - observe), NSEC_PER_USEC) : 0);
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(storage_poll);
 
-/* 接收状态 */
-static int storage_get_status(struct usb_storage *us)
+static void storage_debugfs_init(struct usb_storage *us)
 {
-    int result;
-    int actual_length;
+    us->debugfs = debugfs_create_dir(dev_name(&us->interface->dev),
+                                     storage_debugfs_root);
+    debugfs_create_file("latency", 0444, us->debugfs, us,
+                        &storage_latency_fops);
+    debugfs_create_file("reset", 0200, us->debugfs, us,
+                        &storage_reset_fops);
+    debugfs_create_file("cache", 0444, us->debugfs, us,
+                        &storage_cache_fops);
+    debugfs_create_file("poll", 0444, us->debugfs, us,
+                        &storage_poll_fops);
+}
+
+/*
+ * 直通字符设备：厂商诊断和固件工具发原始CDB，不用解绑驱动改走usbfs。
+ * 用户缓冲区的页被固定后直接组成sg表交给状态机，不经过中间缓冲区，
+ * 块设备同时保持可用
+ */
+static struct usb_driver storage_driver;
+
+static void storage_delete(struct kref *kref)
+{
+    struct usb_storage *us = container_of(kref, struct usb_storage, kref);
     
-    /* 接收CSW */
-    result = usb_bulk_msg(us->udev, us->recv_bulk_pipe,
-                         us->csw, sizeof(struct bulk_cs_wrap),
-                         &actual_length, 5000);
+    usb_put_dev(us->udev);
+    kfree(us);
+}
+
+/* 释放识别失败的接口，接口已经断开时什么也不做 */
+static void storage_release_work(struct work_struct *work)
+{
+    struct usb_storage *us = container_of(work, struct usb_storage,
+                                          release_work);
+    struct usb_interface *interface = us->interface;
     
-    if (result) {
-        dev_err(&us->interface->dev, "接收CSW失败: %d\n", result);
-        return result;
-    }
+    usb_lock_device(us->udev);
+    if (usb_get_intfdata(interface) == us)
+        usb_driver_release_interface(&storage_driver, interface);
+    usb_unlock_device(us->udev);
     
-    /* 验证CSW */
-    if (actual_length != sizeof(struct bulk_cs_wrap)) {
-        dev_err(&us->interface->dev, "CSW长度错误\n");
-        return -EIO;
-    }
+    usb_put_intf(interface);
+    kref_put(&us->kref, storage_delete);
+}
+
+static int storage_pt_open(struct inode *inode, struct file *file)
+{
+    struct usb_interface *interface;
+    struct usb_storage *us;
     
-    if (le32_to_cpu(us->csw->Signature) != US_BULK_CS_SIGN) {
-        dev_err(&us->interface->dev, "CSW签名错误\n");
-        return -EIO;
-    }
+    interface = usb_find_interface(&storage_driver, iminor(inode));
+    if (!interface)
+        return -ENODEV;
     
-    if (us->csw->Tag != us->tag) {
-        dev_err(&us->interface->dev, "CSW标签不匹配\n");
-        return -EIO;
-    }
+    us = usb_get_intfdata(interface);
+    if (!us)
+        return -ENODEV;
     
-    /* 检查状态 */
-    if (us->csw->Status != US_BULK_STAT_OK) {
-        dev_err(&us->interface->dev, "命令失败: 状态=%d\n",
-                us->csw->Status);
-        return -EIO;
-    }
+    kref_get(&us->kref);
+    file->private_data = us;
     
     return 0;
 }
 
-/* 执行SCSI命令 */
-static int storage_execute_command(struct usb_storage *us,
-                                  unsigned char *cmd, int cmd_len,
-                                  void *buffer, unsigned int buf_len,
-                                  int direction)
+static int storage_pt_release(struct inode *inode, struct file *file)
 {
-    int result;
-    
-    mutex_lock(&us->io_mutex);
-    
-    /* 发送命令 */
-    result = storage_send_command(us, cmd, cmd_len, buf_len, direction);
-    if (result)
-        goto out;
-    
-    /* 传输数据 */
-    if (buf_len > 0) {
-        result = storage_transfer_data(us, buffer, buf_len, direction);
-        if (result)
-            goto out;
-    }
-    
-    /* 获取状态 */
-    result = storage_get_status(us);
+    struct usb_storage *us = file->private_data;
     
-out:
-    mutex_unlock(&us->io_mutex);
-    return result;
+    kref_put(&us->kref, storage_delete);
+    return 0;
 }
 
-/* INQUIRY命令 - 获取设备信息 */
-static int storage_inquiry(struct usb_storage *us)
+/* 直通命令的完成回调 */
+static void storage_pt_done(struct storage_cmd *cmd)
 {
-    unsigned char cmd[6] = {
-        INQUIRY,        /* 操作码 */
-        0,              /* LUN/EVPD */
-        0,              /* 页面码 */
-        0,              /* 保留 */
-        36,             /* 分配长度 */
-        0               /* 控制 */
+    complete(cmd->context);
+}
+
+/* 固定用户页，组成sg表，执行命令 */
+static int storage_pt_execute(struct storage_lun *lun,
+                              struct storage_passthru *pt)
+{
+    struct usb_storage *us = lun->us;
+    struct usb_bus *bus = us->udev->bus;
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct storage_cmd cmd = {
+        .cdb_len    = pt->cdb_len,
+        .length     = pt->length,
+        .lun        = lun,
+        .timeout_ms = min_t(u32, pt->timeout_ms, STORAGE_PT_MAX_TIMEOUT),
+        .no_retry   = true,
+        .sense      = pt->sense,
+        .done       = storage_pt_done,
+        .context    = &done,
     };
-    unsigned char data[36];
-    int result;
+    bool from_dev = pt->direction == STORAGE_PT_DIR_FROM_DEV;
+    unsigned long uaddr = pt->data;
+    unsigned int offset = offset_in_page(uaddr);
+    unsigned int npages = 0;
+    struct page **pages = NULL;
+    struct sg_table sgt = {};
+    unsigned int maxp;
+    int pinned, result;
     
-    result = storage_execute_command(us, cmd, 6,
-                                    data, 36, DMA_FROM_DEVICE);
+    memcpy(cmd.cdb, pt->cdb, pt->cdb_len);
+    INIT_LIST_HEAD(&cmd.merged);
+    cmd.direction = pt->direction == STORAGE_PT_DIR_NONE ? DMA_NONE :
+                    from_dev ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
     
-    if (result) {
-        dev_err(&us->interface->dev, "INQUIRY命令失败\n");
-        return result;
+    if (!pt->length)
+        goto submit;
+    
+    /* 控制器要求除最后一段外每段都是wMaxPacketSize的整数倍 */
+    maxp = usb_maxpacket(us->udev, us->recv_bulk_pipe);
+    if (!bus->no_sg_constraint && maxp && offset % maxp)
+        return -EINVAL;
+    
+    npages = DIV_ROUND_UP(offset + pt->length, PAGE_SIZE);
+    pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+    
+    pinned = pin_user_pages_fast(uaddr & PAGE_MASK, npages,
+                                 from_dev ? FOLL_WRITE : 0, pages);
+    if (pinned != npages) {
+        if (pinned > 0)
+            unpin_user_pages(pages, pinned);
+        result = pinned < 0 ? pinned : -EFAULT;
+        goto out_free;
     }
     
-    /* 解析设备信息 */
-    memcpy(us->vendor, &data[8], 8);
-    us->vendor[8] = '\0';
-    memcpy(us->product, &data[16], 16);
-    us->product[16] = '\0';
+    result = sg_alloc_table_from_pages(&sgt, pages, npages, offset,
+                                       pt->length, GFP_KERNEL);
+    if (result)
+        goto out_unpin;
+    if (bus->sg_tablesize && sgt.orig_nents > bus->sg_tablesize) {
+        result = -EINVAL;
+        goto out_sgt;
+    }
+    cmd.sg = sgt.sgl;
+    cmd.nents = sgt.orig_nents;
     
-    dev_info(&us->interface->dev,
-            "设备: %.8s %.16s\n",
-            us->vendor, us->product);
+submit:
+    /* 直通命令不经过写合并，先把已经确认给上层的数据写到设备 */
+    storage_wc_drain(lun);
     
-    return 0;
-}
-
-/* TEST UNIT READY命令 */
-static int storage_test_unit_ready(struct usb_storage *us)
-{
-    unsigned char cmd[6] = {
-        TEST_UNIT_READY,
-        0, 0, 0, 0, 0
-    };
+    result = storage_submit_command(us, &cmd);
+    if (result)
+        goto out_sgt;
+    
+    /*
+     * 状态机保证命令在超时或断开后结束，页在此之前不能释放，所以
+     * 不可中断；每个阶段的超时有上限
+     */
+    wait_for_completion(&done);
+    result = cmd.result;
+    
+    /* 不是读数据的命令可能改了任意块，缓存中的数据不再可信 */
+    if (!from_dev)
+        storage_cache_invalidate(lun, 0, U64_MAX);
+    pt->residue = cmd.residue;
+    pt->sense_len = cmd.sense_len;
     
-    return storage_execute_command(us, cmd, 6, NULL, 0, DMA_NONE);
+    /* 命令失败但拿到了sense数据：交给调用者解析 */
+    if (result == -EIO && cmd.sense_len) {
+        pt->status = SAM_STAT_CHECK_CONDITION;
+        result = 0;
+    } else if (!result) {
+        pt->status = SAM_STAT_GOOD;
+    }
+    
+out_sgt:
+    sg_free_table(&sgt);
+out_unpin:
+    if (pages)
+        unpin_user_pages_dirty_lock(pages, npages, from_dev && !result);
+out_free:
+    kvfree(pages);
+    return result;
 }
 
-/* READ CAPACITY命令 - 获取容量 */
-static int storage_read_capacity(struct usb_storage *us)
+static long storage_pt_ioctl(struct file *file, unsigned int code,
+                             unsigned long arg)
 {
-    unsigned char cmd[10] = {
-        READ_CAPACITY,
-        0, 0, 0, 0, 0, 0, 0, 0, 0
-    };
-    unsigned char data[8];
+    struct usb_storage *us = file->private_data;
+    void __user *argp = (void __user *)arg;
+    struct storage_passthru pt;
+    struct storage_lun *lun = NULL;
+    unsigned int i;
     int result;
-    u32 max_lba, block_size;
     
-    result = storage_execute_command(us, cmd, 10,
-                                    data, 8, DMA_FROM_DEVICE);
+    if (code != STORAGE_IOC_PASSTHRU)
+        return -ENOTTY;
+    if (!capable(CAP_SYS_RAWIO))
+        return -EPERM;
+    if (copy_from_user(&pt, argp, sizeof(pt)))
+        return -EFAULT;
     
-    if (result) {
-        dev_err(&us->interface->dev, "READ_CAPACITY命令失败\n");
-        return result;
+    if (pt.cdb_len < 6 || pt.cdb_len > sizeof(pt.cdb) ||
+        pt.direction > STORAGE_PT_DIR_FROM_DEV ||
+        (pt.direction == STORAGE_PT_DIR_NONE) != !pt.length ||
+        pt.length > STORAGE_PT_MAX_LEN || pt.pad)
+        return -EINVAL;
+    
+    pt.sense_len = 0;
+    pt.residue = 0;
+    pt.status = 0;
+    
+    mutex_lock(&us->pt_mutex);
+    if (us->pt_gone) {
+        result = -ENODEV;
+        goto out;
     }
     
-    /* 解析容量信息 */
-    max_lba = be32_to_cpup((__be32 *)data);
-    block_size = be32_to_cpup((__be32 *)(data + 4));
+    for (i = 0; i < READ_ONCE(us->nluns); i++) {
+        if (us->luns[i]->lun == pt.lun) {
+            lun = us->luns[i];
+            break;
+        }
+    }
+    if (!lun) {
+        result = -ENXIO;
+        goto out;
+    }
     
-    dev_info(&us->interface->dev,
-            "容量: %u块 x %u字节 = %llu MB\n",
-            max_lba + 1, block_size,
-            ((u64)(max_lba + 1) * block_size) >> 20);
+    result = storage_pt_execute(lun, &pt);
     
-    return 0;
+out:
+    mutex_unlock(&us->pt_mutex);
+    if (!result && copy_to_user(argp, &pt, sizeof(pt)))
+        result = -EFAULT;
+    return result;
 }
 
+static const struct file_operations storage_pt_fops = {
+    .owner          = THIS_MODULE,
+    .open           = storage_pt_open,
+    .release        = storage_pt_release,
+    .unlocked_ioctl = storage_pt_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .llseek         = noop_llseek,
+};
+
+static struct usb_class_driver storage_pt_class = {
+    .name       = "usb/usbsg%d",
+    .fops       = &storage_pt_fops,
+    .minor_base = STORAGE_PT_MINOR_BASE,
+};
+
 /* USB探测函数 */
 static int storage_probe(struct usb_interface *interface,
                         const struct usb_device_id *id)
@@ -303,19 +5186,60 @@ static int storage_probe(struct usb_interface *interface,
     /* 分配缓冲区 */
     us->cbw = kmalloc(sizeof(struct bulk_cb_wrap), GFP_KERNEL);
     us->csw = kmalloc(sizeof(struct bulk_cs_wrap), GFP_KERNEL);
-    us->data_buffer = kmalloc(512, GFP_KERNEL);
+    us->sense_buf = kmalloc(STORAGE_SENSE_LEN, GFP_KERNEL);
+    us->data_bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    us->stats = alloc_percpu(struct storage_stats);
+    us->cache_hash = kcalloc(1 << STORAGE_CACHE_HASH_BITS,
+                             sizeof(*us->cache_hash), GFP_KERNEL);
+    INIT_LIST_HEAD(&us->cache_lru);
+    
+    if (!us->cbw || !us->csw || !us->sense_buf || !us->data_bounce ||
+        !us->stats || !us->cache_hash)
+        goto error;
+    
+    /* 分配三个阶段的URB */
+    us->cbw_urb = usb_alloc_urb(0, GFP_KERNEL);
+    us->data_urb = usb_alloc_urb(0, GFP_KERNEL);
+    us->csw_urb = usb_alloc_urb(0, GFP_KERNEL);
     
-    if (!us->cbw || !us->csw || !us->data_buffer)
+    if (!us->cbw_urb || !us->data_urb || !us->csw_urb)
         goto error;
     
     /* 初始化 */
     us->udev = usb_get_dev(interface_to_usbdev(interface));
     us->interface = interface;
+    us->probe_time = ktime_get();
+    us->ready_ms = -1;
+    kref_init(&us->kref);
     mutex_init(&us->io_mutex);
+    mutex_init(&us->pt_mutex);
     init_completion(&us->command_done);
+    INIT_WORK(&us->scan_work, storage_scan_work);
+    INIT_WORK(&us->release_work, storage_release_work);
+    INIT_WORK(&us->reset_work, storage_reset_work);
+    init_waitqueue_head(&us->scan_wait);
+    spin_lock_init(&us->lock);
+    spin_lock_init(&us->cache_lock);
+    INIT_LIST_HEAD(&us->merge_list);
+    init_usb_anchor(&us->anchor);
+    timer_setup(&us->timer, storage_timeout, 0);
+    us->transport = &storage_bot_transport;
     
-    /* 查找批量端点 */
+    /* 接口有UAS备用设置时优先使用UAS */
+    result = storage_uas_init(us);
+    if (result == 0)
+        goto found;
+    if (result != -ENODEV)
+        dev_warn(&interface->dev, "UAS初始化失败，使用BOT: %d\n", result);
+    
+    /* BOT回退：当前设置必须是Bulk-Only */
     iface_desc = interface->cur_altsetting;
+    if (iface_desc->desc.bInterfaceProtocol != STORAGE_PR_BULK) {
+        result = -ENODEV;
+        goto error;
+    }
+    
+    /* 查找批量端点 */
     for (i = 0; i < iface_desc->desc.bNumEndpoints; i++) {
         endpoint = &iface_desc->endpoint[i].desc;
         
@@ -336,41 +5260,54 @@ static int storage_probe(struct usb_interface *interface,
         goto error;
     }
     
+found:
+    storage_ep_sizing(us);
+    
+    result = storage_bus_join(us);
+    if (result)
+        goto error;
+    
     /* 保存设备数据 */
     usb_set_intfdata(interface, us);
     
-    /* 初始化设备 */
-    result = storage_inquiry(us);
-    if (result)
+    /* LUN 0总是存在，通过它发现其他LUN */
+    result = -ENOMEM;
+    if (!storage_alloc_lun(us, 0))
         goto error_deregister;
     
-    /* 等待设备就绪 */
-    for (i = 0; i < 3; i++) {
-        result = storage_test_unit_ready(us);
-        if (result == 0)
-            break;
-        msleep(1000);
-    }
+    storage_debugfs_init(us);
     
-    if (result) {
-        dev_err(&interface->dev, "设备未就绪\n");
-        goto error_deregister;
-    }
+    /* 直通设备是可选的，注册失败不影响块设备 */
+    result = usb_register_dev(interface, &storage_pt_class);
+    if (result)
+        dev_warn(&interface->dev, "直通设备注册失败: %d\n", result);
+    else
+        us->pt_registered = true;
     
-    /* 读取容量 */
-    storage_read_capacity(us);
+    /* 等待就绪可能需要几秒，放到工作队列里做，不阻塞hub枚举其他设备 */
+    queue_work(storage_wq, &us->scan_work);
     
-    dev_info(&interface->dev, "USB存储设备已连接\n");
+    dev_info(&interface->dev, "USB存储设备已连接（%s）\n",
+             us->transport->name);
     
     return 0;
     
 error_deregister:
     usb_set_intfdata(interface, NULL);
+    storage_free_luns(us);
 error:
     if (us) {
+        storage_bus_leave(us);
+        storage_uas_free(us);
+        usb_free_urb(us->cbw_urb);
+        usb_free_urb(us->data_urb);
+        usb_free_urb(us->csw_urb);
         kfree(us->cbw);
         kfree(us->csw);
-        kfree(us->data_buffer);
+        kfree(us->sense_buf);
+        kfree(us->data_bounce);
+        storage_cache_free(us);
+        free_percpu(us->stats);
         usb_put_dev(us->udev);
         kfree(us);
     }
@@ -386,21 +5323,250 @@ static void storage_disconnect(struct usb_interface *interface)
         return;
     
     usb_set_intfdata(interface, NULL);
+    if (us->pt_registered)
+        usb_deregister_dev(interface, &storage_pt_class);
+    
+    /* 停止识别工作，正在执行的命令会正常完成或超时 */
+    WRITE_ONCE(us->scan_abort, true);
+    wake_up(&us->scan_wait);
+    cancel_work_sync(&us->scan_work);
+    debugfs_remove_recursive(us->debugfs);
+    
+    /*
+     * 注销块设备之前先挡住直通命令。拿不到锁说明有直通命令还在等
+     * 设备，先停止状态机让它以-ENODEV结束，不等各阶段超时
+     */
+    if (!mutex_trylock(&us->pt_mutex)) {
+        storage_stop(us);
+        mutex_lock(&us->pt_mutex);
+    }
+    us->pt_gone = true;
+    mutex_unlock(&us->pt_mutex);
+    
+    /* 再注销块设备，最后结束所有命令 */
+    storage_remove_luns(us);
+    storage_stop(us);
+    
+    storage_bus_leave(us);
+    storage_free_luns(us);
     
     /* 释放资源 */
+    storage_uas_free(us);
+    usb_free_urb(us->cbw_urb);
+    usb_free_urb(us->data_urb);
+    usb_free_urb(us->csw_urb);
     kfree(us->cbw);
     kfree(us->csw);
-    kfree(us->data_buffer);
-    usb_put_dev(us->udev);
-    kfree(us);
+    kfree(us->sense_buf);
+    kfree(us->data_bounce);
+    storage_cache_free(us);
+    free_percpu(us->stats);
+    
+    /* 直通设备还开着时由最后一次close释放 */
+    kref_put(&us->kref, storage_delete);
     
     dev_info(&interface->dev, "USB存储设备已断开\n");
 }
 
+/* sysfs: 合并后单条读写命令的上限（KB） */
+static ssize_t max_transfer_kb_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    
+    return sysfs_emit(buf, "%u\n", READ_ONCE(us->max_transfer_kb));
+}
+
+static ssize_t max_transfer_kb_store(struct device *dev,
+                                     struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    unsigned int val;
+    int result;
+    
+    result = kstrtouint(buf, 0, &val);
+    if (result)
+        return result;
+    if (val == 0 || val > STORAGE_MAX_TRANSFER_KB_MAX)
+        return -EINVAL;
+    
+    WRITE_ONCE(us->max_transfer_kb, val);
+    return count;
+}
+static DEVICE_ATTR_RW(max_transfer_kb);
+
+/* sysfs: 合并统计，merge_ratio = 请求数/命令数 */
+static ssize_t merge_stats_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    u64 requests = atomic64_read(&us->merge_requests);
+    u64 transfers = atomic64_read(&us->merge_transfers);
+    u64 bytes = atomic64_read(&us->merge_bytes);
+    u64 ratio = transfers ? div64_u64(requests * 100, transfers) : 0;
+    
+    return sysfs_emit(buf,
+                      "requests %llu\n"
+                      "transfers %llu\n"
+                      "bytes %llu\n"
+                      "merge_ratio %llu.%02llu\n"
+                      "avg_transfer_kb %llu\n"
+                      "discard_commands %llu\n"
+                      "discard_ranges %llu\n",
+                      requests, transfers, bytes,
+                      ratio / 100, ratio % 100,
+                      transfers ? div64_u64(bytes, transfers) >> 10 : 0,
+                      (u64)atomic64_read(&us->discard_cmds),
+                      (u64)atomic64_read(&us->discard_ranges));
+}
+static DEVICE_ATTR_RO(merge_stats);
+
+/* sysfs: 写合并统计，write_amplification = 写回字节数/合并的写入字节数 */
+static ssize_t wc_stats_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    u64 host = atomic64_read(&us->wc_host_bytes);
+    u64 written = atomic64_read(&us->wc_dev_bytes);
+    u64 wa = host ? div64_u64(written * 100, host) : 0;
+    
+    return sysfs_emit(buf,
+                      "chunk_kb %u\n"
+                      "host_bytes %llu\n"
+                      "device_bytes %llu\n"
+                      "fill_bytes %llu\n"
+                      "write_amplification %llu.%02llu\n"
+                      "flush_deadline %llu\n"
+                      "flush_evict %llu\n"
+                      "flush_sync %llu\n"
+                      "full_chunks %llu\n"
+                      "errors %llu\n",
+                      wc_chunk_kb ? roundup_pow_of_two(clamp(wc_chunk_kb,
+                              STORAGE_WC_MIN_KB, STORAGE_WC_MAX_KB)) : 0,
+                      host, written,
+                      (u64)atomic64_read(&us->wc_fill_bytes),
+                      wa / 100, wa % 100,
+                      (u64)atomic64_read(&us->wc_flushes[STORAGE_WC_DEADLINE]),
+                      (u64)atomic64_read(&us->wc_flushes[STORAGE_WC_EVICT]),
+                      (u64)atomic64_read(&us->wc_flushes[STORAGE_WC_SYNC]),
+                      (u64)atomic64_read(&us->wc_full_chunks),
+                      (u64)atomic64_read(&us->wc_errors));
+}
+static DEVICE_ATTR_RO(wc_stats);
+
+/* sysfs: 从probe到所有LUN注册块设备的毫秒数，识别未完成时为-1 */
+static ssize_t time_to_ready_ms_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    
+    return sysfs_emit(buf, "%lld\n", READ_ONCE(us->ready_ms));
+}
+static DEVICE_ATTR_RO(time_to_ready_ms);
+
+/* sysfs: 按端点描述符计算的传输大小 */
+static ssize_t transfer_sizing_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    
+    return sysfs_emit(buf,
+                      "speed %s\n"
+                      "max_packet %u\n"
+                      "max_burst %u\n"
+                      "align_bytes %u\n"
+                      "preferred_kb %u\n",
+                      usb_speed_string(us->udev->speed), us->ep_maxp,
+                      us->ep_burst, us->xfer_align, us->pref_transfer_kb);
+}
+static DEVICE_ATTR_RO(transfer_sizing);
+
+/* sysfs: 总线调度的权重，和同一组的其他设备按比例分带宽 */
+static ssize_t bus_weight_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    
+    return sysfs_emit(buf, "%u\n", READ_ONCE(us->bus_weight));
+}
+
+static ssize_t bus_weight_store(struct device *dev,
+                                struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    unsigned long flags;
+    unsigned int val;
+    int result;
+    
+    result = kstrtouint(buf, 0, &val);
+    if (result)
+        return result;
+    if (val == 0 || val > STORAGE_BUS_WEIGHT_MAX)
+        return -EINVAL;
+    
+    spin_lock_irqsave(&us->bus->lock, flags);
+    us->bus_weight = val;
+    spin_unlock_irqrestore(&us->bus->lock, flags);
+    return count;
+}
+static DEVICE_ATTR_RW(bus_weight);
+
+/* sysfs: 总线调度状态，group是设备所在的组（根端口，有TT时加上TT） */
+static ssize_t bus_stats_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    struct usb_storage *us = usb_get_intfdata(to_usb_interface(dev));
+    struct storage_bus *bus = us->bus;
+    struct usb_storage *m;
+    unsigned int members = 0, waiting = 0;
+    u64 inflight, bus_inflight, throttled, bytes;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&bus->lock, flags);
+    list_for_each_entry(m, &bus->devices, bus_node)
+        members++;
+    list_for_each_entry(m, &bus->waiters, bus_wait)
+        waiting++;
+    inflight = us->bus_inflight;
+    bus_inflight = bus->inflight;
+    throttled = us->bus_throttled;
+    bytes = us->bus_bytes;
+    spin_unlock_irqrestore(&bus->lock, flags);
+    
+    return sysfs_emit(buf,
+                      "group %d-%d%s\n"
+                      "members %u\n"
+                      "waiting %u\n"
+                      "inflight_kb %llu\n"
+                      "group_inflight_kb %llu\n"
+                      "throttled %llu\n"
+                      "bytes %llu\n",
+                      bus->bus->busnum, bus->port, bus->tt ? " tt" : "",
+                      members, waiting, inflight >> 10, bus_inflight >> 10,
+                      throttled, bytes);
+}
+static DEVICE_ATTR_RO(bus_stats);
+
+static struct attribute *storage_attrs[] = {
+    &dev_attr_max_transfer_kb.attr,
+    &dev_attr_bus_weight.attr,
+    &dev_attr_bus_stats.attr,
+    &dev_attr_merge_stats.attr,
+    &dev_attr_wc_stats.attr,
+    &dev_attr_time_to_ready_ms.attr,
+    &dev_attr_transfer_sizing.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(storage);
+
 /* USB设备ID表 */
 static const struct usb_device_id storage_id_table[] = {
     /* Bulk-Only传输，SCSI透明命令集 */
     { USB_INTERFACE_INFO(USB_CLASS_MASS_STORAGE, 0x06, 0x50) },
+    /* USB Attached SCSI */
+    { USB_INTERFACE_INFO(USB_CLASS_MASS_STORAGE, 0x06, 0x62) },
     { }  /* 终止符 */
 };
 MODULE_DEVICE_TABLE(usb, storage_id_table);
@@ -411,9 +5577,55 @@ static struct usb_driver storage_driver = {
     .probe      = storage_probe,
     .disconnect = storage_disconnect,
     .id_table   = storage_id_table,
+    .dev_groups = storage_groups,
 };
 
-module_usb_driver(storage_driver);
+/* 模块初始化 */
+static int __init storage_init(void)
+{
+    int retval;
+    
+    /* 注册块设备主设备号（动态分配） */
+    storage_major = register_blkdev(0, "usbs");
+    if (storage_major < 0)
+        return storage_major;
+    
+    /* 识别和错误恢复工作不绑定CPU，多个设备可以同时等待就绪 */
+    storage_wq = alloc_workqueue("usbs", WQ_UNBOUND, 0);
+    if (!storage_wq) {
+        unregister_blkdev(storage_major, "usbs");
+        return -ENOMEM;
+    }
+    
+    storage_debugfs_root = debugfs_create_dir("usb_storage_simple", NULL);
+    debugfs_create_file("profiles", 0444, storage_debugfs_root, NULL,
+                        &storage_profiles_fops);
+    
+    /* 注册USB驱动 */
+    retval = usb_register(&storage_driver);
+    if (retval) {
+        debugfs_remove_recursive(storage_debugfs_root);
+        destroy_workqueue(storage_wq);
+        unregister_blkdev(storage_major, "usbs");
+        return retval;
+    }
+    
+    return 0;
+}
+
+/* 模块退出 */
+static void __exit storage_exit(void)
+{
+    usb_deregister(&storage_driver);
+    debugfs_remove_recursive(storage_debugfs_root);
+    storage_profile_clear();
+    destroy_workqueue(storage_wq);
+    unregister_blkdev(storage_major, "usbs");
+    ida_destroy(&storage_index_ida);
+}
+
+module_init(storage_init);
+module_exit(storage_exit);
 
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("简化的USB存储驱动示例");